@@ -0,0 +1,9 @@
+(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(define count-down (lambda (n acc) (if (< n 1) acc (count-down (- n 1) (+ acc 1)))))
+(define safe (lambda (col dist placed) (if (null placed) true (if (or (= col (car placed)) (= (+ col dist) (car placed)) (= (- col dist) (car placed))) false (safe col (+ dist 1) (cdr placed))))))
+(define try-cols (lambda (n col placed count) (if (< col n) (try-cols n (+ col 1) placed (if (safe col 1 placed) (queens n (cons col placed) count) count)) count)))
+(define queens (lambda (n placed count) (if (= (length placed) n) (+ count 1) (try-cols n 0 placed count))))
+(perf-stat (fib 24))
+(perf-stat (count-down 1000000 0))
+(perf-stat (queens 7 () 0))
+(exit)
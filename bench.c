@@ -0,0 +1,422 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "lisp.h"
+#include "embed.h"
+
+/* Get the processor time in seconds since start.
+ */
+double seconds_since(clock_t start) {
+	return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+/* Measure reader throughput on generated data resembling a large data
+ * file of records with symbols, numbers and strings.
+ */
+void bench_reader(void) {
+	const size_t records = 200000;
+	const int rounds = 5;
+	struct buffer text = {NULL, 0, 0};
+	char line[200];
+	clock_t start;
+	double elapsed;
+	size_t i;
+	int r;
+	buffer_putc(&text, '(');
+	for (i = 0; i < records; ++i) {
+		sprintf(line,
+			"(record-%lu %lu %.3f \"name of record %lu\" (tag-a tag-b) -%lue-3)\n",
+			(unsigned long) i % 1000,
+			(unsigned long) i,
+			i / 7.0,
+			(unsigned long) i,
+			(unsigned long) i % 97);
+		buffer_puts(&text, line);
+	}
+	buffer_putc(&text, ')');
+	start = clock();
+	for (r = 0; r < rounds; ++r) {
+		const char *endptr;
+		read_expr(text.data, &endptr);
+		if (thread.error != ERR_NONE || *endptr) {
+			fprintf(stderr, "Reader benchmark failed to parse!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	elapsed = seconds_since(start);
+	printf("reader: %.1f MB in %.3f s, %.1f MB/s\n",
+	       rounds * text.len / 1e6,
+	       elapsed,
+	       rounds * text.len / 1e6 / elapsed);
+	free(text.data);
+}
+
+/* Evaluate a string of lisp code.
+ */
+struct expr *eval_string(const char *src) {
+	const char *endptr;
+	struct expr *result = eval_expr(read_expr(src, &endptr));
+	if (thread.error != ERR_NONE || *endptr) {
+		fprintf(stderr, "Benchmark failed to evaluate %s!\n", src);
+		exit(EXIT_FAILURE);
+	}
+	return result;
+}
+
+/* Measure calls of a numeric function, interpreted and compiled.
+ */
+void bench_fib(void) {
+	clock_t start;
+	eval_string("(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))");
+	globals.jit = 0;
+	start = clock();
+	eval_string("(fib 20)");
+	printf("fib 20, interpreted: %.3f s\n", seconds_since(start));
+	globals.jit = 1;
+	start = clock();
+	eval_string("(fib 20)");
+	printf("fib 20, compiled: %.3f s\n", seconds_since(start));
+	start = clock();
+	eval_string("(fib 30)");
+	printf("fib 30, compiled: %.3f s\n", seconds_since(start));
+}
+
+/* Measure the overhead of tracing on interpreted calls.
+ */
+void bench_trace(void) {
+	clock_t start;
+	globals.jit = 0;
+	start = clock();
+	eval_string("(fib 22)");
+	printf("fib 22, interpreted: %.3f s\n", seconds_since(start));
+	eval_string("(trace true)");
+	start = clock();
+	eval_string("(fib 22)");
+	printf("fib 22, interpreted and traced: %.3f s\n", seconds_since(start));
+	eval_string("(trace false)");
+	globals.jit = 1;
+}
+
+/* Measure calls of a rule from C, by evaluating source text and through
+ * a function handle.
+ */
+void bench_embed(void) {
+	const int calls = 100000;
+	lisp_value *rule;
+	lisp_value *args[2];
+	clock_t start;
+	int i;
+	eval_string("(define rule (lambda (x y) (if (< x y) (list x y) (list y x))))");
+	start = clock();
+	for (i = 0; i < calls; ++i) {
+		eval_string("(rule 3 4)");
+	}
+	printf("rule, %d calls from source: %.3f s\n", calls, seconds_since(start));
+	rule = lisp_lookup("rule");
+	args[0] = lisp_number(3);
+	args[1] = lisp_number(4);
+	start = clock();
+	for (i = 0; i < calls; ++i) {
+		lisp_release(lisp_call(rule, 2, args));
+	}
+	printf("rule, %d calls through a handle: %.3f s\n", calls, seconds_since(start));
+	lisp_release(args[0]);
+	lisp_release(args[1]);
+	lisp_release(rule);
+}
+
+/* Measure reading the lines of a generated log file.
+ */
+void bench_lines(void) {
+	const char *path = "bench-lines.txt";
+	const size_t lines = 1000000;
+	struct buffer text = {NULL, 0, 0};
+	char line[200];
+	FILE *file;
+	clock_t start;
+	double elapsed;
+	size_t i;
+	for (i = 0; i < lines; ++i) {
+		sprintf(line,
+			"2024-01-01T00:00:%02lu host-%lu GET /path/%lu 200 %lu\n",
+			(unsigned long) i % 60,
+			(unsigned long) i % 16,
+			(unsigned long) i,
+			(unsigned long) i * 7 % 5000);
+		buffer_puts(&text, line);
+	}
+	file = fopen(path, "w");
+	fwrite(text.data, 1, text.len, file);
+	fclose(file);
+	eval_string("(define count 0)");
+	start = clock();
+	eval_string("(for-each-line (open-input-file \"bench-lines.txt\")"
+		    " (lambda (line) (define count (+ count 1))))");
+	elapsed = seconds_since(start);
+	printf("for-each-line: %.1f MB in %.3f s, %.1f MB/s\n",
+	       text.len / 1e6, elapsed, text.len / 1e6 / elapsed);
+	start = clock();
+	eval_string("(read-lines (open-input-file \"bench-lines.txt\"))");
+	elapsed = seconds_since(start);
+	printf("read-lines: %.1f MB in %.3f s, %.1f MB/s\n",
+	       text.len / 1e6, elapsed, text.len / 1e6 / elapsed);
+	remove(path);
+	free(text.data);
+}
+
+/* Measure passing values from a generator to its consumer, which
+ * switches between them twice for every value, compared to a loop
+ * producing the values and a loop consuming them.
+ */
+void bench_generators(void) {
+	const long values = 20000;
+	char src[160];
+	clock_t start;
+	double elapsed;
+	eval_string("(define upto (lambda (n max) (if (< max n) () ((lambda (y) (upto (+ n 1) max)) (yield n)))))");
+	eval_string("(define count-upto (lambda (n max) (if (< max n) () ((lambda (y) (count-upto (+ n 1) max)) n))))");
+	eval_string("(define fold-upto (lambda (acc n max) (if (< max n) acc ((lambda (x) (fold-upto (+ acc x) (+ n 1) max)) n))))");
+	sprintf(src, "(count-upto 1 %ld)", values);
+	start = clock();
+	eval_string(src);
+	elapsed = seconds_since(start);
+	printf("loop of %ld: %.3f s\n", values, elapsed);
+	sprintf(src, "(fold-upto 0 1 %ld)", values);
+	start = clock();
+	eval_string(src);
+	elapsed = seconds_since(start);
+	printf("fold of %ld: %.3f s\n", values, elapsed);
+	sprintf(src, "(generator-fold + 0 (make-generator (lambda () (upto 1 %ld))))", values);
+	start = clock();
+	eval_string(src);
+	elapsed = seconds_since(start);
+	printf("generator of %ld: %.3f s, %.0f ns per value\n",
+	       values, elapsed, elapsed / values * 1e9);
+}
+
+/* Measure reloading a program of derived definitions, by evaluating all
+ * of them and by redefining one function they use, see depend.c.
+ */
+void bench_reload(void) {
+	const int functions = 100;
+	const int definitions = 5000;
+	char src[160];
+	clock_t start;
+	int i;
+	for (i = 0; i < functions; ++i) {
+		sprintf(src, "(define reload-f%d (lambda (x) (+ x %d)))", i, i);
+		eval_string(src);
+	}
+	start = clock();
+	for (i = 0; i < definitions; ++i) {
+		sprintf(src, "(define reload-d%d (reload-f%d %d))", i, i % functions, i);
+		eval_string(src);
+	}
+	printf("%d definitions: %.3f s\n", definitions, seconds_since(start));
+	start = clock();
+	eval_string("(define reload-f0 (lambda (x) (- x 1)))");
+	for (i = 0; i < definitions; ++i) {
+		sprintf(src, "reload-d%d", i);
+		eval_string(src);
+	}
+	printf("%d definitions after redefining one function: %.3f s\n",
+	       definitions, seconds_since(start));
+}
+
+/* Run a chain of list functions with and without fusion, measuring time
+ * and bytes of expressions allocated.
+ */
+void bench_chain(const char *name, const char *src) {
+	int fuse;
+	for (fuse = 0; fuse < 2; ++fuse) {
+		size_t heap = thread.heap;
+		clock_t start;
+		double elapsed;
+		globals.fuse = fuse;
+		start = clock();
+		eval_string(src);
+		elapsed = seconds_since(start);
+		printf("%s, %s: %.3f s, %lu bytes allocated\n",
+		       name, fuse ? "fused" : "unfused", elapsed,
+		       (unsigned long) (thread.heap - heap));
+	}
+}
+
+/* Measure the intermediate lists saved by fusing chains of list
+ * functions, see fuse.c.
+ */
+void bench_fusion(void) {
+	eval_string("(define iota (lambda (n acc) (if (< n 1) acc (iota (- n 1) (cons n acc)))))");
+	eval_string("(define nums (iota 2000 ()))");
+	bench_chain("sum of map of map of 2000",
+		    "(apply + (map (lambda (x) (* x x)) (map (lambda (x) (+ x 1)) nums)))");
+	bench_chain("length of 2000", "(length nums)");
+	bench_chain("fold of filter of map of 2000",
+		    "(fold + 0 (filter (lambda (x) (< 100 x)) (map (lambda (x) (* 2 x)) nums)))");
+	bench_chain("map of filter of 2000",
+		    "(map (lambda (x) (* x x)) (filter (lambda (x) (< x 10000)) nums))");
+	globals.fuse = 1;
+}
+
+/* Measure repeated top-level evaluations that allocate lists, with and
+ * without regions, see region.c.
+ */
+void bench_regions(void) {
+	const int evaluations = 20;
+	int regions;
+	globals.fuse = 0;
+	for (regions = 0; regions < 2; ++regions) {
+		size_t heap = thread.heap;
+		clock_t start;
+		int i;
+		globals.regions = regions;
+		start = clock();
+		for (i = 0; i < evaluations; ++i) {
+			region_begin();
+			eval_string("(length (map (lambda (x) (* x x)) (map (lambda (x) (+ x 1)) nums)))");
+			region_end(NULL);
+		}
+		printf("%d evaluations of map of map of 2000, %s: %.3f s, %lu bytes kept\n",
+		       evaluations, regions ? "in regions" : "on the heap",
+		       seconds_since(start), (unsigned long) (thread.heap - heap));
+	}
+	globals.regions = 0;
+	globals.fuse = 1;
+}
+
+/* Measure calls of a foreign function against calls of a builtin, see
+ * ffi.c.
+ */
+void bench_ffi(void) {
+	clock_t start;
+	eval_string("(define ffi-pow (ffi-func (ffi-load \"libm.so.6\") \"pow\" '(double double) 'double))");
+	eval_string("(define ffi-loop (lambda (f n acc) (if (< n 1) acc (ffi-loop f (- n 1) (+ acc (f 2 3))))))");
+	start = clock();
+	eval_string("(ffi-loop ^ 100000 0)");
+	printf("100000 calls of builtin ^: %.3f s\n", seconds_since(start));
+	start = clock();
+	eval_string("(ffi-loop ffi-pow 100000 0)");
+	printf("100000 calls of foreign pow: %.3f s\n", seconds_since(start));
+}
+
+/* Measure parallel fib and n-queens with futures, for numbers of worker
+ * threads up to twice the number of processors.
+ */
+void bench_futures(void) {
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	long workers;
+	char src[32];
+	clock_t start;
+	double elapsed;
+	struct timespec t0;
+	struct timespec t1;
+	globals.jit = 0;
+	eval_string("(define pfib (lambda (n) (if (< n 15) (fib n) ((lambda (a b) (+ (touch a) b)) (future (pfib (- n 1))) (pfib (- n 2))))))");
+	eval_string("(define safe (lambda (row dist placed) (if (null placed) true (if (or (= (car placed) row) (= (car placed) (+ row dist)) (= (car placed) (- row dist))) false (safe row (+ dist 1) (cdr placed))))))");
+	eval_string("(define queens (lambda (n col placed) (if (= col n) 1 (queens-rows n col placed 0))))");
+	eval_string("(define queens-rows (lambda (n col placed row) (if (= row n) 0 (+ (if (safe row 1 placed) (queens n (+ col 1) (cons row placed)) 0) (queens-rows n col placed (+ row 1))))))");
+	eval_string("(define range (lambda (a b) (if (< a b) (cons a (range (+ a 1) b)) ())))");
+	eval_string("(define pqueens (lambda (n) (apply + (map touch (map (lambda (row) (future (queens n 1 (list row)))) (range 0 n))))))");
+	for (workers = 0; workers <= 2 * processors; workers = workers ? 2 * workers : 1) {
+		sprintf(src, "(workers %ld)", workers);
+		eval_string(src);
+		/* wall clock time, since the processor time of all threads
+		   is counted */
+		start = clock();
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		eval_string("(pfib 25)");
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		elapsed = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		printf("pfib 25, %ld workers: %.3f s, %.3f s processor time\n",
+		       workers, elapsed, seconds_since(start));
+		start = clock();
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		eval_string("(pqueens 8)");
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		elapsed = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		printf("pqueens 8, %ld workers: %.3f s, %.3f s processor time\n",
+		       workers, elapsed, seconds_since(start));
+	}
+	eval_string("(workers 0)");
+	globals.jit = 1;
+}
+
+#define BENCH_SYMBOLS 200000
+#define BENCH_SYMBOL_SAVES 2000000
+
+/* Names saved by bench_symbols, and the number of threads saving them. */
+static char symbol_names[BENCH_SYMBOLS][SYMBOL_MAXLEN];
+static long symbol_threads;
+
+/* Save a share of the names, each about ten times, starting at a
+ * different name in each thread.
+ */
+void *save_symbol_names(void *arg) {
+	long t = (long) arg;
+	long saves = BENCH_SYMBOL_SAVES / symbol_threads;
+	long i;
+	for (i = 0; i < saves; ++i) {
+		save_symbol(symbol_names[(i * 7 + t * 7919) % BENCH_SYMBOLS]);
+	}
+	return NULL;
+}
+
+/* Measure symbol saving from many threads, for numbers of threads up to
+ * twice the number of processors. A tenth of the saves are of new names.
+ */
+void bench_symbols(void) {
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[256];
+	struct timespec t0;
+	struct timespec t1;
+	double elapsed;
+	long i;
+	for (symbol_threads = 1;
+	     symbol_threads <= 2 * processors && symbol_threads <= 256;
+	     symbol_threads *= 2) {
+		for (i = 0; i < BENCH_SYMBOLS; ++i) {
+			sprintf(symbol_names[i], "t%ld-name-%ld", symbol_threads, i);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < symbol_threads; ++i) {
+			pthread_create(&threads[i], NULL, save_symbol_names, (void *) i);
+		}
+		for (i = 0; i < symbol_threads; ++i) {
+			pthread_join(threads[i], NULL);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		elapsed = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		printf("symbols, %ld threads: %d saves in %.3f s, %.1f M/s\n",
+		       symbol_threads, BENCH_SYMBOL_SAVES, elapsed,
+		       BENCH_SYMBOL_SAVES / elapsed / 1e6);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1) {
+		fprintf(stderr, "No args expected, got: %s ...", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	init_globals();
+	bench_reader();
+	bench_symbols();
+	bench_fib();
+	bench_trace();
+	bench_embed();
+	bench_lines();
+	bench_generators();
+	bench_ffi();
+	bench_futures();
+	/* last, since these leave much garbage */
+	bench_reload();
+	bench_fusion();
+	bench_regions();
+	return 0;
+}
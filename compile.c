@@ -0,0 +1,1027 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include "lisp.h"
+
+/* An ahead-of-time compiler from Lisp source to C.
+ *
+ * Every top-level definition of a lambda with a fixed number of
+ * parameters becomes a C function, which the generated program defines
+ * as a builtin when it starts. The other top-level forms are kept as
+ * source text and evaluated by the interpreter in their order in the
+ * file, printing the values of the forms that are not definitions.
+ *
+ * Parameters, and variables bound by ((lambda (x ...) body) value ...),
+ * are C variables. Calls of compiled functions are direct C calls, the
+ * arithmetic and list builtins are inlined with a fast path for numbers
+ * and pairs, other builtins are called directly, and calls of a function
+ * to itself in tail position become loops. Forms the compiler does not
+ * handle, such as nested lambdas, are evaluated by the interpreter after
+ * substituting the variables in scope, like bind_lambda does.
+ *
+ * Global names are resolved when compiling, so redefining a builtin or a
+ * compiled function at run time does not change the compiled calls of
+ * it. Compiled code does not use evaluation fuel, and calls other than
+ * self tail calls use the C stack.
+ */
+
+/* The line length of the generated code, not counting indentation. */
+#define COMPILE_LINE_MAXLEN 256
+
+/* A top-level function compiled to C. */
+struct function {
+	const char *name;
+	struct expr *params;
+	struct expr *body;
+	unsigned int arity;
+};
+
+/* A variable bound to a C variable, see compile_expr. */
+struct binding {
+	const char *symbol;
+	unsigned int temp;
+};
+
+/* A top-level form, with its source text. */
+struct form {
+	struct expr *e;
+	const char *text;
+	size_t len;
+	/* the function it defines, or null */
+	struct function *function;
+};
+
+struct compiler {
+	struct form *forms;
+	size_t forms_count;
+	size_t forms_size;
+	/* names defined at the top level, which are never inlined */
+	const char **defined;
+	size_t defined_count;
+	size_t defined_size;
+	struct function *functions;
+	size_t functions_count;
+	/* symbols and constants used by the code, the arrays s and k of the
+	   generated program */
+	const char **symbols;
+	size_t symbols_count;
+	size_t symbols_size;
+	struct expr **constants;
+	size_t constants_count;
+	size_t constants_size;
+	/* the function being compiled and its variables */
+	struct function *self;
+	struct binding *scope;
+	size_t scope_count;
+	size_t scope_size;
+	unsigned int temps;
+	unsigned int labels;
+	/* the largest number of arguments passed through v */
+	unsigned int max_args;
+	int uses_args;
+	int loops;
+	unsigned int indent;
+	struct buffer code;
+	/* the definitions of the compiled functions */
+	struct buffer defs;
+};
+
+/* Inlined builtins and prelude functions. */
+enum intrinsic {
+	I_ADD,
+	I_SUB,
+	I_MUL,
+	I_DIV,
+	I_LT,
+	I_EQ,
+	I_GT,
+	I_LE,
+	I_GE,
+	I_CAR,
+	I_CDR,
+	I_CONS,
+	I_NULL,
+	I_NOT
+};
+
+static const struct {
+	const char *name;
+	enum intrinsic op;
+	unsigned int argc;
+	/* the C operator or builtin of the operation */
+	const char *c;
+} INTRINSICS[] = {
+	{"+", I_ADD, 2, "+"},
+	{"-", I_SUB, 2, "-"},
+	{"*", I_MUL, 2, "*"},
+	{"/", I_DIV, 2, "/"},
+	{"<", I_LT, 2, "<"},
+	{"=", I_EQ, 2, "=="},
+	{">", I_GT, 2, ">"},
+	{"<=", I_LE, 2, "<="},
+	{">=", I_GE, 2, ">="},
+	{"car", I_CAR, 1, "bi_car"},
+	{"cdr", I_CDR, 1, "bi_cdr"},
+	{"cons", I_CONS, 2, NULL},
+	{"null", I_NULL, 1, NULL},
+	{"not", I_NOT, 1, NULL}
+};
+
+static void *grow(void *array, size_t *size, size_t count, size_t elem)
+{
+	if (count == *size) {
+		*size = *size ? 2 * *size : 16;
+		array = realloc(array, *size * elem);
+		assert(array);
+	}
+	return array;
+}
+
+static void append(struct buffer *b, const char *format, ...)
+{
+	char line[COMPILE_LINE_MAXLEN];
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(line, sizeof line, format, ap);
+	va_end(ap);
+	buffer_puts(b, line);
+}
+
+/* Append a line of code to the function being compiled.
+ */
+static void emit(struct compiler *c, const char *format, ...)
+{
+	char line[COMPILE_LINE_MAXLEN];
+	unsigned int i;
+	va_list ap;
+	va_start(ap, format);
+	vsnprintf(line, sizeof line, format, ap);
+	va_end(ap);
+	for (i = 0; i < c->indent; ++i) {
+		buffer_putc(&c->code, '\t');
+	}
+	buffer_puts(&c->code, line);
+	buffer_putc(&c->code, '\n');
+}
+
+static void emit_check(struct compiler *c)
+{
+	emit(c, "if (thread.error != ERR_NONE) {");
+	emit(c, "\treturn NULL;");
+	emit(c, "}");
+}
+
+/* Write text as a C string literal. Characters other than printable ASCII
+ * are written as octal escapes.
+ */
+static void write_literal(FILE *f, const char *text, size_t len)
+{
+	size_t i;
+	putc('"', f);
+	for (i = 0; i < len; ++i) {
+		unsigned char ch = text[i];
+		if (ch == '"' || ch == '\\') {
+			fprintf(f, "\\%c", ch);
+		} else if (ch == '\n') {
+			fputs("\\n", f);
+		} else if (ch < ' ' || ch > '~') {
+			fprintf(f, "\\%03o", ch);
+		} else {
+			putc(ch, f);
+		}
+	}
+	putc('"', f);
+}
+
+/* The C name of a function compiled from a Lisp name: letters and digits
+ * are kept, an underscore is doubled and other characters are written as
+ * an underscore and two hex digits, so names do not collide. The name is
+ * valid until the next call.
+ */
+static const char *mangled(const char *prefix, const char *name)
+{
+	static char out[3 * SYMBOL_MAXLEN + 8];
+	char *p = out + sprintf(out, "%s", prefix);
+	for (; *name; ++name) {
+		unsigned char ch = *name;
+		if (isalnum(ch)) {
+			*p++ = ch;
+		} else if (ch == '_') {
+			p += sprintf(p, "__");
+		} else {
+			p += sprintf(p, "_%02x", ch);
+		}
+	}
+	*p = '\0';
+	return out;
+}
+
+static unsigned int symbol_index(struct compiler *c, const char *symbol)
+{
+	size_t i;
+	for (i = 0; i < c->symbols_count; ++i) {
+		if (c->symbols[i] == symbol) {
+			return i;
+		}
+	}
+	c->symbols = grow(c->symbols, &c->symbols_size,
+			  c->symbols_count, sizeof *c->symbols);
+	c->symbols[c->symbols_count] = symbol;
+	return c->symbols_count++;
+}
+
+static unsigned int constant_index(struct compiler *c, struct expr *e)
+{
+	c->constants = grow(c->constants, &c->constants_size,
+			    c->constants_count, sizeof *c->constants);
+	c->constants[c->constants_count] = e;
+	return c->constants_count++;
+}
+
+static int is_defined(struct compiler *c, const char *symbol)
+{
+	size_t i;
+	for (i = 0; i < c->defined_count; ++i) {
+		if (c->defined[i] == symbol) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static struct function *find_function(struct compiler *c, const char *symbol)
+{
+	size_t i;
+	for (i = 0; i < c->functions_count; ++i) {
+		if (c->functions[i].name == symbol) {
+			return &c->functions[i];
+		}
+	}
+	return NULL;
+}
+
+/* The C variable of a variable in scope, innermost first, or -1.
+ */
+static long lookup(struct compiler *c, const char *symbol)
+{
+	size_t i = c->scope_count;
+	while (i-- > 0) {
+		if (c->scope[i].symbol == symbol) {
+			return c->scope[i].temp;
+		}
+	}
+	return -1;
+}
+
+/* The value a global name had when compiling, if the code can not have
+ * changed it: it is not a variable in scope and not defined in the file.
+ */
+static struct expr *global_value(struct compiler *c, struct expr *e)
+{
+	struct variable *v;
+	if (!e || e->type != T_SYMBOL
+	    || lookup(c, e->data.symbol) >= 0
+	    || is_defined(c, e->data.symbol)) {
+		return NULL;
+	}
+	v = find_variable(e->data.symbol);
+	return v ? v->value : NULL;
+}
+
+/* Check whether e is a global builtin with the given function, or the
+ * given special form if func is null.
+ */
+static int is_builtin(struct compiler *c, struct expr *e, func_t func,
+		      enum special sf)
+{
+	struct expr *value = global_value(c, e);
+	return value && value->type == T_BUILTIN
+		&& value->data.builtin.spec_form == sf
+		&& value->data.builtin.func == func;
+}
+
+/* Whether a parameter list is a proper list of symbols. */
+static int fixed_params(struct expr *params)
+{
+	for (; params; params = params->data.pair.cdr) {
+		if (params->type != T_PAIR
+		    || !params->data.pair.car
+		    || params->data.pair.car->type != T_SYMBOL) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Whether an expression is a proper list. */
+static int is_list(struct expr *e)
+{
+	while (e && e->type == T_PAIR) {
+		e = e->data.pair.cdr;
+	}
+	return !e;
+}
+
+/* Whether a symbol occurs anywhere in an expression. */
+static int mentions(struct expr *e, const char *symbol)
+{
+	while (e && e->type == T_PAIR) {
+		if (mentions(e->data.pair.car, symbol)) {
+			return 1;
+		}
+		e = e->data.pair.cdr;
+	}
+	return e && e->type == T_SYMBOL && e->data.symbol == symbol;
+}
+
+static int mentions_scope(struct compiler *c, struct expr *e)
+{
+	size_t i;
+	for (i = 0; i < c->scope_count; ++i) {
+		if (mentions(e, c->scope[i].symbol)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static unsigned int new_temp(struct compiler *c)
+{
+	return c->temps++;
+}
+
+/* Finish a value: return it in tail position. */
+static unsigned int result(struct compiler *c, unsigned int t, int tail)
+{
+	if (tail) {
+		emit(c, "return t%u;", t);
+	}
+	return t;
+}
+
+static unsigned int compile_expr(struct compiler *c, struct expr *e, int tail);
+
+/* Evaluate an expression with the interpreter, substituting the
+ * variables in scope that it mentions, innermost first.
+ */
+static unsigned int compile_fallback(struct compiler *c, struct expr *e, int tail)
+{
+	unsigned int t = new_temp(c);
+	size_t i = c->scope_count;
+	emit(c, "t%u = k[%u];", t, constant_index(c, e));
+	while (i-- > 0) {
+		const char *symbol = c->scope[i].symbol;
+		if (mentions(e, symbol) && lookup(c, symbol) == c->scope[i].temp) {
+			emit(c, "t%u = replace_symbol(t%u, s[%u], t%u);",
+			     t, t, symbol_index(c, symbol), c->scope[i].temp);
+		}
+	}
+	emit(c, "t%u = eval_expr(t%u);", t, t);
+	emit_check(c);
+	return result(c, t, tail);
+}
+
+/* Compile the arguments of a call, returning an array of the C variables
+ * of their values, which the caller frees.
+ */
+static unsigned int *compile_args(struct compiler *c, struct expr *args,
+				  unsigned int argc)
+{
+	unsigned int *temps = calloc(argc + 1, sizeof *temps);
+	unsigned int i;
+	for (i = 0; i < argc; ++i, args = args->data.pair.cdr) {
+		temps[i] = compile_expr(c, args->data.pair.car, 0);
+	}
+	return temps;
+}
+
+/* Emit a direct call of a compiled function, storing its value in t.
+ */
+static void emit_call(struct compiler *c, unsigned int t, const char *name,
+		      unsigned int *args, unsigned int argc)
+{
+	char arg[NUMBER_MAXLEN];
+	unsigned int i;
+	for (i = 0; i < c->indent; ++i) {
+		buffer_putc(&c->code, '\t');
+	}
+	sprintf(arg, "t%u = ", t);
+	buffer_puts(&c->code, arg);
+	buffer_puts(&c->code, name);
+	buffer_putc(&c->code, '(');
+	for (i = 0; i < argc; ++i) {
+		sprintf(arg, "%st%u", i ? ", " : "", args[i]);
+		buffer_puts(&c->code, arg);
+	}
+	buffer_puts(&c->code, ");\n");
+	emit_check(c);
+}
+
+/* Store arguments in the array v, for calls through a function pointer.
+ */
+static void emit_argv(struct compiler *c, unsigned int *args, unsigned int argc)
+{
+	unsigned int i;
+	for (i = 0; i < argc; ++i) {
+		emit(c, "v[%u] = t%u;", i, args[i]);
+	}
+	c->uses_args = 1;
+	if (argc > c->max_args) {
+		c->max_args = argc;
+	}
+}
+
+static unsigned int compile_intrinsic(struct compiler *c, size_t op,
+				      unsigned int *args, int tail)
+{
+	unsigned int t = new_temp(c);
+	unsigned int a = args[0];
+	unsigned int b = INTRINSICS[op].argc > 1 ? args[1] : 0;
+	const char *cop = INTRINSICS[op].c;
+	switch (INTRINSICS[op].op) {
+	case I_ADD:
+	case I_SUB:
+	case I_MUL:
+	case I_DIV:
+	case I_LT:
+	case I_EQ:
+	case I_GT:
+	case I_LE:
+	case I_GE:
+		emit(c, "if (t%u && t%u && t%u->type == T_NUMBER && t%u->type == T_NUMBER) {",
+		     a, b, a, b);
+		if (INTRINSICS[op].op <= I_DIV) {
+			emit(c, "\tt%u = make_number(t%u->data.number %s t%u->data.number);",
+			     t, a, cop, b);
+		} else {
+			emit(c, "\tt%u = t%u->data.number %s t%u->data.number",
+			     t, a, cop, b);
+			emit(c, "\t\t? globals.TRUE : globals.FALSE;");
+		}
+		emit(c, "} else {");
+		++c->indent;
+		/* the builtin reports the type error */
+		emit_argv(c, args, 2);
+		emit(c, "t%u = %s(2, v);", t,
+		     INTRINSICS[op].op == I_ADD ? "bi_sum"
+		     : INTRINSICS[op].op == I_SUB ? "bi_diff"
+		     : INTRINSICS[op].op == I_MUL ? "bi_prod"
+		     : INTRINSICS[op].op == I_DIV ? "bi_quot"
+		     : INTRINSICS[op].op == I_EQ ? "bi_numeq" : "bi_numle");
+		emit_check(c);
+		--c->indent;
+		emit(c, "}");
+		break;
+	case I_CAR:
+	case I_CDR:
+		emit(c, "if (t%u && t%u->type == T_PAIR) {", a, a);
+		emit(c, "\tt%u = t%u->data.pair.%s;", t, a,
+		     INTRINSICS[op].op == I_CAR ? "car" : "cdr");
+		emit(c, "} else {");
+		++c->indent;
+		emit_argv(c, args, 1);
+		emit(c, "t%u = %s(1, v);", t, cop);
+		emit_check(c);
+		--c->indent;
+		emit(c, "}");
+		break;
+	case I_CONS:
+		emit(c, "t%u = make_pair(t%u, t%u);", t, a, b);
+		break;
+	case I_NULL:
+		emit(c, "t%u = t%u ? globals.FALSE : globals.TRUE;", t, a);
+		break;
+	case I_NOT:
+		emit(c, "switch (compiled_truth(t%u)) {", a);
+		emit(c, "case 1:");
+		emit(c, "\tt%u = globals.FALSE;", t);
+		emit(c, "\tbreak;");
+		emit(c, "case 0:");
+		emit(c, "\tt%u = globals.TRUE;", t);
+		emit(c, "\tbreak;");
+		emit(c, "default:");
+		emit(c, "\treturn NULL;");
+		emit(c, "}");
+		break;
+	}
+	free(args);
+	return result(c, t, tail);
+}
+
+static unsigned int compile_if(struct compiler *c, struct expr *args, int tail)
+{
+	unsigned int cond = compile_expr(c, args->data.pair.car, 0);
+	unsigned int t = tail ? 0 : new_temp(c);
+	int i;
+	args = args->data.pair.cdr;
+	emit(c, "switch (compiled_truth(t%u)) {", cond);
+	for (i = 1; i >= 0; --i, args = args->data.pair.cdr) {
+		emit(c, "case %d:", i);
+		++c->indent;
+		if (tail) {
+			compile_expr(c, args->data.pair.car, 1);
+		} else {
+			emit(c, "t%u = t%u;", t, compile_expr(c, args->data.pair.car, 0));
+			emit(c, "break;");
+		}
+		--c->indent;
+	}
+	emit(c, "default:");
+	emit(c, "\treturn NULL;");
+	emit(c, "}");
+	return t;
+}
+
+/* Compile and or or, which is true or false depending on whether one of
+ * the arguments is the truth value stop.
+ */
+static unsigned int compile_and_or(struct compiler *c, struct expr *args,
+				   int is_and, int tail)
+{
+	unsigned int t = new_temp(c);
+	unsigned int label = c->labels++;
+	const char *stop = is_and ? "globals.FALSE" : "globals.TRUE";
+	emit(c, "t%u = %s;", t, stop);
+	for (; args; args = args->data.pair.cdr) {
+		unsigned int arg = compile_expr(c, args->data.pair.car, 0);
+		emit(c, "if (compiled_is(t%u, %s)) {", arg, stop);
+		emit(c, "\tgoto l%u;", label);
+		emit(c, "}");
+	}
+	emit(c, "t%u = %s;", t, is_and ? "globals.TRUE" : "globals.FALSE");
+	emit(c, "l%u: ;", label);
+	return result(c, t, tail);
+}
+
+/* Compile ((lambda (x ...) body) value ...) by binding the variables.
+ */
+static unsigned int compile_let(struct compiler *c, struct expr *lambda,
+				struct expr *args, unsigned int argc, int tail)
+{
+	struct expr *params = lambda->data.pair.cdr->data.pair.car;
+	struct expr *body = lambda->data.pair.cdr->data.pair.cdr->data.pair.car;
+	unsigned int *temps = compile_args(c, args, argc);
+	size_t scope_count = c->scope_count;
+	unsigned int t;
+	unsigned int i;
+	for (i = 0; i < argc; ++i, params = params->data.pair.cdr) {
+		c->scope = grow(c->scope, &c->scope_size,
+				c->scope_count, sizeof *c->scope);
+		c->scope[c->scope_count].symbol = params->data.pair.car->data.symbol;
+		c->scope[c->scope_count].temp = temps[i];
+		++c->scope_count;
+		/* the variable may not be used */
+		emit(c, "(void) t%u;", temps[i]);
+	}
+	free(temps);
+	t = compile_expr(c, body, tail);
+	c->scope_count = scope_count;
+	return t;
+}
+
+static unsigned int compile_call(struct compiler *c, struct expr *e, int tail)
+{
+	struct expr *head = e->data.pair.car;
+	struct expr *args = e->data.pair.cdr;
+	unsigned int argc = list_length(args);
+	struct expr *value = global_value(c, head);
+	struct function *f = NULL;
+	unsigned int *temps;
+	unsigned int f_temp;
+	unsigned int t;
+	size_t i;
+
+	if (head && head->type == T_SYMBOL && lookup(c, head->data.symbol) < 0) {
+		f = find_function(c, head->data.symbol);
+	}
+	if (f && f->arity == argc) {
+		temps = compile_args(c, args, argc);
+		if (f == c->self && tail) {
+			/* the arguments may refer to the parameters */
+			t = c->temps;
+			for (i = 0; i < argc; ++i) {
+				emit(c, "t%u = t%u;", new_temp(c), temps[i]);
+			}
+			for (i = 0; i < argc; ++i) {
+				emit(c, "t%u = t%u;", (unsigned int) i, t + (unsigned int) i);
+			}
+			emit(c, "goto start;");
+			c->loops = 1;
+			free(temps);
+			return 0;
+		}
+		t = new_temp(c);
+		emit_call(c, t, mangled("f_", f->name), temps, argc);
+		free(temps);
+		return result(c, t, tail);
+	}
+	if (value && (value->type == T_LAMBDA
+		      || (value->type == T_BUILTIN
+			  && value->data.builtin.spec_form == SF_NONE))) {
+		for (i = 0; i < sizeof INTRINSICS / sizeof *INTRINSICS; ++i) {
+			if (head->data.symbol == save_symbol(INTRINSICS[i].name)
+			    && argc == INTRINSICS[i].argc) {
+				return compile_intrinsic(c, i, compile_args(c, args, argc),
+							 tail);
+			}
+		}
+	}
+	if (value && value->type == T_BUILTIN) {
+		switch (value->data.builtin.spec_form) {
+		case SF_NONE:
+			/* by the name declared in lisp.h */
+			for (i = 0; i < BUILTIN_DEFS_COUNT; ++i) {
+				if (value->data.builtin.func == BUILTIN_DEFS[i].func) {
+					temps = compile_args(c, args, argc);
+					t = new_temp(c);
+					emit_argv(c, temps, argc);
+					free(temps);
+					emit(c, "t%u = %s(%u, v);", t, BUILTIN_DEFS[i].c_name, argc);
+					emit_check(c);
+					return result(c, t, tail);
+				}
+			}
+			break;
+		case SF_QUOTED:
+			if (value->data.builtin.func == bi_quote && argc == 1
+			    && !mentions_scope(c, args->data.pair.car)) {
+				t = new_temp(c);
+				if (args->data.pair.car) {
+					emit(c, "t%u = k[%u];", t,
+					     constant_index(c, args->data.pair.car));
+				} else {
+					emit(c, "t%u = NULL;", t);
+				}
+				return result(c, t, tail);
+			}
+			return compile_fallback(c, e, tail);
+		case SF_IF:
+			if (argc == 3) {
+				return compile_if(c, args, tail);
+			}
+			return compile_fallback(c, e, tail);
+		case SF_AND:
+		case SF_OR:
+			return compile_and_or(c, args,
+					      value->data.builtin.spec_form == SF_AND,
+					      tail);
+		default:
+			return compile_fallback(c, e, tail);
+		}
+	} else if (head && head->type == T_PAIR
+		   && is_builtin(c, head->data.pair.car, bi_lambda, SF_QUOTED)
+		   && list_length(head) == 3
+		   && fixed_params(list_index(head, 1))
+		   && list_length(list_index(head, 1)) == argc) {
+		return compile_let(c, head, args, argc, tail);
+	}
+
+	/* call whatever the head evaluates to */
+	f_temp = compile_expr(c, head, 0);
+	temps = compile_args(c, args, argc);
+	emit_argv(c, temps, argc);
+	free(temps);
+	t = new_temp(c);
+	emit(c, "t%u = apply_function(t%u, %u, v);", t, f_temp, argc);
+	emit_check(c);
+	return result(c, t, tail);
+}
+
+/* Compile an expression, storing its value in a new C variable, whose
+ * number is returned. In tail position the value is returned from the
+ * function instead.
+ */
+static unsigned int compile_expr(struct compiler *c, struct expr *e, int tail)
+{
+	unsigned int t;
+	long var;
+	if (!e) {
+		t = new_temp(c);
+		emit(c, "t%u = NULL;", t);
+		return result(c, t, tail);
+	}
+	switch (e->type) {
+	case T_SYMBOL:
+		var = lookup(c, e->data.symbol);
+		if (var >= 0) {
+			return result(c, var, tail);
+		} else {
+			t = new_temp(c);
+			emit(c, "t%u = get_variable(s[%u]);", t,
+			     symbol_index(c, e->data.symbol));
+			emit_check(c);
+		}
+		return result(c, t, tail);
+	case T_PAIR:
+		if (!is_list(e->data.pair.cdr)) {
+			/* an improper list, left to the interpreter */
+			return compile_fallback(c, e, tail);
+		}
+		return compile_call(c, e, tail);
+	default:
+		t = new_temp(c);
+		emit(c, "t%u = k[%u];", t, constant_index(c, e));
+		return result(c, t, tail);
+	}
+}
+
+/* Compile a top-level function into the definitions.
+ */
+static void compile_function(struct compiler *c, struct function *f)
+{
+	struct expr *param = f->params;
+	unsigned int i;
+	c->self = f;
+	c->scope_count = 0;
+	for (i = 0; i < f->arity; ++i, param = param->data.pair.cdr) {
+		c->scope = grow(c->scope, &c->scope_size,
+				c->scope_count, sizeof *c->scope);
+		c->scope[c->scope_count].symbol = param->data.pair.car->data.symbol;
+		c->scope[c->scope_count].temp = i;
+		++c->scope_count;
+	}
+	c->temps = f->arity;
+	c->labels = 0;
+	c->max_args = 0;
+	c->uses_args = 0;
+	c->loops = 0;
+	c->indent = 1;
+	c->code.len = 0;
+	compile_expr(c, f->body, 1);
+
+	append(&c->defs, "\nstatic struct expr *%s(", mangled("f_", f->name));
+	for (i = 0; i < f->arity; ++i) {
+		append(&c->defs, "%sstruct expr *t%u", i ? ", " : "", i);
+	}
+	buffer_puts(&c->defs, f->arity ? ")\n{\n" : "void)\n{\n");
+	for (i = f->arity; i < c->temps; ++i) {
+		append(&c->defs, "\tstruct expr *t%u;\n", i);
+	}
+	if (c->uses_args) {
+		append(&c->defs, "\tstruct expr *v[%u];\n",
+		       c->max_args ? c->max_args : 1);
+	}
+	for (i = 0; i < f->arity; ++i) {
+		/* the parameter may not be used */
+		append(&c->defs, "\t(void) t%u;\n", i);
+	}
+	if (c->loops) {
+		buffer_puts(&c->defs, "start:\n");
+	}
+	buffer_write(&c->defs, c->code.data, c->code.len);
+	buffer_puts(&c->defs, "}\n");
+}
+
+/* The name defined by a top-level form, or null if it is not a
+ * definition.
+ */
+static const char *defined_name(struct compiler *c, struct expr *e)
+{
+	if (e && e->type == T_PAIR
+	    && is_builtin(c, e->data.pair.car, NULL, SF_DEFINE)
+	    && list_length(e) == 3
+	    && list_index(e, 1)
+	    && list_index(e, 1)->type == T_SYMBOL) {
+		return list_index(e, 1)->data.symbol;
+	}
+	return NULL;
+}
+
+/* Read the top-level forms of a file, and find the functions to compile:
+ * the names defined exactly once in the file, as a lambda with a fixed
+ * number of parameters.
+ */
+static int read_forms(struct compiler *c, const char *text)
+{
+	const char *p = text;
+	size_t i;
+	while (*(p = skip_spaces(p))) {
+		const char *end;
+		struct expr *e = read_expr(p, &end);
+		struct form *form;
+		const char *name;
+		if (thread.error != ERR_NONE) {
+			return 1;
+		}
+		c->forms = grow(c->forms, &c->forms_size,
+				c->forms_count, sizeof *c->forms);
+		form = &c->forms[c->forms_count++];
+		form->e = e;
+		form->text = p;
+		form->len = end - p;
+		form->function = NULL;
+		name = defined_name(c, e);
+		if (name) {
+			c->defined = grow(c->defined, &c->defined_size,
+					  c->defined_count, sizeof *c->defined);
+			c->defined[c->defined_count++] = name;
+		}
+		p = end;
+	}
+	c->functions = malloc((c->forms_count + 1) * sizeof *c->functions);
+	c->functions_count = 0;
+	for (i = 0; i < c->forms_count; ++i) {
+		struct expr *e = c->forms[i].e;
+		struct expr *lambda;
+		const char *name;
+		size_t j;
+		unsigned int definitions = 0;
+		name = defined_name(c, e);
+		if (!name) {
+			continue;
+		}
+		lambda = list_index(e, 2);
+		for (j = 0; j < c->defined_count; ++j) {
+			definitions += c->defined[j] == name;
+		}
+		if (definitions == 1
+		    && lambda && lambda->type == T_PAIR
+		    && is_builtin(c, lambda->data.pair.car, bi_lambda, SF_QUOTED)
+		    && list_length(lambda) == 3
+		    && fixed_params(list_index(lambda, 1))) {
+			struct function *f = &c->functions[c->functions_count++];
+			f->name = name;
+			f->params = list_index(lambda, 1);
+			f->body = list_index(lambda, 2);
+			f->arity = list_length(f->params);
+			c->forms[i].function = f;
+		}
+	}
+	return 0;
+}
+
+static void write_program(struct compiler *c, FILE *f, const char *in)
+{
+	size_t i;
+	unsigned int j;
+	fprintf(f, "/* Compiled from %s by lisp --compile-c. */\n\n", in);
+	fprintf(f, "#include \"lisp.h\"\n\n");
+	if (c->symbols_count) {
+		fprintf(f, "static const char *s[%lu];\n",
+			(unsigned long) c->symbols_count);
+	}
+	if (c->constants_count) {
+		fprintf(f, "static struct expr *k[%lu];\n",
+			(unsigned long) c->constants_count);
+	}
+	fputc('\n', f);
+	for (i = 0; i < c->functions_count; ++i) {
+		struct function *fn = &c->functions[i];
+		fprintf(f, "static struct expr *%s(", mangled("f_", fn->name));
+		for (j = 0; j < fn->arity; ++j) {
+			fprintf(f, "%sstruct expr *t%u", j ? ", " : "", j);
+		}
+		fputs(fn->arity ? ");\n" : "void);\n", f);
+	}
+	if (c->defs.len) {
+		fwrite(c->defs.data, 1, c->defs.len, f);
+	}
+	for (i = 0; i < c->functions_count; ++i) {
+		struct function *fn = &c->functions[i];
+		fprintf(f, "\nstatic struct expr *%s(unsigned int argc, struct expr **argv)\n{\n",
+			mangled("bi_f_", fn->name));
+		fprintf(f, "\tif (check_arg_count(argc, %u)) {\n\t\treturn NULL;\n\t}\n",
+			fn->arity);
+		if (!fn->arity) {
+			fputs("\t(void) argv;\n", f);
+		}
+		fprintf(f, "\treturn %s(", mangled("f_", fn->name));
+		for (j = 0; j < fn->arity; ++j) {
+			fprintf(f, "%sargv[%u]", j ? ", " : "", j);
+		}
+		fputs(");\n}\n", f);
+	}
+
+	fputs("\nint main(void)\n{\n\tinit_globals();\n", f);
+	for (i = 0; i < c->symbols_count; ++i) {
+		fprintf(f, "\ts[%lu] = save_symbol(", (unsigned long) i);
+		write_literal(f, c->symbols[i], strlen(c->symbols[i]));
+		fputs(");\n", f);
+	}
+	for (i = 0; i < c->constants_count; ++i) {
+		struct buffer b = {NULL, 0, 0};
+		print_buffer(c->constants[i], &b);
+		fprintf(f, "\tk[%lu] = compiled_constant(", (unsigned long) i);
+		write_literal(f, b.data, b.len);
+		fputs(");\n", f);
+		free(b.data);
+	}
+	for (i = 0; i < c->forms_count; ++i) {
+		struct form *form = &c->forms[i];
+		if (form->function) {
+			fputs("\tcreate_builtin(", f);
+			write_literal(f, form->function->name,
+				      strlen(form->function->name));
+			fprintf(f, ", %s, SF_NONE);\n",
+				mangled("bi_f_", form->function->name));
+		} else {
+			fputs("\tcompiled_run(", f);
+			write_literal(f, form->text, form->len);
+			fputs(");\n", f);
+		}
+	}
+	fputs("\treturn 0;\n}\n", f);
+}
+
+/* Compile a file of Lisp source to a C program, see the top of this file.
+ * The interpreter must be initialized, since global names are resolved
+ * when compiling. Returns non-zero on failure.
+ */
+int compile_file(const char *in, const char *out)
+{
+	struct compiler c;
+	char *text = read_file(in);
+	FILE *f;
+	size_t i;
+	if (!text) {
+		fprintf(stderr, "Can not read %s!\n", in);
+		return 1;
+	}
+	memset(&c, 0, sizeof c);
+	if (read_forms(&c, text)) {
+		fprintf(stderr, "Can not parse %s!\n", in);
+		free(text);
+		return 1;
+	}
+	for (i = 0; i < c.functions_count; ++i) {
+		compile_function(&c, &c.functions[i]);
+	}
+	f = fopen(out, "w");
+	if (!f) {
+		fprintf(stderr, "Can not write %s!\n", out);
+		free(text);
+		return 1;
+	}
+	write_program(&c, f, in);
+	fclose(f);
+	free(text);
+	free(c.forms);
+	free(c.defined);
+	free(c.functions);
+	free(c.symbols);
+	free(c.constants);
+	free(c.scope);
+	free(c.code.data);
+	free(c.defs.data);
+	return 0;
+}
+
+/* Run time support of compiled programs. */
+
+/* Check a truth value, like if does. Returns 1 for true and 0 for false,
+ * or -1 and sets the error state for any other value.
+ */
+int compiled_truth(struct expr *value)
+{
+	if (compiled_is(value, globals.TRUE)) {
+		return 1;
+	} else if (compiled_is(value, globals.FALSE)) {
+		return 0;
+	}
+	fprintf(stderr, "Invalid truth value: ");
+	print_expr(value, stderr);
+	putc('\n', stderr);
+	thread.error = ERR_USER;
+	return -1;
+}
+
+/* Check whether a value is the given truth value. */
+int compiled_is(struct expr *value, struct expr *truth)
+{
+	return value && value->type == T_SYMBOL
+		&& value->data.symbol == truth->data.symbol;
+}
+
+/* Read a constant of the compiled code. */
+struct expr *compiled_constant(const char *text)
+{
+	const char *endptr;
+	struct expr *e = read_expr(text, &endptr);
+	assert(thread.error == ERR_NONE && !*skip_spaces(endptr));
+	return e;
+}
+
+/* Evaluate a top-level form that was not compiled, printing its value
+ * unless it is a definition. Errors have already been reported, and do
+ * not stop the program.
+ */
+void compiled_run(const char *text)
+{
+	const char *endptr;
+	struct expr *e = read_expr(text, &endptr);
+	struct expr *value = eval_expr(e);
+	if (thread.error != ERR_NONE) {
+		thread.error = ERR_NONE;
+	} else if (!(e && e->type == T_PAIR && e->data.pair.car
+		     && e->data.pair.car->type == T_SYMBOL
+		     && !strcmp(e->data.pair.car->data.symbol, "define"))) {
+		print_expr(value, stdout);
+		putchar('\n');
+	}
+}
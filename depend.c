@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "lisp.h"
+
+/* Dependencies between definitions.
+ *
+ * While the value of a top-level define is computed by a call, see
+ * SF_DEFINE in eval_expr, every global it reads, also in the functions it
+ * calls, is recorded. A define of just a variable copies its value, e.g.
+ * to keep a function before redefining it, so it is not recorded. Once
+ * defined, the variable is added to the dependents of each of them, and
+ * keeps the expression of its value. When a variable is redefined, its
+ * dependents, and theirs, are marked stale, and the value of a stale
+ * variable is recomputed from its expression when it is next read, see
+ * get_variable. Redefining a function thus only costs the definitions
+ * that actually used it, and only once they are needed.
+ *
+ * A dependent is recorded with the generation of its variable, which
+ * changes whenever the variable is set, so the dependencies of an older
+ * definition are dropped instead of being searched for. A definition
+ * that reads itself does not depend on itself, one read while it is
+ * recomputed keeps its old value, and a recomputed value does not mark
+ * its dependents stale again, so cycles end and then keep their values.
+ */
+
+/* Start recording the globals read by the current thread. Reads are
+ * marked with a stamp unique to the definition, so each is recorded once.
+ */
+void begin_tracking(struct tracking *t)
+{
+	t->reads_base = thread.reads_count;
+	t->defining = thread.defining;
+	thread.defining = __atomic_add_fetch(&globals.definitions, 1,
+					     __ATOMIC_RELAXED);
+}
+
+/* Record that the definition being evaluated reads a variable.
+ */
+void record_read(struct variable *v)
+{
+	if (v->read_stamp == thread.defining) {
+		return;
+	}
+	v->read_stamp = thread.defining;
+	if (thread.reads_count == thread.reads_size) {
+		thread.reads_size = thread.reads_size ? 2 * thread.reads_size : 64;
+		thread.reads = realloc(thread.reads,
+				       thread.reads_size * sizeof *thread.reads);
+		assert(thread.reads);
+	}
+	thread.reads[thread.reads_count++] = v;
+}
+
+/* Drop the dependents of older definitions. */
+static void prune_dependents(struct variable *v)
+{
+	struct dependent **d = &v->dependents;
+	v->dependents_count = 0;
+	while (*d) {
+		struct dependent *old = *d;
+		if (old->generation != old->variable->generation) {
+			*d = old->next;
+			free(old);
+		} else {
+			++v->dependents_count;
+			d = &old->next;
+		}
+	}
+}
+
+/* Add a dependent to a variable. The reads of a definition are recorded
+ * once, and dependents of older definitions are dropped once they may
+ * be half of them, so this takes constant time on average. Must hold the
+ * variables lock.
+ */
+static void add_dependent(struct variable *v, struct variable *dependent)
+{
+	struct dependent *d;
+	if (v->dependents_count >= v->dependents_limit) {
+		prune_dependents(v);
+		v->dependents_limit = v->dependents_count < 8
+			? 16 : 2 * v->dependents_count;
+	}
+	d = malloc(sizeof *d);
+	assert(d);
+	d->variable = dependent;
+	d->generation = dependent->generation;
+	d->next = v->dependents;
+	v->dependents = d;
+	++v->dependents_count;
+}
+
+/* Stop recording. If symbol is non-null, it has just been defined by
+ * evaluating source, and becomes a dependent of the globals read.
+ */
+void end_tracking(struct tracking *t, const char *symbol, struct expr *source)
+{
+	size_t i;
+	struct variable *v = symbol ? find_variable(symbol) : NULL;
+	if (v) {
+		pthread_mutex_lock(&globals.variables_lock);
+		if (v->source) {
+			--v->source->refs;
+		}
+		v->source = promote(source);
+		++v->source->refs;
+		for (i = t->reads_base; i < thread.reads_count; ++i) {
+			if (thread.reads[i] != v) {
+				add_dependent(thread.reads[i], v);
+			}
+		}
+		pthread_mutex_unlock(&globals.variables_lock);
+	}
+	thread.reads_count = t->reads_base;
+	thread.defining = t->defining;
+}
+
+/* Mark the dependents of a variable stale, and theirs. Variables marked
+ * but not yet visited are kept in a worklist, so long chains of
+ * definitions do not use the C stack. Must hold the variables lock.
+ */
+void mark_dependents(struct variable *v)
+{
+	struct variable **work = NULL;
+	size_t count = 0;
+	size_t size = 0;
+	while (v) {
+		struct dependent *d;
+		prune_dependents(v);
+		for (d = v->dependents; d; d = d->next) {
+			if (d->variable->stale) {
+				continue;
+			}
+			d->variable->stale = 1;
+			if (count == size) {
+				size = size ? 2 * size : 64;
+				work = realloc(work, size * sizeof *work);
+				assert(work);
+			}
+			work[count++] = d->variable;
+		}
+		v = count ? work[--count] : NULL;
+	}
+	free(work);
+}
+
+/* Recompute the value of a stale variable from its definition. If it
+ * fails, the variable keeps its old value and stays stale.
+ */
+void refresh_variable(struct variable *v)
+{
+	struct tracking t;
+	struct expr *source = v->source;
+	struct expr *value;
+	/* only one thread recomputes it, others read the old value */
+	if (!source || !__atomic_exchange_n(&v->stale, 0, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	begin_tracking(&t);
+	value = eval_expr(source);
+	if (thread.error != ERR_NONE) {
+		fprintf(stderr, "Could not recompute %s!\n", v->symbol);
+		end_tracking(&t, NULL, NULL);
+		v->stale = 1;
+		return;
+	}
+	/* keep the source, which set_variable forgets */
+	++source->refs;
+	set_refreshed_variable(v->symbol, value);
+	end_tracking(&t, v->symbol, source);
+	--source->refs;
+}
@@ -0,0 +1,183 @@
+#include <string.h>
+#include <assert.h>
+
+#include "lisp.h"
+#include "embed.h"
+
+/* Implementation of the embedding interface in embed.h. References are
+ * counted in the refs field of the expressions.
+ */
+
+void lisp_init(void)
+{
+	init_globals();
+}
+
+/* Set the limits of every following evaluation, see struct limits.
+ */
+void lisp_set_limits(unsigned long fuel, size_t heap, size_t depth)
+{
+	globals.limits.fuel = fuel;
+	globals.limits.heap = heap;
+	globals.limits.depth = depth;
+}
+
+/* Get the error of the last call that failed since the last call that
+ * evaluated code.
+ */
+enum lisp_error lisp_error(void)
+{
+	return (enum lisp_error) thread.error;
+}
+
+/* Evaluate all expressions in the source text, returning the value of
+ * the last one.
+ */
+lisp_value *lisp_eval(const char *src)
+{
+	struct expr *value = NULL;
+	thread.error = ERR_NONE;
+	while (*(src = skip_spaces(src))) {
+		struct expr *e = read_expr(src, &src);
+		if (thread.error != ERR_NONE) {
+			return NULL;
+		}
+		value = eval_expr(e);
+		if (thread.error != ERR_NONE) {
+			return NULL;
+		}
+	}
+	return lisp_retain(value);
+}
+
+/* Look up the value of a global variable, typically a function to call
+ * with lisp_call.
+ */
+lisp_value *lisp_lookup(const char *name)
+{
+	thread.error = ERR_NONE;
+	return lisp_retain(get_variable(save_symbol(name)));
+}
+
+/* Call a function with the given arguments. The arguments are borrowed
+ * for the duration of the call.
+ */
+lisp_value *lisp_call(lisp_value *f, unsigned int argc, lisp_value **argv)
+{
+	struct expr *value;
+	thread.error = ERR_NONE;
+	value = apply_function(f, argc, argv);
+	if (thread.error != ERR_NONE) {
+		return NULL;
+	}
+	return lisp_retain(value);
+}
+
+/* Take a new reference to a value.
+ */
+lisp_value *lisp_retain(lisp_value *v)
+{
+	if (v) {
+		++v->refs;
+	}
+	return v;
+}
+
+/* Drop a reference to a value.
+ */
+void lisp_release(lisp_value *v)
+{
+	if (v) {
+		assert(v->refs > 0);
+		--v->refs;
+	}
+}
+
+lisp_value *lisp_number(double number)
+{
+	return lisp_retain(make_number(number));
+}
+
+lisp_value *lisp_string(const char *string)
+{
+	return lisp_retain(make_string(string, strlen(string)));
+}
+
+lisp_value *lisp_symbol(const char *name)
+{
+	if (strlen(name) > SYMBOL_MAXLEN) {
+		fprintf(stderr, "Symbol name too long: %s!\n", name);
+		thread.error = ERR_USER;
+		return NULL;
+	}
+	return lisp_retain(make_symbol(name));
+}
+
+lisp_value *lisp_cons(lisp_value *car, lisp_value *cdr)
+{
+	return lisp_retain(make_pair(car, cdr));
+}
+
+lisp_value *lisp_list(unsigned int argc, lisp_value **argv)
+{
+	return lisp_retain(make_list(argc, argv));
+}
+
+enum lisp_type lisp_type_of(lisp_value *v)
+{
+	if (!v) {
+		return LISP_NIL;
+	}
+	switch (v->type) {
+	case T_SYMBOL:
+		return LISP_SYMBOL;
+	case T_NUMBER:
+		return LISP_NUMBER;
+	case T_STRING:
+		return LISP_STRING;
+	case T_PAIR:
+		return LISP_PAIR;
+	case T_BUILTIN:
+	case T_LAMBDA:
+	case T_CONTINUATION:
+	case T_MEMO:
+	case T_FOREIGN:
+		return LISP_FUNCTION;
+	default:
+		return LISP_OTHER;
+	}
+}
+
+int lisp_is_true(lisp_value *v)
+{
+	return v && v->type == T_SYMBOL
+		&& v->data.symbol == globals.TRUE->data.symbol;
+}
+
+/* The accessors set the error code if the value has the wrong type.
+ */
+
+double lisp_number_value(lisp_value *v)
+{
+	return check_type(v, T_NUMBER) ? 0 : v->data.number;
+}
+
+const char *lisp_string_value(lisp_value *v)
+{
+	return check_type(v, T_STRING) ? NULL : string_text(v);
+}
+
+const char *lisp_symbol_name(lisp_value *v)
+{
+	return check_type(v, T_SYMBOL) ? NULL : v->data.symbol;
+}
+
+lisp_value *lisp_car(lisp_value *v)
+{
+	return check_type(v, T_PAIR) ? NULL : lisp_retain(v->data.pair.car);
+}
+
+lisp_value *lisp_cdr(lisp_value *v)
+{
+	return check_type(v, T_PAIR) ? NULL : lisp_retain(v->data.pair.cdr);
+}
@@ -0,0 +1,69 @@
+#ifndef _EMBED_H_
+#define _EMBED_H_
+
+#include <stddef.h>
+
+/* Interface for embedding the interpreter in a C program.
+ *
+ * Values are handled through references of type lisp_value *. Every
+ * function returning a reference returns a new one, which keeps the value
+ * alive until it is passed to lisp_release, also across calls into the
+ * interpreter. Nil is the null reference, which needs no release.
+ *
+ * Functions that evaluate code report failure by returning null and
+ * setting an error code, see lisp_error. Since null is also nil, check
+ * lisp_error when the result may be nil.
+ *
+ * A function looked up once with lisp_lookup can be called any number of
+ * times with lisp_call, without reading any source text.
+ */
+
+typedef struct expr lisp_value;
+
+enum lisp_type {
+	LISP_NIL,
+	LISP_SYMBOL,
+	LISP_NUMBER,
+	LISP_STRING,
+	LISP_PAIR,
+	LISP_FUNCTION,
+	/* other values, such as promises and ports */
+	LISP_OTHER
+};
+
+/* Error codes, with the same values as enum error in lisp.h. */
+enum lisp_error {
+	LISP_OK,
+	LISP_ERR_PARSE,
+	LISP_ERR_USER,
+	LISP_ERR_FUEL,
+	LISP_ERR_MEMORY,
+	LISP_ERR_DEPTH
+};
+
+void lisp_init(void);
+void lisp_set_limits(unsigned long fuel, size_t heap, size_t depth);
+enum lisp_error lisp_error(void);
+
+lisp_value *lisp_eval(const char *src);
+lisp_value *lisp_lookup(const char *name);
+lisp_value *lisp_call(lisp_value *f, unsigned int argc, lisp_value **argv);
+
+lisp_value *lisp_retain(lisp_value *v);
+void lisp_release(lisp_value *v);
+
+lisp_value *lisp_number(double number);
+lisp_value *lisp_string(const char *string);
+lisp_value *lisp_symbol(const char *name);
+lisp_value *lisp_cons(lisp_value *car, lisp_value *cdr);
+lisp_value *lisp_list(unsigned int argc, lisp_value **argv);
+
+enum lisp_type lisp_type_of(lisp_value *v);
+int lisp_is_true(lisp_value *v);
+double lisp_number_value(lisp_value *v);
+const char *lisp_string_value(lisp_value *v);
+const char *lisp_symbol_name(lisp_value *v);
+lisp_value *lisp_car(lisp_value *v);
+lisp_value *lisp_cdr(lisp_value *v);
+
+#endif
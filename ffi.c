@@ -0,0 +1,346 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <dlfcn.h>
+
+#include "lisp.h"
+
+/* Calls of functions in C shared libraries.
+ *
+ * (ffi-load "libm.so.6") opens a library, and
+ *
+ *	(ffi-func lib "pow" '(double double) 'double)
+ *
+ * looks up one of its functions, giving a foreign function that is
+ * called like any other. The types of parameters are double, int, long,
+ * string, a const char * to the text of a string, and f64, a double *
+ * to the elements of an f64 buffer, see make-f64. The result may also
+ * be void. Arguments are read straight from the value stack into
+ * registers, and buffers are passed without copying, so only the result
+ * is allocated.
+ *
+ * Without a library such as libffi, the call is made through a single
+ * function type taking all integer registers, then all floating point
+ * registers, see ffi_call. The calling conventions of x86-64 and AArch64
+ * assign arguments of the two classes to registers independently, and
+ * a function ignores the registers it does not use, so this calls any
+ * function that takes at most FFI_MAX_INTS integers and pointers and
+ * FFI_MAX_DOUBLES doubles, and is not variadic. Other platforms can load
+ * libraries but not call them.
+ */
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define FFI_SUPPORTED
+#endif
+
+static const char *const FFI_TYPE_NAMES[] = {
+	"void",
+	"double",
+	"int",
+	"long",
+	"string",
+	"f64"
+};
+
+#define FFI_TYPES_COUNT (sizeof FFI_TYPE_NAMES / sizeof *FFI_TYPE_NAMES)
+
+typedef double (*ffi_double_func)(long, long, long, long, long, long,
+				  double, double, double, double,
+				  double, double, double, double);
+typedef long (*ffi_long_func)(long, long, long, long, long, long,
+			      double, double, double, double,
+			      double, double, double, double);
+typedef int (*ffi_int_func)(long, long, long, long, long, long,
+			    double, double, double, double,
+			    double, double, double, double);
+typedef const char *(*ffi_string_func)(long, long, long, long, long, long,
+				       double, double, double, double,
+				       double, double, double, double);
+
+/* Get the type named by a symbol, or return -1 and set the global error
+ * state if there is none.
+ */
+static int ffi_type(struct expr *e)
+{
+	size_t i;
+	if (check_type(e, T_SYMBOL)) {
+		return -1;
+	}
+	for (i = 0; i < FFI_TYPES_COUNT; ++i) {
+		if (!strcmp(e->data.symbol, FFI_TYPE_NAMES[i])) {
+			return i;
+		}
+	}
+	fprintf(stderr, "Unknown foreign type %s!\n", e->data.symbol);
+	thread.error = ERR_USER;
+	return -1;
+}
+
+struct expr *bi_ffi_load(unsigned int argc, struct expr **argv)
+{
+	struct expr *e;
+	void *handle;
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_STRING)) {
+		return NULL;
+	}
+	handle = dlopen(string_text(argv[0]), RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "Can not load library: %s!\n", dlerror());
+		thread.error = ERR_USER;
+		return NULL;
+	}
+	/* libraries stay loaded, since their functions may be kept */
+	e = new_expr(T_FOREIGN);
+	e->data.foreign.handle = handle;
+	e->data.foreign.func = NULL;
+	e->data.foreign.name = strdup(string_text(argv[0]));
+	assert(e->data.foreign.name);
+	e->data.foreign.param_count = 0;
+	e->data.foreign.result = FFI_VOID;
+	return e;
+}
+
+struct expr *bi_ffi_func(unsigned int argc, struct expr **argv)
+{
+	struct foreign *lib;
+	struct expr *e;
+	struct expr *p;
+	union {
+		void *data;
+		void (*func)(void);
+	} symbol;
+	unsigned char params[FFI_MAX_ARGS];
+	unsigned int count = 0;
+	unsigned int ints = 0;
+	unsigned int doubles = 0;
+	int type;
+	if (check_arg_count(argc, 4) || check_type(argv[0], T_FOREIGN)
+	    || check_type(argv[1], T_STRING)) {
+		return NULL;
+	}
+	lib = &argv[0]->data.foreign;
+	if (!lib->handle) {
+		fprintf(stderr, "Expected a library, got foreign function %s!\n",
+			lib->name);
+		thread.error = ERR_USER;
+		return NULL;
+	}
+	for (p = argv[2]; p; p = p->data.pair.cdr) {
+		if (check_type(p, T_PAIR)
+		    || (type = ffi_type(p->data.pair.car)) < 0) {
+			return NULL;
+		}
+		if (type == FFI_VOID) {
+			fprintf(stderr, "Foreign parameters can not be void!\n");
+			thread.error = ERR_USER;
+			return NULL;
+		}
+		if (type == FFI_DOUBLE ? ++doubles > FFI_MAX_DOUBLES
+		    : ++ints > FFI_MAX_INTS) {
+			fprintf(stderr,
+				"Too many foreign parameters, expected at most %d integers and %d doubles!\n",
+				FFI_MAX_INTS, FFI_MAX_DOUBLES);
+			thread.error = ERR_USER;
+			return NULL;
+		}
+		params[count++] = type;
+	}
+	if ((type = ffi_type(argv[3])) < 0) {
+		return NULL;
+	}
+	if (type == FFI_F64) {
+		fprintf(stderr, "Foreign functions can not return f64!\n");
+		thread.error = ERR_USER;
+		return NULL;
+	}
+#ifndef FFI_SUPPORTED
+	fprintf(stderr, "Foreign functions can not be called on this platform!\n");
+	thread.error = ERR_USER;
+	return NULL;
+#endif
+	dlerror();
+	symbol.data = dlsym(lib->handle, string_text(argv[1]));
+	if (!symbol.data) {
+		const char *error = dlerror();
+		fprintf(stderr, "Can not find foreign function %s: %s!\n",
+			string_text(argv[1]), error ? error : "null symbol");
+		thread.error = ERR_USER;
+		return NULL;
+	}
+	e = new_expr(T_FOREIGN);
+	e->data.foreign.handle = NULL;
+	e->data.foreign.func = symbol.func;
+	e->data.foreign.name = strdup(string_text(argv[1]));
+	assert(e->data.foreign.name);
+	memcpy(e->data.foreign.params, params, count);
+	e->data.foreign.param_count = count;
+	e->data.foreign.result = type;
+	return e;
+}
+
+/* Call a foreign function with the given arguments, whose number and
+ * types are checked.
+ */
+struct expr *ffi_call(struct expr *f, unsigned int argc, struct expr **argv)
+{
+	struct foreign *foreign = &f->data.foreign;
+	long ints[FFI_MAX_INTS] = {0};
+	double doubles[FFI_MAX_DOUBLES] = {0};
+	unsigned int int_count = 0;
+	unsigned int double_count = 0;
+	unsigned int i;
+	if (!foreign->func) {
+		fprintf(stderr, "Trying to call library %s!\n", foreign->name);
+		thread.error = ERR_USER;
+		return NULL;
+	}
+	if (check_arg_count(argc, foreign->param_count)) {
+		return NULL;
+	}
+	for (i = 0; i < argc; ++i) {
+		switch (foreign->params[i]) {
+		case FFI_DOUBLE:
+			if (check_type(argv[i], T_NUMBER)) {
+				return NULL;
+			}
+			doubles[double_count++] = argv[i]->data.number;
+			break;
+		case FFI_INT:
+		case FFI_LONG:
+			if (check_type(argv[i], T_NUMBER)) {
+				return NULL;
+			}
+			ints[int_count++] = (long) argv[i]->data.number;
+			break;
+		case FFI_STRING:
+			if (check_type(argv[i], T_STRING)) {
+				return NULL;
+			}
+			ints[int_count++] = (long) string_text(argv[i]);
+			break;
+		case FFI_F64:
+			if (check_type(argv[i], T_F64)) {
+				return NULL;
+			}
+			ints[int_count++] = (long) argv[i]->data.f64.data;
+			break;
+		}
+	}
+#ifdef FFI_SUPPORTED
+#define FFI_ARGS(type) ((type) foreign->func)(ints[0], ints[1], ints[2], \
+	ints[3], ints[4], ints[5], doubles[0], doubles[1], doubles[2], \
+	doubles[3], doubles[4], doubles[5], doubles[6], doubles[7])
+	switch (foreign->result) {
+	case FFI_VOID:
+		FFI_ARGS(ffi_long_func);
+		return NULL;
+	case FFI_DOUBLE:
+		return make_number(FFI_ARGS(ffi_double_func));
+	case FFI_INT:
+		return make_number(FFI_ARGS(ffi_int_func));
+	case FFI_LONG:
+		return make_number(FFI_ARGS(ffi_long_func));
+	case FFI_STRING:
+		{
+			const char *s = FFI_ARGS(ffi_string_func);
+			return s ? make_string(s, strlen(s)) : NULL;
+		}
+	}
+#undef FFI_ARGS
+#endif
+	return NULL;
+}
+
+/* Make an f64 buffer of n elements, which are all zero or the given
+ * number.
+ */
+struct expr *bi_make_f64(unsigned int argc, struct expr **argv)
+{
+	struct expr *e;
+	double n;
+	double fill = 0;
+	size_t i;
+	if (argc != 1 && check_arg_count(argc, 2)) {
+		return NULL;
+	}
+	if (check_type(argv[0], T_NUMBER)
+	    || (argc == 2 && check_type(argv[1], T_NUMBER))) {
+		return NULL;
+	}
+	n = argv[0]->data.number;
+	if (n < 0 || n > (size_t) -1 / sizeof (double) || n != (size_t) n) {
+		fprintf(stderr, "Invalid length, expected a non-negative integer!\n");
+		thread.error = ERR_USER;
+		return NULL;
+	}
+	if (argc == 2) {
+		fill = argv[1]->data.number;
+	}
+	e = new_expr(T_F64);
+	e->data.f64.len = 0;
+	e->data.f64.data = NULL;
+	charge_heap(n * sizeof *e->data.f64.data);
+	if (thread.error != ERR_NONE) {
+		return NULL;
+	}
+	e->data.f64.len = n;
+	e->data.f64.data = malloc((n ? n : 1) * sizeof *e->data.f64.data);
+	if (!e->data.f64.data) {
+		fprintf(stderr, "Out of memory for f64 buffer!\n");
+		thread.error = ERR_MEMORY;
+		e->data.f64.len = 0;
+		return NULL;
+	}
+	for (i = 0; i < e->data.f64.len; ++i) {
+		e->data.f64.data[i] = fill;
+	}
+	return e;
+}
+
+/* Check that argv[0] is an f64 buffer and argv[1] an index in it. */
+static int check_f64_index(struct expr **argv)
+{
+	double i;
+	if (check_type(argv[0], T_F64) || check_type(argv[1], T_NUMBER)) {
+		return 1;
+	}
+	i = argv[1]->data.number;
+	if (i < 0 || i >= argv[0]->data.f64.len || i != (size_t) i) {
+		fprintf(stderr, "Invalid index, expected an integer below %lu!\n",
+			(unsigned long) argv[0]->data.f64.len);
+		thread.error = ERR_USER;
+		return 1;
+	}
+	return 0;
+}
+
+struct expr *bi_f64_ref(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 2) || check_f64_index(argv)) {
+		return NULL;
+	}
+	return make_number(argv[0]->data.f64.data[(size_t) argv[1]->data.number]);
+}
+
+/* Set an element of an f64 buffer, returning the number. */
+struct expr *bi_f64_set(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 3) || check_f64_index(argv)
+	    || check_type(argv[2], T_NUMBER)) {
+		return NULL;
+	}
+	argv[0]->data.f64.data[(size_t) argv[1]->data.number] =
+		argv[2]->data.number;
+	return argv[2];
+}
+
+struct expr *bi_f64_length(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_F64)) {
+		return NULL;
+	}
+	return make_number(argv[0]->data.f64.len);
+}
@@ -0,0 +1,406 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "lisp.h"
+
+/* Fusion of chains of list functions.
+ *
+ * A call of map, filter, fold, length or (apply + ...) whose list is
+ * itself given by a call of map or filter, such as
+ *
+ *	(apply + (map f (filter p lst)))
+ *
+ * would build a list at every step of the chain, only to walk it once in
+ * the next. The evaluator instead runs such a chain as a single loop over
+ * the source list, see fuse, passing each element through the stages and
+ * into the last call, so only the result of a final map or filter is
+ * consed.
+ *
+ * The functions of the chain are recognized by their values, see
+ * create_prelude, so a chain is left alone once any of them is
+ * redefined. The arguments are evaluated in the same order as without
+ * fusion, but the calls of the functions of different stages are
+ * interleaved.
+ *
+ * The loop evaluates the arguments and calls the functions with nested
+ * eval_expr and apply_function, which do not see the frames of the
+ * evaluation around them. A continuation called or a yield evaluated
+ * there would not leave the chain as it does without fusion, so a chain
+ * is only fused if nothing it evaluates can do either, see is_pure.
+ */
+
+/* stages fused in one loop, a longer chain is fused from its end */
+#define FUSE_STAGES 16
+/* nesting of calls of global lambdas followed by is_pure */
+#define FUSE_PURE_DEPTH 16
+
+enum fuse_kind {
+	FK_MAP,
+	FK_FILTER,
+	FK_FOLD,
+	FK_LENGTH,
+	FK_SUM
+};
+
+struct fuse_stage {
+	enum fuse_kind kind;
+	/* the function, evaluated */
+	struct expr *f;
+};
+
+/* The lambdas whose bodies are being checked by is_pure. */
+struct purity {
+	struct lambda *lambdas[FUSE_PURE_DEPTH];
+	unsigned int count;
+};
+
+/* The value of the head of a form, without evaluating anything: the
+ * value of a global variable, or a function substituted for a parameter.
+ */
+static struct expr *head_value(struct expr *head)
+{
+	struct variable *v;
+	if (!head || head->type != T_SYMBOL) {
+		return head;
+	}
+	v = find_variable(head->data.symbol);
+	return v ? v->value : NULL;
+}
+
+/* The kind of a call of f with args, or -1 if it is not a list function
+ * of the prelude called with the right number of arguments.
+ */
+static int call_kind(struct expr *f, struct expr *args)
+{
+	unsigned int argc = list_length(args);
+	if (!f) {
+		return -1;
+	} else if (f == globals.MAP && argc == 2) {
+		return FK_MAP;
+	} else if (f == globals.FILTER && argc == 2) {
+		return FK_FILTER;
+	} else if (f == globals.FOLD && argc == 3) {
+		return FK_FOLD;
+	} else if (f == globals.LENGTH && argc == 1) {
+		return FK_LENGTH;
+	} else if (f->type == T_BUILTIN && f->data.builtin.spec_form == SF_APPLY
+		   && argc == 2) {
+		struct expr *g = head_value(args->data.pair.car);
+		if (g && g->type == T_BUILTIN && g->data.builtin.func == bi_sum) {
+			return FK_SUM;
+		}
+	}
+	return -1;
+}
+
+/* Whether sym is one of the parameters of a lambda. */
+static int is_param(const char *sym, struct expr *params)
+{
+	for (; params && params->type == T_PAIR; params = params->data.pair.cdr) {
+		if (params->data.pair.car->data.symbol == sym) {
+			return 1;
+		}
+	}
+	return params && params->type == T_SYMBOL && params->data.symbol == sym;
+}
+
+static int is_pure(struct expr *e, struct expr *params, struct purity *p);
+
+/* Whether calling the head of a form can not call a continuation or
+ * yield. The head is a symbol, a lambda form or a value, and params are
+ * the parameters of the lambda whose body it is in, which may be bound
+ * to anything.
+ */
+static int is_pure_head(struct expr *head, struct expr *params,
+			struct purity *p)
+{
+	struct lambda *lambda;
+	unsigned int i;
+	int pure;
+	if (head && head->type == T_SYMBOL) {
+		if (is_param(head->data.symbol, params)) {
+			return 0;
+		}
+		head = head_value(head);
+	} else if (head && head->type == T_PAIR) {
+		/* (lambda params body), only outside of lambdas, whose
+		   parameters its body could call */
+		struct expr *l = head_value(head->data.pair.car);
+		struct expr *rest = head->data.pair.cdr;
+		if (params || !l || l->type != T_BUILTIN
+		    || l->data.builtin.func != bi_lambda
+		    || list_length(rest) != 2) {
+			return 0;
+		}
+		return is_pure(rest->data.pair.cdr->data.pair.car,
+			       rest->data.pair.car, p);
+	}
+	if (!head) {
+		return 0;
+	} else if (head->type == T_BUILTIN) {
+		switch (head->data.builtin.spec_form) {
+		case SF_NONE:
+		case SF_IF:
+		case SF_AND:
+		case SF_OR:
+			return 1;
+		default:
+			return 0;
+		}
+	} else if (head->type != T_LAMBDA) {
+		/* continuations, memoized and foreign functions */
+		return 0;
+	}
+	lambda = &head->data.lambda;
+	for (i = 0; i < p->count; ++i) {
+		if (p->lambdas[i] == lambda) {
+			/* a recursive call is pure if the rest of the body is */
+			return 1;
+		}
+	}
+	if (p->count == FUSE_PURE_DEPTH) {
+		return 0;
+	}
+	p->lambdas[p->count++] = lambda;
+	pure = is_pure(lambda->body, lambda->params, p);
+	--p->count;
+	return pure;
+}
+
+/* Whether evaluating e can not call a continuation or yield, so that it
+ * may be evaluated outside of the frames around it. Calls are followed
+ * into the bodies of global lambdas, and only builtins that do not
+ * evaluate anything but their arguments are pure.
+ */
+static int is_pure(struct expr *e, struct expr *params, struct purity *p)
+{
+	struct expr *head;
+	struct expr *args;
+	if (!e || e->type != T_PAIR) {
+		return 1;
+	}
+	head = e->data.pair.car;
+	if (head && head->type == T_SYMBOL
+	    && !is_param(head->data.symbol, params)) {
+		struct expr *f = head_value(head);
+		if (f && f->type == T_BUILTIN
+		    && f->data.builtin.spec_form == SF_QUOTED) {
+			/* quote, lambda, delay and future evaluate nothing
+			   here */
+			return 1;
+		}
+	}
+	if (!is_pure_head(head, params, p)) {
+		return 0;
+	}
+	for (args = e->data.pair.cdr; args && args->type == T_PAIR;
+	     args = args->data.pair.cdr) {
+		if (!is_pure(args->data.pair.car, params, p)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Whether e is a call of map or filter, giving the list of a stage. */
+static int is_stage(struct expr *e)
+{
+	int kind;
+	if (!e || e->type != T_PAIR) {
+		return 0;
+	}
+	kind = call_kind(head_value(e->data.pair.car), e->data.pair.cdr);
+	return kind == FK_MAP || kind == FK_FILTER;
+}
+
+/* The last argument of a call, which is the list. */
+static struct expr *list_arg(struct expr *args)
+{
+	while (args->data.pair.cdr) {
+		args = args->data.pair.cdr;
+	}
+	return args->data.pair.car;
+}
+
+/* Whether the arguments of a chain, which fuse evaluates, and the
+ * functions it calls are pure.
+ */
+static int is_pure_chain(enum fuse_kind kind, struct expr *args)
+{
+	struct purity p;
+	struct expr *source;
+	unsigned int count = 0;
+	p.count = 0;
+	switch (kind) {
+	case FK_MAP:
+	case FK_FILTER:
+		if (!is_pure_head(args->data.pair.car, NULL, &p)) {
+			return 0;
+		}
+		break;
+	case FK_FOLD:
+		if (!is_pure_head(args->data.pair.car, NULL, &p)
+		    || !is_pure(args->data.pair.cdr->data.pair.car, NULL, &p)) {
+			return 0;
+		}
+		break;
+	case FK_LENGTH:
+	case FK_SUM:
+		break;
+	}
+	for (source = list_arg(args);
+	     count < FUSE_STAGES && is_stage(source);
+	     source = list_arg(source->data.pair.cdr), ++count) {
+		if (!is_pure_head(source->data.pair.cdr->data.pair.car,
+				  NULL, &p)) {
+			return 0;
+		}
+	}
+	return is_pure(source, NULL, &p);
+}
+
+/* Check whether a call of the function f, already evaluated, with the
+ * unevaluated arguments args ends a chain that can be fused.
+ */
+int is_fusable(struct expr *f, struct expr *args)
+{
+	int kind;
+	/* most calls are of other functions */
+	if (f != globals.MAP && f != globals.FILTER && f != globals.FOLD
+	    && f != globals.LENGTH
+	    && !(f && f->type == T_BUILTIN
+		 && f->data.builtin.spec_form == SF_APPLY)) {
+		return 0;
+	}
+	kind = call_kind(f, args);
+	return kind >= 0 && is_stage(list_arg(args))
+		&& is_pure_chain(kind, args);
+}
+
+/* Evaluate the call of f with args, which is_fusable, as one loop. The
+ * stages are kept outermost first, so each element goes through them
+ * from the end.
+ */
+struct expr *fuse(struct expr *f, struct expr *args)
+{
+	struct fuse_stage stages[FUSE_STAGES];
+	unsigned int count = 0;
+	struct expr *last = NULL;
+	struct expr *acc = NULL;
+	struct expr *result = NULL;
+	struct expr **tail = &result;
+	struct expr *source;
+	struct expr *list;
+	double sum = 0;
+	unsigned long length = 0;
+	unsigned int i;
+	enum fuse_kind kind = call_kind(f, args);
+	/* evaluate the arguments of the last call before its list */
+	switch (kind) {
+	case FK_MAP:
+	case FK_FILTER:
+		last = eval_expr(args->data.pair.car);
+		break;
+	case FK_FOLD:
+		last = eval_expr(args->data.pair.car);
+		if (thread.error == ERR_NONE) {
+			acc = eval_expr(args->data.pair.cdr->data.pair.car);
+		}
+		break;
+	case FK_LENGTH:
+	case FK_SUM:
+		break;
+	}
+	if (thread.error != ERR_NONE) {
+		return NULL;
+	}
+	/* then the functions of the stages, from the outermost */
+	for (source = list_arg(args);
+	     count < FUSE_STAGES && is_stage(source);
+	     source = list_arg(source->data.pair.cdr)) {
+		struct fuse_stage *s = &stages[count++];
+		s->kind = call_kind(head_value(source->data.pair.car),
+				    source->data.pair.cdr);
+		s->f = eval_expr(source->data.pair.cdr->data.pair.car);
+		if (thread.error != ERR_NONE) {
+			return NULL;
+		}
+	}
+	list = eval_expr(source);
+	if (thread.error != ERR_NONE) {
+		return NULL;
+	}
+	for (; list; list = list->data.pair.cdr) {
+		struct expr *x;
+		struct expr *y;
+		int keep = 1;
+		if (check_type(list, T_PAIR)) {
+			return NULL;
+		}
+		x = list->data.pair.car;
+		for (i = count; keep && i > 0; --i) {
+			y = apply_function(stages[i - 1].f, 1, &x);
+			if (stages[i - 1].kind == FK_MAP) {
+				x = y;
+			} else if (thread.error == ERR_NONE) {
+				keep = compiled_truth(y);
+			}
+			if (thread.error != ERR_NONE) {
+				return NULL;
+			}
+		}
+		if (!keep) {
+			continue;
+		}
+		switch (kind) {
+		case FK_MAP:
+			x = apply_function(last, 1, &x);
+			break;
+		case FK_FILTER:
+			y = apply_function(last, 1, &x);
+			if (thread.error == ERR_NONE) {
+				keep = compiled_truth(y);
+			}
+			break;
+		case FK_FOLD:
+			{
+				struct expr *argv[2];
+				argv[0] = acc;
+				argv[1] = x;
+				acc = apply_function(last, 2, argv);
+			}
+			break;
+		case FK_LENGTH:
+			++length;
+			break;
+		case FK_SUM:
+			if (check_type(x, T_NUMBER)) {
+				return NULL;
+			}
+			sum += x->data.number;
+			break;
+		}
+		if (thread.error != ERR_NONE) {
+			return NULL;
+		}
+		if ((kind == FK_MAP || kind == FK_FILTER) && keep) {
+			*tail = make_pair(x, NULL);
+			if (tail != &result) {
+				++(*tail)->refs;
+			}
+			tail = &(*tail)->data.pair.cdr;
+		}
+	}
+	switch (kind) {
+	case FK_MAP:
+	case FK_FILTER:
+		return result;
+	case FK_FOLD:
+		return acc;
+	case FK_LENGTH:
+		return make_number(length);
+	case FK_SUM:
+		return make_number(sum);
+	}
+	return NULL;
+}
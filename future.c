@@ -0,0 +1,364 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "lisp.h"
+
+/* Futures evaluated by a pool of worker threads.
+ *
+ * (future expr) returns a future of the value of expr, and (touch f)
+ * waits for it. Every thread, the main thread included, has a deque of
+ * pending futures. A thread pushes the futures it creates at the tail of
+ * its own deque, and pops the most recent one when it touches a future
+ * that is not done yet. Idle workers steal the oldest future from the
+ * head of the deque of another thread, which is usually the largest
+ * piece of work left. Creating a future therefore only costs an
+ * allocation and a push, and a future that no other thread has stolen
+ * by the time it is touched is evaluated inline, like a call. Without
+ * any workers, futures are evaluated lazily when touched.
+ *
+ * The deques follow the THE protocol of Cilk: the owner pushes and pops
+ * without locking unless it competes with a thief for the last future,
+ * and thieves lock the deque.
+ *
+ * Evaluation state, such as the stacks and the error, is local to each
+ * thread, see struct thread. The tables of symbols, variables and
+ * hash-consed expressions are shared and guarded by locks. Reference
+ * counts are not updated atomically, which is harmless as long as
+ * expressions are never collected. Compiled code only runs on the main
+ * thread.
+ */
+
+#define MAX_WORKERS 256
+#define DEQUE_SIZE 256
+
+struct deque {
+	/* pending futures, indexed modulo size */
+	struct expr **tasks;
+	long size;
+	/* thieves take from the head, the owner pushes and pops at the
+	   tail */
+	long head;
+	long tail;
+	pthread_mutex_t lock;
+};
+
+struct worker {
+	pthread_t handle;
+	struct deque deque;
+	/* state for choosing victims to steal from */
+	unsigned long seed;
+	int stop;
+};
+
+struct scheduler {
+	/* the main thread and the worker threads, by thread id */
+	struct worker workers[MAX_WORKERS + 1];
+	/* number of running worker threads */
+	unsigned int count;
+	/* futures in all deques, and the number of idle workers waiting
+	   for one */
+	long pending;
+	long sleeping;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+
+static void init_deque(struct deque *d)
+{
+	d->size = DEQUE_SIZE;
+	d->tasks = malloc(d->size * sizeof *d->tasks);
+	d->head = 0;
+	d->tail = 0;
+	pthread_mutex_init(&d->lock, NULL);
+}
+
+/* Create the scheduler, without any worker threads.
+ */
+struct scheduler *make_scheduler(void)
+{
+	struct scheduler *s = malloc(sizeof *s);
+	unsigned int i;
+	for (i = 0; i <= MAX_WORKERS; ++i) {
+		s->workers[i].deque.tasks = NULL;
+		s->workers[i].seed = i + 1;
+		s->workers[i].stop = 0;
+	}
+	init_deque(&s->workers[0].deque);
+	s->count = 0;
+	s->pending = 0;
+	s->sleeping = 0;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->wake, NULL);
+	return s;
+}
+
+/* Push a future at the tail of the deque of the current thread, waking an
+ * idle worker if there is one.
+ */
+static void push_task(struct scheduler *s, struct expr *task)
+{
+	struct deque *d = &s->workers[thread.id].deque;
+	long tail = d->tail;
+	if (tail - __atomic_load_n(&d->head, __ATOMIC_SEQ_CST) >= d->size) {
+		/* grow, keeping the positions of the tasks */
+		struct expr **tasks;
+		long i;
+		pthread_mutex_lock(&d->lock);
+		tasks = malloc(2 * d->size * sizeof *tasks);
+		for (i = d->head; i < tail; ++i) {
+			tasks[i & (2 * d->size - 1)] = d->tasks[i & (d->size - 1)];
+		}
+		free(d->tasks);
+		d->tasks = tasks;
+		d->size *= 2;
+		pthread_mutex_unlock(&d->lock);
+	}
+	d->tasks[tail & (d->size - 1)] = task;
+	__atomic_store_n(&d->tail, tail + 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&s->pending, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&s->lock);
+		pthread_cond_signal(&s->wake);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/* Pop the most recent future from the deque of the current thread, or
+ * return null if it is empty.
+ */
+static struct expr *pop_task(struct scheduler *s)
+{
+	struct deque *d = &s->workers[thread.id].deque;
+	long tail = d->tail - 1;
+	if (tail < __atomic_load_n(&d->head, __ATOMIC_SEQ_CST)) {
+		return NULL;
+	}
+	__atomic_store_n(&d->tail, tail, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&d->head, __ATOMIC_SEQ_CST) > tail) {
+		/* a thief may be taking the same future, so decide under
+		   the lock */
+		__atomic_store_n(&d->tail, tail + 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&d->lock);
+		__atomic_store_n(&d->tail, tail, __ATOMIC_SEQ_CST);
+		if (d->head > tail) {
+			__atomic_store_n(&d->tail, tail + 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&d->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&d->lock);
+	}
+	__atomic_sub_fetch(&s->pending, 1, __ATOMIC_SEQ_CST);
+	return d->tasks[tail & (d->size - 1)];
+}
+
+/* Steal the oldest future from the deque of another thread, or return
+ * null if none was found.
+ */
+static struct expr *steal_task(struct scheduler *s)
+{
+	struct worker *self = &s->workers[thread.id];
+	unsigned int n = __atomic_load_n(&s->count, __ATOMIC_SEQ_CST) + 1;
+	unsigned int start;
+	unsigned int i;
+	self->seed = self->seed * 1103515245UL + 12345UL;
+	start = (self->seed >> 16) % n;
+	for (i = 0; i < n; ++i) {
+		struct worker *victim = &s->workers[(start + i) % n];
+		struct deque *d = &victim->deque;
+		struct expr *task = NULL;
+		long head;
+		if (victim == self || !d->tasks
+		    || __atomic_load_n(&d->head, __ATOMIC_SEQ_CST)
+		    >= __atomic_load_n(&d->tail, __ATOMIC_SEQ_CST)) {
+			continue;
+		}
+		pthread_mutex_lock(&d->lock);
+		head = d->head;
+		__atomic_store_n(&d->head, head + 1, __ATOMIC_SEQ_CST);
+		if (head + 1 > __atomic_load_n(&d->tail, __ATOMIC_SEQ_CST)) {
+			/* the owner popped it first */
+			__atomic_store_n(&d->head, head, __ATOMIC_SEQ_CST);
+		} else {
+			task = d->tasks[head & (d->size - 1)];
+		}
+		pthread_mutex_unlock(&d->lock);
+		if (task) {
+			__atomic_sub_fetch(&s->pending, 1, __ATOMIC_SEQ_CST);
+			return task;
+		}
+	}
+	return NULL;
+}
+
+/* Evaluate a future on the current thread. Its error is kept for touch
+ * instead of aborting the current evaluation.
+ */
+static void run_task(struct expr *task)
+{
+	struct future *future = &task->data.future;
+	struct expr *value;
+	__atomic_store_n(&future->state, FUTURE_RUNNING, __ATOMIC_SEQ_CST);
+	value = promote(eval_expr(future->expr));
+	future->error = thread.error;
+	thread.error = ERR_NONE;
+	future->value = value;
+	if (value) {
+		++value->refs;
+	}
+	__atomic_store_n(&future->state, FUTURE_DONE, __ATOMIC_RELEASE);
+}
+
+/* Find a future to run, or return null if there is none.
+ */
+static struct expr *find_task(struct scheduler *s)
+{
+	struct expr *task = pop_task(s);
+	return task ? task : steal_task(s);
+}
+
+static void *run_worker(void *arg)
+{
+	struct scheduler *s = globals.scheduler;
+	struct worker *self = arg;
+	init_thread(self - s->workers);
+	while (1) {
+		struct expr *task = pop_task(s);
+		if (!task && self->stop) {
+			break;
+		}
+		if (!task) {
+			task = steal_task(s);
+		}
+		if (task) {
+			run_task(task);
+			continue;
+		}
+		/* sleep until a future is pushed, announcing it first so
+		   that push_task can not miss it */
+		pthread_mutex_lock(&s->lock);
+		__atomic_add_fetch(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+		while (!self->stop && !__atomic_load_n(&s->pending, __ATOMIC_SEQ_CST)) {
+			pthread_cond_wait(&s->wake, &s->lock);
+		}
+		__atomic_sub_fetch(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&s->lock);
+	}
+	return NULL;
+}
+
+/* Start or stop worker threads until count are running. Returns non-zero
+ * if a thread could not be started.
+ */
+static int set_workers(struct scheduler *s, unsigned int count)
+{
+	unsigned int i;
+	while (s->count < count) {
+		struct worker *w = &s->workers[s->count + 1];
+		if (!w->deque.tasks) {
+			init_deque(&w->deque);
+		}
+		w->stop = 0;
+		if (pthread_create(&w->handle, NULL, run_worker, w)) {
+			return 1;
+		}
+		__atomic_add_fetch(&s->count, 1, __ATOMIC_SEQ_CST);
+	}
+	if (s->count > count) {
+		pthread_mutex_lock(&s->lock);
+		for (i = count + 1; i <= s->count; ++i) {
+			s->workers[i].stop = 1;
+		}
+		pthread_cond_broadcast(&s->wake);
+		pthread_mutex_unlock(&s->lock);
+		for (i = count + 1; i <= s->count; ++i) {
+			pthread_join(s->workers[i].handle, NULL);
+		}
+		/* the deques of stopped workers are empty, so thieves may
+		   still look at them */
+		__atomic_store_n(&s->count, count, __ATOMIC_SEQ_CST);
+	}
+	return 0;
+}
+
+struct expr *bi_future(unsigned int argc, struct expr **argv)
+{
+	struct expr *e;
+	if (check_arg_count(argc, 1)) {
+		return NULL;
+	}
+	e = new_expr(T_FUTURE);
+	/* workers do not allocate in the region of this thread */
+	argv[0] = promote(argv[0]);
+	e->data.future.expr = argv[0];
+	if (argv[0]) {
+		++argv[0]->refs;
+	}
+	e->data.future.value = NULL;
+	e->data.future.error = ERR_NONE;
+	e->data.future.state = FUTURE_PENDING;
+	push_task(globals.scheduler, e);
+	return e;
+}
+
+/* Wait for the value of a future, running other futures meanwhile. Any
+ * other value is returned as is.
+ */
+struct expr *bi_touch(unsigned int argc, struct expr **argv)
+{
+	struct scheduler *s = globals.scheduler;
+	struct future *future;
+	if (check_arg_count(argc, 1)) {
+		return NULL;
+	}
+	if (!argv[0] || argv[0]->type != T_FUTURE) {
+		return argv[0];
+	}
+	/* argv may move while running other futures */
+	future = &argv[0]->data.future;
+	while (__atomic_load_n(&future->state, __ATOMIC_ACQUIRE) != FUTURE_DONE) {
+		struct expr *task = find_task(s);
+		if (task) {
+			run_task(task);
+		} else {
+			/* another thread is running it */
+			sched_yield();
+		}
+	}
+	if (future->error != ERR_NONE) {
+		thread.error = future->error;
+		return NULL;
+	}
+	return future->value;
+}
+
+/* Set the number of worker threads evaluating futures.
+ */
+struct expr *bi_workers(unsigned int argc, struct expr **argv)
+{
+	double count;
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_NUMBER)) {
+		return NULL;
+	}
+	count = argv[0]->data.number;
+	if (thread.id != 0) {
+		fprintf(stderr, "Workers can only be set by the main thread!\n");
+		thread.error = ERR_USER;
+		return NULL;
+	}
+	if (count < 0 || count > MAX_WORKERS || count != (unsigned int) count) {
+		fprintf(stderr, "Invalid number of workers, expected 0 to %d!\n",
+			MAX_WORKERS);
+		thread.error = ERR_USER;
+		return NULL;
+	}
+	if (set_workers(globals.scheduler, count)) {
+		fprintf(stderr, "Can not start worker thread!\n");
+		thread.error = ERR_USER;
+	}
+	return NULL;
+}
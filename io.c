@@ -0,0 +1,329 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "lisp.h"
+
+/* Ports for reading files line by line.
+ *
+ * A regular file is mapped into memory, and lines are found with memchr
+ * without copying. The strings returned for them borrow their data from
+ * the mapping, which is only unmapped once the port is closed and no
+ * borrowed strings are left. Other files, such as pipes, are read
+ * through a large stdio buffer, and their lines are copied.
+ */
+
+#define PORT_BUFFER_SIZE (1 << 20)
+
+/* Open a file for reading. Returns null and sets the global error state
+ * if it can not be opened.
+ */
+struct expr *open_port(const char *path)
+{
+	struct expr *e;
+	struct port *port;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "Can not open %s!\n", path);
+		thread.error = ERR_USER;
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
+	}
+	e = new_expr(T_PORT);
+	port = &e->data.port;
+	port->file = NULL;
+	port->map = NULL;
+	port->size = 0;
+	port->pos = 0;
+	port->borrowers = 0;
+	port->closed = 0;
+	port->line.data = NULL;
+	port->line.len = 0;
+	port->line.size = 0;
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			port->map = map;
+			port->size = st.st_size;
+			close(fd);
+			return e;
+		}
+	}
+	port->file = fdopen(fd, "r");
+	setvbuf(port->file, NULL, _IOFBF, PORT_BUFFER_SIZE);
+	return e;
+}
+
+/* Close the file of a port, keeping a mapping that strings borrow from.
+ */
+static void close_port(struct port *port)
+{
+	port->closed = 1;
+	if (port->file) {
+		fclose(port->file);
+		port->file = NULL;
+	}
+	if (port->map && port->borrowers == 0) {
+		munmap(port->map, port->size);
+		port->map = NULL;
+	}
+}
+
+/* Release the resources of a port that is freed.
+ */
+void free_port(struct port *port)
+{
+	close_port(port);
+	free(port->line.data);
+}
+
+/* Construct a string borrowing len bytes of data from the mapped file of
+ * a port. The data is not null-terminated.
+ */
+struct expr *make_borrowed(struct expr *port, char *data, size_t len)
+{
+	struct expr *e = new_expr(T_STRING);
+	e->data.string.data = data;
+	e->data.string.len = len;
+	e->data.string.port = port;
+	++port->refs;
+	++port->data.port.borrowers;
+	return e;
+}
+
+/* Stop a string from borrowing from its port, when it is freed or
+ * copied.
+ */
+void release_string(struct expr *string)
+{
+	struct expr *port = string->data.string.port;
+	--port->refs;
+	if (--port->data.port.borrowers == 0 && port->data.port.closed) {
+		close_port(&port->data.port);
+	}
+}
+
+/* Read the next line of a port, without the line terminator. Stores its
+ * start in text and its length in len, which counts any null characters
+ * in the line. The text is only valid until the next read, unless the
+ * port is mapped. Returns non-zero at the end of the file.
+ */
+static int read_port_line(struct port *port, char **text, size_t *len)
+{
+	struct buffer *line = &port->line;
+	if (port->map) {
+		char *start = port->map + port->pos;
+		char *end;
+		if (port->pos == port->size) {
+			return 1;
+		}
+		end = memchr(start, '\n', port->size - port->pos);
+		if (!end) {
+			end = port->map + port->size;
+			port->pos = port->size;
+		} else {
+			port->pos = end + 1 - port->map;
+		}
+		*text = start;
+		*len = end - start;
+	} else {
+		ssize_t n;
+		if (!port->file) {
+			return 1;
+		}
+		/* read a whole line, however long, into the buffer, which
+		   getline grows as needed */
+		n = getline(&line->data, &line->size, port->file);
+		if (n <= 0) {
+			line->len = 0;
+			return 1;
+		}
+		line->len = n;
+		*text = line->data;
+		*len = line->len;
+		if (line->data[*len - 1] == '\n') {
+			--*len;
+		}
+	}
+	if (*len > 0 && (*text)[*len - 1] == '\r') {
+		--*len;
+	}
+	return 0;
+}
+
+/* Make a string of the next line of a port, borrowing it if the port is
+ * mapped. Returns null at the end of the file.
+ */
+static struct expr *port_line(struct expr *port)
+{
+	char *text;
+	size_t len;
+	if (read_port_line(&port->data.port, &text, &len)) {
+		return NULL;
+	}
+	if (port->data.port.map && !(thread.region && thread.region->active)) {
+		/* a borrowed string is not kept in a region, see region.c */
+		return make_borrowed(port, text, len);
+	}
+	return make_string(text, len);
+}
+
+/* Check that the argument is a port that has not been closed.
+ */
+static int check_open_port(struct expr *e)
+{
+	if (check_type(e, T_PORT)) {
+		return 1;
+	} else if (e->data.port.closed) {
+		fprintf(stderr, "Port is closed!\n");
+		thread.error = ERR_USER;
+		return 1;
+	}
+	return 0;
+}
+
+/* Make a stream of the expressions in a file, one per line, which are
+ * read as the stream is forced.
+ */
+struct expr *bi_stream_from_file(unsigned int argc, struct expr **argv)
+{
+	struct expr *port;
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_STRING)) {
+		return NULL;
+	}
+	port = open_port(string_text(argv[0]));
+	if (!port) {
+		return NULL;
+	}
+	return bi_port_stream(1, &port);
+}
+
+/* Read the next expression from a port, returning the rest of the stream.
+ */
+struct expr *bi_port_stream(unsigned int argc, struct expr **argv)
+{
+	struct port *port;
+	const char *endptr;
+	char *text;
+	size_t len;
+	struct expr *e;
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_PORT)) {
+		return NULL;
+	}
+	port = &argv[0]->data.port;
+	while (!port->closed && !read_port_line(port, &text, &len)) {
+		if (text != port->line.data) {
+			/* the reader needs a null-terminated copy */
+			port->line.len = 0;
+			buffer_write(&port->line, text, len);
+		} else {
+			port->line.data[len] = '\0';
+		}
+		if (!*skip_spaces(port->line.data)) {
+			continue;
+		}
+		e = read_expr(port->line.data, &endptr);
+		if (thread.error != ERR_NONE) {
+			return NULL;
+		}
+		if (*skip_spaces(endptr)) {
+			fprintf(stderr, "Trailing text \"%s\"!\n", endptr);
+			thread.error = ERR_PARSE;
+			return NULL;
+		}
+		return make_pair(e, make_promise(make_pair(globals.PORT_STREAM,
+							   make_pair(argv[0], NULL))));
+	}
+	close_port(port);
+	return NULL;
+}
+
+struct expr *bi_open_input_file(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_STRING)) {
+		return NULL;
+	}
+	return open_port(string_text(argv[0]));
+}
+
+/* Read the next line of a port, or nil at the end.
+ */
+struct expr *bi_read_line(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 1) || check_open_port(argv[0])) {
+		return NULL;
+	}
+	return port_line(argv[0]);
+}
+
+/* Read the remaining lines of a port as a list.
+ */
+struct expr *bi_read_lines(unsigned int argc, struct expr **argv)
+{
+	struct expr *list = NULL;
+	struct expr **tail = &list;
+	struct expr *line;
+	if (check_arg_count(argc, 1) || check_open_port(argv[0])) {
+		return NULL;
+	}
+	while ((line = port_line(argv[0]))) {
+		*tail = make_pair(line, NULL);
+		if (tail != &list) {
+			++(*tail)->refs;
+		}
+		tail = &(*tail)->data.pair.cdr;
+	}
+	return list;
+}
+
+/* Call a function with each remaining line of a port.
+ */
+struct expr *bi_for_each_line(unsigned int argc, struct expr **argv)
+{
+	struct expr *port;
+	struct expr *f;
+	struct expr *line;
+	if (check_arg_count(argc, 2) || check_open_port(argv[0])) {
+		return NULL;
+	}
+	/* argv may move while calling f */
+	port = argv[0];
+	f = argv[1];
+	while ((line = port_line(port))) {
+		apply_function(f, 1, &line);
+		if (thread.error != ERR_NONE) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+/* Write a string to the standard output, without quotes.
+ */
+struct expr *bi_write_string(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_STRING)) {
+		return NULL;
+	}
+	fwrite(argv[0]->data.string.data, 1, argv[0]->data.string.len, stdout);
+	return NULL;
+}
+
+struct expr *bi_close_port(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_PORT)) {
+		return NULL;
+	}
+	close_port(&argv[0]->data.port);
+	return NULL;
+}
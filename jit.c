@@ -0,0 +1,594 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#ifdef __x86_64__
+#include <sys/mman.h>
+#endif
+
+#include "lisp.h"
+
+/* A tiered just-in-time compiler for numeric lambdas on x86-64.
+ *
+ * A lambda that has been called JIT_THRESHOLD times is compiled if its
+ * body only uses its parameters, number literals, +, -, *, /, if with
+ * < or = as the test, and calls to the lambda itself. Such a body can
+ * only produce numbers, so the only type guard needed is that all
+ * arguments are numbers, which is checked before entering the code.
+ * Everything else is left to the interpreter.
+ *
+ * The compiled code has the C type jit_func. Arguments are passed as an
+ * array of doubles, and intermediate values are kept on the machine stack.
+ * Calls in tail position become jumps. Other recursion is limited to
+ * JIT_MAX_DEPTH calls, after which the code sets *bail and returns. The
+ * call is then redone by the interpreter, which is safe since the code
+ * has no side effects. The code also bails when the evaluation runs out
+ * of fuel, using up one step for every call. The fuel is that of the main
+ * thread, which is the only one running compiled code, see future.c.
+ *
+ * The globals that the code depends on, e.g. the builtin bound to +, are
+ * recorded as guards and checked again whenever a variable has been
+ * redefined, see globals.epoch.
+ */
+
+#define JIT_MAX_PARAMS 16
+#define JIT_MAX_DEPTH 10000
+
+typedef double (*jit_func)(const double *args, long depth, int *bail);
+
+/* A global variable the compiled code assumes to be unchanged.
+ */
+struct jit_guard {
+	const char *symbol;
+	struct expr *value;
+};
+
+struct jit_code {
+	/* null if the lambda can not be compiled */
+	void *code;
+	size_t size;
+	unsigned int param_count;
+	struct jit_guard *guards;
+	size_t guards_count;
+	unsigned long epoch;
+	/* depth of the evaluation stack when the code last bailed */
+	size_t bailed_at;
+};
+
+/* State while compiling a single lambda.
+ */
+struct jit_state {
+	struct expr *self;
+	unsigned int param_count;
+	/* offset of the start of the body */
+	size_t body;
+	struct buffer code;
+	struct jit_guard *guards;
+	size_t guards_count;
+	size_t guards_size;
+	/* offsets of jumps to the epilogue */
+	size_t *exits;
+	size_t exits_count;
+	size_t exits_size;
+};
+
+#ifdef __x86_64__
+
+/* Emit len bytes of machine code.
+ */
+static void emit(struct jit_state *st, const char *bytes, size_t len)
+{
+	buffer_write(&st->code, bytes, len);
+}
+
+static void emit_u32(struct jit_state *st, unsigned long v)
+{
+	char bytes[4];
+	int i;
+	for (i = 0; i < 4; ++i) {
+		bytes[i] = (char) ((v >> (8 * i)) & 0xff);
+	}
+	emit(st, bytes, 4);
+}
+
+/* Patch the 32 bit relative jump whose offset ends at end to jump to
+ * target.
+ */
+static void patch_jump(struct jit_state *st, size_t end, size_t target)
+{
+	unsigned long rel = (unsigned long) (target - end);
+	int i;
+	for (i = 0; i < 4; ++i) {
+		st->code.data[end - 4 + i] = (char) ((rel >> (8 * i)) & 0xff);
+	}
+}
+
+/* Emit a jump instruction with a 32 bit offset to be patched later,
+ * returning the offset after it.
+ */
+static size_t emit_jump(struct jit_state *st, const char *op, size_t len)
+{
+	emit(st, op, len);
+	emit_u32(st, 0);
+	return st->code.len;
+}
+
+/* Emit a jump to the epilogue, which is patched when it is emitted.
+ */
+static void emit_exit(struct jit_state *st, const char *op, size_t len)
+{
+	size_t end = emit_jump(st, op, len);
+	if (st->exits_count == st->exits_size) {
+		st->exits_size = st->exits_size ? 2 * st->exits_size : 16;
+		st->exits = realloc(st->exits, st->exits_size * sizeof *st->exits);
+		assert(st->exits);
+	}
+	st->exits[st->exits_count++] = end;
+}
+
+/* sub rsp, 8; movsd [rsp], xmm0 */
+static void emit_push(struct jit_state *st)
+{
+	emit(st, "\x48\x83\xec\x08\xf2\x0f\x11\x04\x24", 9);
+}
+
+/* movapd xmm1, xmm0; movsd xmm0, [rsp]; add rsp, 8 */
+static void emit_pop_lhs(struct jit_state *st)
+{
+	emit(st, "\x66\x0f\x28\xc8\xf2\x0f\x10\x04\x24\x48\x83\xc4\x08", 13);
+}
+
+/* mov rax, number; movq xmm0, rax */
+static void emit_number(struct jit_state *st, double number)
+{
+	char bytes[sizeof number];
+	memcpy(bytes, &number, sizeof number);
+	emit(st, "\x48\xb8", 2);
+	emit(st, bytes, sizeof bytes);
+	emit(st, "\x66\x48\x0f\x6e\xc0", 5);
+}
+
+/* Look up the global value of a symbol and record it as a guard.
+ * Returns null if it is not defined, or is to be recomputed, see
+ * depend.c.
+ */
+static struct expr *resolve(struct jit_state *st, const char *symbol)
+{
+	struct variable *v = find_variable(symbol);
+	if (!v || v->stale) {
+		return NULL;
+	}
+	if (st->guards_count == st->guards_size) {
+		st->guards_size = st->guards_size ? 2 * st->guards_size : 8;
+		st->guards = realloc(st->guards,
+				     st->guards_size * sizeof *st->guards);
+		assert(st->guards);
+	}
+	st->guards[st->guards_count].symbol = symbol;
+	st->guards[st->guards_count].value = v->value;
+	++st->guards_count;
+	return v->value;
+}
+
+/* Get the index of a parameter, or -1 if the symbol is not a parameter.
+ */
+static int param_index(struct jit_state *st, const char *symbol)
+{
+	struct expr *p = st->self->data.lambda.params;
+	int i = 0;
+	while (p) {
+		if (p->data.pair.car->data.symbol == symbol) {
+			return i;
+		}
+		p = p->data.pair.cdr;
+		++i;
+	}
+	return -1;
+}
+
+static int compile_expr(struct jit_state *st, struct expr *e, int tail);
+
+/* Compile arithmetic on a list of arguments, following bi_sum, bi_prod,
+ * bi_diff and bi_quot exactly.
+ */
+static int compile_arith(struct jit_state *st, func_t func, struct expr *args)
+{
+	unsigned int argc = list_length(args);
+	const char *op;
+	if (func == bi_sum) {
+		op = "\xf2\x0f\x58\xc1";
+	} else if (func == bi_prod) {
+		op = "\xf2\x0f\x59\xc1";
+	} else if (func == bi_diff) {
+		op = "\xf2\x0f\x5c\xc1";
+	} else {
+		op = "\xf2\x0f\x5e\xc1";
+	}
+	if (argc == 0) {
+		emit_number(st, func == bi_prod ? 1 : 0);
+		return 0;
+	}
+	if (func == bi_sum) {
+		/* the sum starts from 0, which matters for -0 */
+		emit_number(st, 0);
+	} else {
+		if (compile_expr(st, args->data.pair.car, 0)) {
+			return 1;
+		}
+		args = args->data.pair.cdr;
+		if (func == bi_diff && argc == 1) {
+			/* negate by flipping the sign bit */
+			emit(st, "\x66\x0f\x28\xc8", 4);
+			emit_number(st, -0.0);
+			emit(st, "\x66\x0f\x57\xc1", 4);
+			return 0;
+		}
+	}
+	while (args) {
+		emit_push(st);
+		if (compile_expr(st, args->data.pair.car, 0)) {
+			return 1;
+		}
+		emit_pop_lhs(st);
+		emit(st, op, 4);
+		args = args->data.pair.cdr;
+	}
+	return 0;
+}
+
+/* Compile an if whose test is a numeric comparison.
+ */
+static int compile_if(struct jit_state *st, struct expr *args, int tail)
+{
+	struct expr *test;
+	struct expr *cmp;
+	size_t to_else[2];
+	size_t to_else_count;
+	size_t to_end;
+	if (list_length(args) != 3) {
+		return 1;
+	}
+	test = args->data.pair.car;
+	if (!test
+	    || test->type != T_PAIR
+	    || !test->data.pair.car
+	    || test->data.pair.car->type != T_SYMBOL
+	    || param_index(st, test->data.pair.car->data.symbol) >= 0
+	    || list_length(test) != 3) {
+		return 1;
+	}
+	cmp = resolve(st, test->data.pair.car->data.symbol);
+	if (!cmp
+	    || cmp->type != T_BUILTIN
+	    || (cmp->data.builtin.func != bi_numle
+		&& cmp->data.builtin.func != bi_numeq)) {
+		return 1;
+	}
+	if (compile_expr(st, list_index(test, 1), 0)) {
+		return 1;
+	}
+	emit_push(st);
+	if (compile_expr(st, list_index(test, 2), 0)) {
+		return 1;
+	}
+	emit_pop_lhs(st);
+	if (cmp->data.builtin.func == bi_numle) {
+		/* ucomisd xmm1, xmm0; jbe else, which is also taken for nan */
+		emit(st, "\x66\x0f\x2e\xc8", 4);
+		to_else[0] = emit_jump(st, "\x0f\x86", 2);
+		to_else_count = 1;
+	} else {
+		/* ucomisd xmm0, xmm1; jne else; jp else */
+		emit(st, "\x66\x0f\x2e\xc1", 4);
+		to_else[0] = emit_jump(st, "\x0f\x85", 2);
+		to_else[1] = emit_jump(st, "\x0f\x8a", 2);
+		to_else_count = 2;
+	}
+	if (compile_expr(st, list_index(args, 1), tail)) {
+		return 1;
+	}
+	to_end = emit_jump(st, "\xe9", 1);
+	while (to_else_count > 0) {
+		patch_jump(st, to_else[--to_else_count], st->code.len);
+	}
+	if (compile_expr(st, list_index(args, 2), tail)) {
+		return 1;
+	}
+	patch_jump(st, to_end, st->code.len);
+	return 0;
+}
+
+/* Compile a call of the lambda being compiled. Calls in tail position
+ * replace the parameters and jump back to the start of the body.
+ */
+static int compile_self_call(struct jit_state *st, struct expr *args, int tail)
+{
+	unsigned int argc = list_length(args);
+	unsigned int i;
+	if (argc != st->param_count) {
+		return 1;
+	}
+	/* push the arguments in reverse, so that the first is at rsp */
+	for (i = argc; i > 0; --i) {
+		if (compile_expr(st, list_index(args, i - 1), 0)) {
+			return 1;
+		}
+		emit_push(st);
+	}
+	if (tail) {
+		for (i = 0; i < argc; ++i) {
+			/* movsd xmm0, [rsp]; add rsp, 8; movsd [rbx + 8 * i], xmm0 */
+			emit(st, "\xf2\x0f\x10\x04\x24\x48\x83\xc4\x08"
+			     "\xf2\x0f\x11\x83", 13);
+			emit_u32(st, 8 * i);
+		}
+		patch_jump(st, emit_jump(st, "\xe9", 1), st->body);
+		return 0;
+	}
+	/* mov rdi, rsp; lea rsi, [r12 - 1]; mov rdx, r13; call entry */
+	emit(st, "\x48\x89\xe7\x49\x8d\x74\x24\xff\x4c\x89\xea\xe8", 12);
+	emit_u32(st, (unsigned long) (0 - (st->code.len + 4)));
+	if (argc > 0) {
+		/* add rsp, 8 * argc */
+		emit(st, "\x48\x81\xc4", 3);
+		emit_u32(st, 8 * argc);
+	}
+	/* cmp dword [r13], 0; jne epilogue */
+	emit(st, "\x41\x83\x7d\x00\x00", 5);
+	emit_exit(st, "\x0f\x85", 2);
+	return 0;
+}
+
+/* Compile an expression, leaving its value in xmm0. tail is non-zero if
+ * the value is returned from the lambda.
+ * Returns non-zero if the expression is not supported.
+ */
+static int compile_expr(struct jit_state *st, struct expr *e, int tail)
+{
+	struct expr *f;
+	int i;
+	if (!e) {
+		return 1;
+	} else if (e->type == T_NUMBER) {
+		emit_number(st, e->data.number);
+		return 0;
+	} else if (e->type == T_SYMBOL) {
+		i = param_index(st, e->data.symbol);
+		if (i < 0) {
+			return 1;
+		}
+		/* movsd xmm0, [rbx + 8 * i] */
+		emit(st, "\xf2\x0f\x10\x83", 4);
+		emit_u32(st, 8 * i);
+		return 0;
+	} else if (e->type != T_PAIR
+		   || !e->data.pair.car
+		   || e->data.pair.car->type != T_SYMBOL
+		   || param_index(st, e->data.pair.car->data.symbol) >= 0) {
+		return 1;
+	}
+	f = resolve(st, e->data.pair.car->data.symbol);
+	if (f == st->self) {
+		return compile_self_call(st, e->data.pair.cdr, tail);
+	} else if (!f || f->type != T_BUILTIN) {
+		return 1;
+	} else if (f->data.builtin.spec_form == SF_IF) {
+		return compile_if(st, e->data.pair.cdr, tail);
+	} else if (f->data.builtin.func == bi_sum
+		   || f->data.builtin.func == bi_prod
+		   || f->data.builtin.func == bi_diff
+		   || f->data.builtin.func == bi_quot) {
+		return compile_arith(st, f->data.builtin.func, e->data.pair.cdr);
+	}
+	return 1;
+}
+
+/* Compile the body of the lambda into st->code.
+ */
+static int compile_lambda(struct jit_state *st)
+{
+	size_t bail;
+	size_t no_fuel;
+	unsigned long *fuel_ptr = &thread.fuel;
+	char fuel[sizeof fuel_ptr];
+	unsigned int i;
+	/* push rbp; mov rbp, rsp; push rbx; push r12; push r13;
+	   mov r12, rsi; mov r13, rdx;
+	   test r12, r12; jz bail */
+	emit(st, "\x55\x48\x89\xe5\x53\x41\x54\x41\x55"
+	     "\x49\x89\xf4\x49\x89\xd5\x4d\x85\xe4", 18);
+	bail = emit_jump(st, "\x0f\x84", 2);
+	/* copy the arguments to the stack, where tail calls can replace
+	   them: sub rsp, 8 * param_count; mov rbx, rsp */
+	emit(st, "\x48\x81\xec", 3);
+	emit_u32(st, 8 * st->param_count);
+	emit(st, "\x48\x89\xe3", 3);
+	for (i = 0; i < st->param_count; ++i) {
+		/* movsd xmm0, [rdi + 8 * i]; movsd [rbx + 8 * i], xmm0 */
+		emit(st, "\xf2\x0f\x10\x87", 4);
+		emit_u32(st, 8 * i);
+		emit(st, "\xf2\x0f\x11\x83", 4);
+		emit_u32(st, 8 * i);
+	}
+	/* every call uses up one step of fuel, and the interpreter
+	   reports when it is exhausted:
+	   mov rax, &thread.fuel; cmp qword [rax], 0; je bail;
+	   dec qword [rax] */
+	st->body = st->code.len;
+	emit(st, "\x48\xb8", 2);
+	memcpy(fuel, &fuel_ptr, sizeof fuel);
+	emit(st, fuel, sizeof fuel);
+	emit(st, "\x48\x83\x38\x00", 4);
+	no_fuel = emit_jump(st, "\x0f\x84", 2);
+	emit(st, "\x48\xff\x08", 3);
+	if (compile_expr(st, st->self->data.lambda.body, 1)) {
+		return 1;
+	}
+	emit_exit(st, "\xe9", 1);
+	/* bail: mov dword [r13], 1 */
+	patch_jump(st, bail, st->code.len);
+	patch_jump(st, no_fuel, st->code.len);
+	emit(st, "\x41\xc7\x45\x00\x01\x00\x00\x00", 8);
+	/* epilogue: lea rsp, [rbp - 24]; pop r13; pop r12; pop rbx;
+	   pop rbp; ret */
+	while (st->exits_count > 0) {
+		patch_jump(st, st->exits[--st->exits_count], st->code.len);
+	}
+	emit(st, "\x48\x8d\x65\xe8\x41\x5d\x41\x5c\x5b\x5d\xc3", 11);
+	return 0;
+}
+
+#endif
+
+/* Try to compile a lambda, storing the result in its jit field.
+ */
+void jit_compile(struct expr *lambda)
+{
+	struct jit_code *jit = malloc(sizeof *jit);
+	struct jit_state st;
+	struct expr *p;
+	jit->code = NULL;
+	jit->size = 0;
+	jit->guards = NULL;
+	jit->guards_count = 0;
+	jit->param_count = 0;
+	for (p = lambda->data.lambda.params; p && p->type == T_PAIR; p = p->data.pair.cdr) {
+		++jit->param_count;
+	}
+	jit->epoch = globals.epoch;
+	jit->bailed_at = 0;
+	lambda->data.lambda.jit = jit;
+	region_compiled(lambda);
+	st.self = lambda;
+	st.param_count = jit->param_count;
+	st.body = 0;
+	st.code.data = NULL;
+	st.code.len = 0;
+	st.code.size = 0;
+	st.guards = NULL;
+	st.guards_count = 0;
+	st.guards_size = 0;
+	st.exits = NULL;
+	st.exits_count = 0;
+	st.exits_size = 0;
+#ifdef __x86_64__
+	if (!p && jit->param_count <= JIT_MAX_PARAMS && !compile_lambda(&st)) {
+		void *code = mmap(NULL, st.code.len, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (code != MAP_FAILED) {
+			memcpy(code, st.code.data, st.code.len);
+			if (!mprotect(code, st.code.len, PROT_READ | PROT_EXEC)) {
+				jit->code = code;
+				jit->size = st.code.len;
+				jit->guards = st.guards;
+				jit->guards_count = st.guards_count;
+				st.guards = NULL;
+			} else {
+				munmap(code, st.code.len);
+			}
+		}
+	}
+#endif
+	if (globals.debug) {
+		fprintf(stderr, "%s lambda: ", jit->code ? "Compiled" : "Could not compile");
+		print_expr(lambda, stderr);
+		putc('\n', stderr);
+	}
+	free(st.code.data);
+	free(st.guards);
+	free(st.exits);
+}
+
+/* Release the code of a compiled lambda, leaving it to the interpreter.
+ */
+void jit_free(struct jit_code *jit)
+{
+#ifdef __x86_64__
+	if (jit->code) {
+		munmap(jit->code, jit->size);
+	}
+#endif
+	free(jit->guards);
+	free(jit);
+}
+
+/* Check that the globals that the code depends on are unchanged, and
+ * discard the code otherwise.
+ */
+static int check_guards(struct jit_code *jit)
+{
+	size_t i;
+	for (i = 0; i < jit->guards_count; ++i) {
+		struct variable *v = find_variable(jit->guards[i].symbol);
+		if (!v || v->stale || v->value != jit->guards[i].value) {
+#ifdef __x86_64__
+			munmap(jit->code, jit->size);
+#endif
+			jit->code = NULL;
+			return 1;
+		}
+	}
+	jit->epoch = globals.epoch;
+	return 0;
+}
+
+/* Count a call of the lambda, compiling it when it gets hot, and run the
+ * compiled code if there is any and the arguments are numbers. Returns
+ * non-zero and stores the result in value if the call was handled.
+ */
+int jit_call(struct expr *lambda, unsigned int argc, struct expr **argv,
+	     struct expr **value)
+{
+	struct jit_code *jit = lambda->data.lambda.jit;
+	double args[JIT_MAX_PARAMS];
+	unsigned int i;
+	double result;
+	int bail = 0;
+	union {
+		void *code;
+		jit_func func;
+	} entry;
+	if (!jit) {
+		if (++lambda->data.lambda.calls < JIT_THRESHOLD) {
+			return 0;
+		}
+		jit_compile(lambda);
+		jit = lambda->data.lambda.jit;
+	}
+	if (!jit->code || (jit->epoch != globals.epoch && check_guards(jit))) {
+		return 0;
+	}
+	if (jit->bailed_at) {
+		/* the interpreter is redoing a call that recursed too deep,
+		   so let it handle the nested calls as well */
+		if (thread.frames_count > jit->bailed_at) {
+			return 0;
+		}
+		jit->bailed_at = 0;
+	}
+	if (argc != jit->param_count) {
+		return 0;
+	}
+	for (i = 0; i < argc; ++i) {
+		if (!argv[i] || argv[i]->type != T_NUMBER) {
+			return 0;
+		}
+		args[i] = argv[i]->data.number;
+	}
+	entry.code = jit->code;
+	result = entry.func(args, JIT_MAX_DEPTH, &bail);
+	if (bail) {
+		jit->bailed_at = thread.frames_count;
+		return 0;
+	}
+	if (thread.defining) {
+		/* the globals read by the code are those it guards */
+		for (i = 0; i < jit->guards_count; ++i) {
+			record_read(find_variable(jit->guards[i].symbol));
+		}
+	}
+	*value = make_number(result);
+	return 1;
+}
@@ -4,33 +4,167 @@
 #include <stdio.h>
 #include <math.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "lisp.h"
 
+struct globals globals;
+__thread struct thread thread;
+
 /* These characters, as well as spaces, are not allowed in symbols. */
 const char *NON_SYMBOL_CHARS = "'()\".";
 
+/* Classes of characters used by the reader, see CHAR_CLASS. */
+#define C_SPACE 1
+#define C_DELIM 2
+#define C_DIGIT 4
+
+/* Class of every character, indexed by unsigned char. Filled in by
+ * init_char_classes so that the reader does not need to call isspace
+ * and strchr for every character.
+ */
+unsigned char CHAR_CLASS[256];
+
+/* Powers of ten that are exactly representable as doubles. */
+const double POW10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
 const char *TYPE_NAMES[] = {
 	"symbol",
 	"number",
 	"string",
 	"pair",
 	"builtin",
-	"lambda"
+	"lambda",
+	"continuation",
+	"promise",
+	"port",
+	"future",
+	"generator",
+	"memo",
+	"foreign",
+	"f64"
 };
 
-/* Initialize all global state.
+static void unhash_expr(struct expr *e);
+
+/* Initialize the state of the current thread, which gets the given id.
  */
-void init_globals(void) {
-	globals.symbols_size = 100;
-	globals.symbols = malloc(globals.symbols_size * sizeof *globals.symbols);
-	globals.symbols_count = 0;
-	globals.exprs_size = 100;
-	globals.exprs = malloc(globals.exprs_size * sizeof *globals.exprs);
-	globals.exprs_count = 0;
-	globals.variables = NULL;
-	globals.error = ERR_NONE;
-	globals.debug = 0;
+void init_thread(unsigned int id)
+{
+	thread.id = id;
+	thread.error = ERR_NONE;
+	thread.out.data = NULL;
+	thread.out.len = 0;
+	thread.out.size = 0;
+	thread.print_stack = NULL;
+	thread.print_stack_size = 0;
+	thread.read_stack = NULL;
+	thread.read_stack_size = 0;
+	thread.frames = NULL;
+	thread.frames_count = 0;
+	thread.frames_size = 0;
+	thread.values = NULL;
+	thread.values_count = 0;
+	thread.values_size = 0;
+	thread.fuel = (unsigned long) -1;
+	thread.calls = 0;
+	thread.heap = 0;
+	thread.heap_max = (size_t) -1;
+	thread.evaluating = 0;
+	thread.free_exprs = NULL;
+	thread.chunk = NULL;
+	thread.chunk_left = 0;
+	thread.trace = NULL;
+	thread.defining = 0;
+	thread.reads = NULL;
+	thread.reads_count = 0;
+	thread.reads_size = 0;
+	thread.region = NULL;
+}
+
+#define BUILTIN_DEF(name, func, sf) {name, func, sf, #func}
+
+/* The builtins of the prelude, see create_prelude.
+ */
+const struct builtin_def BUILTIN_DEFS[] = {
+	BUILTIN_DEF("define", NULL, SF_DEFINE),
+	BUILTIN_DEF("lambda", bi_lambda, SF_QUOTED),
+	BUILTIN_DEF("if", NULL, SF_IF),
+	BUILTIN_DEF("apply", NULL, SF_APPLY),
+	BUILTIN_DEF("call/cc", NULL, SF_CALLCC),
+	BUILTIN_DEF("delay", bi_delay, SF_QUOTED),
+	BUILTIN_DEF("force", NULL, SF_FORCE),
+	BUILTIN_DEF("make-generator", bi_make_generator, SF_NONE),
+	BUILTIN_DEF("next", NULL, SF_NEXT),
+	BUILTIN_DEF("yield", NULL, SF_YIELD),
+	BUILTIN_DEF("quote", bi_quote, SF_QUOTED),
+	BUILTIN_DEF("cons", bi_cons, SF_NONE),
+	BUILTIN_DEF("car", bi_car, SF_NONE),
+	BUILTIN_DEF("cdr", bi_cdr, SF_NONE),
+	BUILTIN_DEF("eq", bi_eq, SF_NONE),
+	BUILTIN_DEF("list", bi_list, SF_NONE),
+	BUILTIN_DEF("append", bi_append, SF_NONE),
+	BUILTIN_DEF("+", bi_sum, SF_NONE),
+	BUILTIN_DEF("*", bi_prod, SF_NONE),
+	BUILTIN_DEF("-", bi_diff, SF_NONE),
+	BUILTIN_DEF("/", bi_quot, SF_NONE),
+	BUILTIN_DEF("^", bi_pow, SF_NONE),
+	BUILTIN_DEF("<", bi_numle, SF_NONE),
+	BUILTIN_DEF("=", bi_numeq, SF_NONE),
+	BUILTIN_DEF("and", NULL, SF_AND),
+	BUILTIN_DEF("or", NULL, SF_OR),
+	BUILTIN_DEF("pair", bi_pair, SF_NONE),
+	BUILTIN_DEF("debug", bi_debug, SF_NONE),
+	BUILTIN_DEF("exit", bi_exit, SF_NONE),
+	BUILTIN_DEF("to-string", bi_to_string, SF_NONE),
+	BUILTIN_DEF("jit", bi_jit, SF_NONE),
+	BUILTIN_DEF("equal", bi_equal, SF_NONE),
+	BUILTIN_DEF("hash-cons", bi_hash_cons, SF_NONE),
+	BUILTIN_DEF("hash-quotes", bi_hash_quotes, SF_NONE),
+	BUILTIN_DEF("read-data", bi_read_data, SF_NONE),
+	BUILTIN_DEF("require", bi_require, SF_NONE),
+	BUILTIN_DEF("stream-from-file", bi_stream_from_file, SF_NONE),
+	BUILTIN_DEF("open-input-file", bi_open_input_file, SF_NONE),
+	BUILTIN_DEF("read-line", bi_read_line, SF_NONE),
+	BUILTIN_DEF("read-lines", bi_read_lines, SF_NONE),
+	BUILTIN_DEF("for-each-line", bi_for_each_line, SF_NONE),
+	BUILTIN_DEF("write-string", bi_write_string, SF_NONE),
+	BUILTIN_DEF("close-port", bi_close_port, SF_NONE),
+	BUILTIN_DEF("future", bi_future, SF_QUOTED),
+	BUILTIN_DEF("touch", bi_touch, SF_NONE),
+	BUILTIN_DEF("workers", bi_workers, SF_NONE),
+	BUILTIN_DEF("perf-stat", bi_perf_stat, SF_QUOTED),
+	BUILTIN_DEF("trace", bi_trace, SF_NONE),
+	BUILTIN_DEF("memoize", bi_memoize, SF_NONE),
+	BUILTIN_DEF("memo-stats", bi_memo_stats, SF_NONE),
+	BUILTIN_DEF("trace-dump", bi_trace_dump, SF_NONE),
+	BUILTIN_DEF("fuse", bi_fuse, SF_NONE),
+	BUILTIN_DEF("ffi-load", bi_ffi_load, SF_NONE),
+	BUILTIN_DEF("ffi-func", bi_ffi_func, SF_NONE),
+	BUILTIN_DEF("make-f64", bi_make_f64, SF_NONE),
+	BUILTIN_DEF("f64-ref", bi_f64_ref, SF_NONE),
+	BUILTIN_DEF("f64-set", bi_f64_set, SF_NONE),
+	BUILTIN_DEF("f64-length", bi_f64_length, SF_NONE)
+};
+
+const size_t BUILTIN_DEFS_COUNT = sizeof BUILTIN_DEFS / sizeof *BUILTIN_DEFS;
+
+const struct builtin_def PORT_STREAM_DEF =
+	BUILTIN_DEF("port-stream", bi_port_stream, SF_NONE);
+
+/* Create the variables of the prelude, and the symbols and expressions
+ * they refer to. The symbol table must exist. Programs do not call this
+ * at startup: preludegen.c runs it when building, and writes the result
+ * as static data in prelude.c, whose load_prelude installs it.
+ */
+void create_prelude(void)
+{
+	size_t i;
 	globals.TRUE = make_symbol("true");
 	set_variable(save_symbol("true"), globals.TRUE);
 	globals.FALSE = make_symbol("false");
@@ -38,71 +172,189 @@ void init_globals(void) {
 	/* create built-in variables */
 	set_variable(save_symbol("pi"),
 		     make_number(3.14159265358979323846));
-	create_builtin("define", bi_define, 1);
-	create_builtin("lambda", bi_lambda, 1);
-	create_builtin("if", bi_if, 1);
-	create_builtin("apply", bi_apply, 0);
-	create_builtin("quote", bi_quote, 1);
-	create_builtin("cons", bi_cons, 0);
-	create_builtin("car", bi_car, 0);
-	create_builtin("cdr", bi_cdr, 0);
-	create_builtin("eq", bi_eq, 0);
-	create_builtin("list", bi_list, 0);
-	create_builtin("append", bi_append, 0);
-	create_builtin("+", bi_sum, 0);
-	create_builtin("*", bi_prod, 0);
-	create_builtin("-", bi_diff, 0);
-	create_builtin("/", bi_quot, 0);
-	create_builtin("^", bi_pow, 0);
-	create_builtin("<", bi_numle, 0);
-	create_builtin("=", bi_numeq, 0);
-	create_builtin("and", bi_and, 1);
-	create_builtin("or", bi_or, 1);
-	create_builtin("pair", bi_pair, 0);
-	create_builtin("debug", bi_debug, 0);
-	create_builtin("exit", bi_exit, 0);
+	for (i = 0; i < BUILTIN_DEFS_COUNT; ++i) {
+		create_builtin(BUILTIN_DEFS[i].name,
+			       BUILTIN_DEFS[i].func,
+			       BUILTIN_DEFS[i].spec_form);
+	}
+	globals.PORT_STREAM = make_builtin(PORT_STREAM_DEF.name,
+					   PORT_STREAM_DEF.func,
+					   PORT_STREAM_DEF.spec_form);
 	create_function("not", "(e)", "(if e false true)");
 	create_function("null", "(e)", "(eq e ())");
 	create_function("<=", "(lhs rhs)", "(or (< lhs rhs) (= rhs lhs))");
 	create_function(">", "(lhs rhs)", "(not (<= lhs rhs))");
 	create_function(">=", "(lhs rhs)", "(not (< lhs rhs))");
 	create_function("abs", "(x)", "(if (< x 0) (- x) x)");
-	create_function("equal",
-			"(x y)",
-			"(if (and (pair x) (pair y)) (and (equal (car x) (car y)) (equal (cdr x) (cdr y))) (eq x y))");
 	create_function("map",
 			"(f lst)",
 			"(if (null lst) () (cons (f (car lst)) (map f (cdr lst))))");
+	create_function("filter",
+			"(p lst)",
+			"(if (null lst) () (if (p (car lst)) (cons (car lst) (filter p (cdr lst))) (filter p (cdr lst))))");
+	create_function("fold",
+			"(f acc lst)",
+			"(if (null lst) acc (fold f (f acc (car lst)) (cdr lst)))");
 	create_function("length",
 			"(lst)",
 			"(apply + (map (lambda (e) 1) lst))");
+	globals.MAP = get_variable(save_symbol("map"));
+	globals.FILTER = get_variable(save_symbol("filter"));
+	globals.FOLD = get_variable(save_symbol("fold"));
+	globals.LENGTH = get_variable(save_symbol("length"));
 	/* create_function("reverse", "(lst)", "" */
 	create_function("member",
 			"(e lst)",
 			"(if (null lst) false (or (equal e (car lst)) (member e (cdr lst))))");
+	/* streams are lists whose cdr is a promise of the rest */
+	create_function("stream-cdr", "(s)", "(force (cdr s))");
+	create_function("stream-map",
+			"(f s)",
+			"(if (null s) () (cons (f (car s)) (delay (stream-map f (stream-cdr s)))))");
+	create_function("stream-filter",
+			"(p s)",
+			"(if (null s) () (if (p (car s)) (cons (car s) (delay (stream-filter p (stream-cdr s)))) (stream-filter p (stream-cdr s))))");
+	create_function("stream-take",
+			"(n s)",
+			"(if (or (< n 1) (null s)) () (cons (car s) (delay (stream-take (- n 1) (stream-cdr s)))))");
+	create_function("stream-fold",
+			"(f acc s)",
+			"(if (null s) acc (stream-fold f (f acc (car s)) (stream-cdr s)))");
+	/* generators end by giving nil */
+	create_function("yield-map",
+			"(f g)",
+			"((lambda (x) (if (null x) () ((lambda (y) (yield-map f g)) (yield (f x))))) (next g))");
+	create_function("generator-map",
+			"(f g)",
+			"(make-generator (lambda () (yield-map f g)))");
+	create_function("generator-fold",
+			"(f acc g)",
+			"((lambda (x) (if (null x) acc (generator-fold f (f acc x) g))) (next g))");
+}
+
+/* Initialize all global state, and the state of the current thread.
+ */
+void init_globals(void) {
+	init_char_classes();
+	init_thread(0);
+	globals.symbol_chunks = NULL;
+	pthread_mutex_init(&globals.symbols_lock, NULL);
+	globals.exprs_size = 0;
+	globals.exprs = NULL;
+	globals.exprs_count = 0;
+	globals.variables = NULL;
+	pthread_mutex_init(&globals.variables_lock, NULL);
+	globals.debug = 0;
+	globals.jit = 1;
+	globals.trace = 0;
+	globals.profile = 0;
+	globals.fuse = 1;
+	globals.regions = 0;
+	globals.epoch = 0;
+	globals.hashed = NULL;
+	globals.hashed_size = 0;
+	globals.hashed_count = 0;
+	pthread_mutex_init(&globals.hashed_lock, NULL);
+	globals.hash_quotes = 0;
+	globals.limits.fuel = 0;
+	globals.limits.heap = 0;
+	globals.limits.depth = 0;
+	globals.module_path = getenv("LISP_PATH") ? getenv("LISP_PATH") : ".";
+	globals.modules = NULL;
+	globals.scheduler = make_scheduler();
+	load_prelude();
 }
 
-/* Free a single expression.
+/* Free a single expression, putting it on the free list of the current
+ * thread.
  */
 void free_expr(struct expr *e)
 {
+	if (e->hashed) {
+		pthread_mutex_lock(&globals.hashed_lock);
+		unhash_expr(e);
+		pthread_mutex_unlock(&globals.hashed_lock);
+	}
 	switch (e->type) {
 	case T_SYMBOL:
 	case T_NUMBER:
 		break;
 	case T_STRING:
-		free(e->data.string);
+		if (e->data.string.port) {
+			release_string(e);
+		} else {
+			thread.heap -= e->data.string.len + 1;
+			free(e->data.string.data);
+		}
 		break;
 	case T_PAIR:
-		--e->data.pair.car->refs;
-		--e->data.pair.cdr->refs;
+		if (e->data.pair.car) {
+			--e->data.pair.car->refs;
+		}
+		if (e->data.pair.cdr) {
+			--e->data.pair.cdr->refs;
+		}
 		break;
 	case T_BUILTIN:
-	case T_LAMBDA:
 		/* TODO */
 		break;
+	case T_LAMBDA:
+		if (e->data.lambda.jit) {
+			jit_free(e->data.lambda.jit);
+		}
+		break;
+	case T_CONTINUATION:
+		thread.heap -= e->data.continuation.count
+			* sizeof *e->data.continuation.frames;
+		thread.heap -= e->data.continuation.values_count
+			* sizeof *e->data.continuation.values;
+		free(e->data.continuation.frames);
+		free(e->data.continuation.values);
+		break;
+	case T_PROMISE:
+		if (e->data.promise.expr) {
+			--e->data.promise.expr->refs;
+		}
+		if (e->data.promise.value) {
+			--e->data.promise.value->refs;
+		}
+		break;
+	case T_PORT:
+		free_port(&e->data.port);
+		break;
+	case T_FUTURE:
+		if (e->data.future.expr) {
+			--e->data.future.expr->refs;
+		}
+		if (e->data.future.value) {
+			--e->data.future.value->refs;
+		}
+		break;
+	case T_GENERATOR:
+		if (e->data.generator.function) {
+			--e->data.generator.function->refs;
+		}
+		thread.heap -= e->data.generator.frames_size
+			* sizeof *e->data.generator.frames;
+		thread.heap -= e->data.generator.values_size
+			* sizeof *e->data.generator.values;
+		free(e->data.generator.frames);
+		free(e->data.generator.values);
+		break;
+	case T_MEMO:
+		free_memo(&e->data.memo);
+		break;
+	case T_FOREIGN:
+		free(e->data.foreign.name);
+		break;
+	case T_F64:
+		thread.heap -= e->data.f64.len * sizeof *e->data.f64.data;
+		free(e->data.f64.data);
+		break;
 	}
-	free(e);
+	thread.heap -= sizeof *e;
+	e->data.pair.cdr = thread.free_exprs;
+	thread.free_exprs = e;
 }
 
 /* Free all unused expressions, collecting garbage.
@@ -110,6 +362,9 @@ void free_expr(struct expr *e)
 void free_unused()
 {
 	size_t freed;
+	if (globals.trace) {
+		trace_event(TE_ENTER, "collect", 0);
+	}
 	do {
 		size_t i;
 		/* free unused, setting them to null */
@@ -137,42 +392,203 @@ void free_unused()
 		globals.exprs = new_exprs;
 		globals.exprs_count = j;
 	}
+	if (globals.trace) {
+		trace_event(TE_EXIT, "collect", 0);
+	}
 }
 
 
-/* Save the symbol in the global list of symbols.
+/* Fill in CHAR_CLASS.
+ */
+void init_char_classes(void)
+{
+	const char *c;
+	int i;
+	for (i = 0; i < 256; ++i) {
+		CHAR_CLASS[i] = 0;
+		if (isspace(i)) {
+			CHAR_CLASS[i] |= C_SPACE | C_DELIM;
+		}
+		if (isdigit(i)) {
+			CHAR_CLASS[i] |= C_DIGIT;
+		}
+	}
+	for (c = NON_SYMBOL_CHARS; *c; ++c) {
+		CHAR_CLASS[(unsigned char) *c] |= C_DELIM;
+	}
+	CHAR_CLASS[0] |= C_DELIM;
+}
+
+/* FNV-1a hash of a string.
+ */
+unsigned long hash_string(const char *s)
+{
+	unsigned long h = 2166136261UL;
+	while (*s) {
+		h = (h ^ (unsigned char) *s++) * 16777619UL;
+	}
+	return h;
+}
+
+/* Hash len bytes with FNV-1a, like hash_string.
+ */
+unsigned long hash_bytes(const char *s, size_t len)
+{
+	unsigned long h = 2166136261UL;
+	while (len--) {
+		h = (h ^ (unsigned char) *s++) * 16777619UL;
+	}
+	return h;
+}
+
+/* Make a table of symbols with size slots, a power of two.
+ */
+struct symbol_table *make_symbol_table(size_t size)
+{
+	struct symbol_table *table = malloc(sizeof *table);
+	table->slots = calloc(size, sizeof *table->slots);
+	table->size = size;
+	table->old = NULL;
+	return table;
+}
+
+/* Find a symbol in a table, which may be read while another thread
+ * inserts. If it is missing, stores the free slot where it belongs.
+ */
+static const char *find_symbol(struct symbol_table *table, const char *symbol,
+			       unsigned long hash, size_t *slot)
+{
+	size_t mask = table->size - 1;
+	size_t i = hash & mask;
+	const char *found;
+	while ((found = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE))) {
+		if (!strcmp(symbol, found)) {
+			return found;
+		}
+		i = (i + 1) & mask;
+	}
+	*slot = i;
+	return NULL;
+}
+
+/* Save the symbol in the global table of symbols. The table is an open
+ * addressing hash table of pointers into chunks of symbol names, which are
+ * never moved so that saved symbols can be compared by pointer.
+ * Any thread may save symbols. Lookups do not lock: a slot is only
+ * published once its name is written, and a grown table once it is
+ * filled, and replaced tables are kept for the threads still reading
+ * them. A missing symbol is looked up again and inserted under
+ * symbols_lock.
  */
 const char *save_symbol(const char *symbol)
 {
-	char *found = NULL;
+	unsigned long hash = hash_string(symbol);
+	struct symbol_table *table = __atomic_load_n(&globals.symbols, __ATOMIC_ACQUIRE);
+	struct symbol_chunk *chunk;
+	const char *found;
+	char *name;
 	size_t i;
-	for (i = 0; i < globals.symbols_count; ++i) {
-		if (!strcmp(symbol, globals.symbols[i])) {
-			found = globals.symbols[i];
+	found = find_symbol(table, symbol, hash, &i);
+	if (found) {
+		return found;
+	}
+	pthread_mutex_lock(&globals.symbols_lock);
+	/* another thread may have saved it, or grown the table */
+	table = globals.symbols;
+	found = find_symbol(table, symbol, hash, &i);
+	if (found) {
+		pthread_mutex_unlock(&globals.symbols_lock);
+		return found;
+	}
+	chunk = globals.symbol_chunks;
+	if (!chunk || chunk->count == SYMBOL_CHUNK_SIZE) {
+		chunk = malloc(sizeof *chunk);
+		chunk->count = 0;
+		chunk->next = globals.symbol_chunks;
+		globals.symbol_chunks = chunk;
+	}
+	name = chunk->names[chunk->count++];
+	strncpy(name, symbol, SYMBOL_MAXLEN);
+	name[SYMBOL_MAXLEN] = '\0';
+	if (2 * (globals.symbols_count + 1) > table->size) {
+		/* keep the table at most half full */
+		struct symbol_table *grown = make_symbol_table(2 * table->size);
+		size_t j;
+		for (j = 0; j < table->size; ++j) {
+			if (table->slots[j]) {
+				find_symbol(grown, table->slots[j],
+					    hash_string(table->slots[j]), &i);
+				grown->slots[i] = table->slots[j];
+			}
 		}
+		find_symbol(grown, name, hash, &i);
+		grown->slots[i] = name;
+		grown->old = table;
+		__atomic_store_n(&globals.symbols, grown, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&table->slots[i], name, __ATOMIC_RELEASE);
 	}
-	if (!found) {
-		/* new symbol */
-		++globals.symbols_count;
-		if (globals.symbols_count >= globals.symbols_size) {
-			globals.symbols_size *= 2;
-			globals.symbols =
-				realloc(globals.symbols, globals.symbols_size * sizeof *globals.symbols);
+	++globals.symbols_count;
+	pthread_mutex_unlock(&globals.symbols_lock);
+	return name;
+}
+
+/* Count bytes allocated for expressions against the heap limit. An
+ * exceeded limit is reported through the global error state, so that the
+ * current evaluation is aborted.
+ */
+void charge_heap(size_t bytes)
+{
+	thread.heap += bytes;
+	if (thread.heap > thread.heap_max && thread.error == ERR_NONE) {
+		fprintf(stderr, "Memory limit exceeded!\n");
+		thread.error = ERR_MEMORY;
+	}
+}
+
+/* Allocate an unreferenced expression of the given type. Every thread
+ * takes expressions from its own free list, or else from its own chunk,
+ * so that threads do not contend for the allocator. Chunks are never
+ * returned to the system.
+ */
+struct expr *new_expr(enum type type)
+{
+	struct expr *e = thread.free_exprs;
+	if (thread.region && thread.region->active && type != T_CONTINUATION
+	    && type != T_PORT && type != T_FUTURE && type != T_GENERATOR
+	    && type != T_MEMO && type != T_FOREIGN && type != T_F64) {
+		/* expressions that own resources or may be shared between
+		   threads are kept on the heap, see region.c */
+		e = region_expr();
+	} else if (e) {
+		thread.free_exprs = e->data.pair.cdr;
+	} else {
+		if (thread.chunk_left == 0) {
+			thread.chunk = malloc(EXPR_CHUNK_SIZE * sizeof *thread.chunk);
+			assert(thread.chunk);
+			thread.chunk_left = EXPR_CHUNK_SIZE;
+			if (globals.trace) {
+				trace_event(TE_HEAP, "heap", thread.heap);
+			}
 		}
-		memcpy(globals.symbols[i], symbol, SYMBOL_MAXLEN);
-		found = globals.symbols[i];
-		/* printf("Created symbol %zd: %s\n", i, buf); */
+		e = thread.chunk++;
+		--thread.chunk_left;
+	}
+	if (e->placement != PL_REGION) {
+		e->placement = PL_HEAP;
 	}
-	return found;
+	charge_heap(sizeof *e);
+	e->refs = 0;
+	e->hashed = 0;
+	e->type = type;
+	return e;
 }
 
 /* Construct a new symbol.
  */
 struct expr *make_symbol(const char *symbol)
 {
-	struct expr *e = malloc(sizeof *e);
-	e->refs = 0;
-	e->type = T_SYMBOL;
+	struct expr *e = new_expr(T_SYMBOL);
 	e->data.symbol = save_symbol(symbol);
 	return e;
 }
@@ -181,9 +597,7 @@ struct expr *make_symbol(const char *symbol)
  */
 struct expr *make_pair(struct expr *car, struct expr *cdr)
 {
-	struct expr *e = malloc(sizeof *e);
-	e->refs = 0;
-	e->type = T_PAIR;
+	struct expr *e = new_expr(T_PAIR);
 	e->data.pair.car = car;
 	if (car) {
 		++car->refs;
@@ -195,25 +609,45 @@ struct expr *make_pair(struct expr *car, struct expr *cdr)
 	return e;
 }
 
-/* Construct a new string.
+/* Construct a new string from the first len characters of text.
  */
 struct expr *make_string(const char *text, size_t len)
 {
-	struct expr *e = malloc(sizeof *e);
-	e->refs = 0;
-	e->type = T_STRING;
-	e->data.string = malloc(len + 1);
-	memcpy(e->data.string, text, len + 1);
+	struct expr *e = new_expr(T_STRING);
+	charge_heap(len + 1);
+	e->data.string.data = e->placement == PL_REGION
+		? region_alloc(len + 1) : malloc(len + 1);
+	assert(e->data.string.data);
+	memcpy(e->data.string.data, text, len);
+	e->data.string.data[len] = '\0';
+	e->data.string.len = len;
+	e->data.string.port = NULL;
 	return e;
 }
 
+/* Get the text of a string as a null-terminated C string. A string
+ * borrowed from the buffer of a port is copied first, see make_borrowed.
+ */
+const char *string_text(struct expr *e)
+{
+	struct string *s = &e->data.string;
+	if (s->port) {
+		char *data = malloc(s->len + 1);
+		memcpy(data, s->data, s->len);
+		data[s->len] = '\0';
+		charge_heap(s->len + 1);
+		release_string(e);
+		s->data = data;
+		s->port = NULL;
+	}
+	return s->data;
+}
+
 /* Construct a new number.
  */
 struct expr *make_number(double value)
 {
-	struct expr *e = malloc(sizeof *e);
-	e->refs = 0;
-	e->type = T_NUMBER;
+	struct expr *e = new_expr(T_NUMBER);
 	e->data.number = value;
 	return e;
 }
@@ -222,22 +656,258 @@ struct expr *make_number(double value)
  */
 struct expr *make_lambda(struct expr *params, struct expr *body)
 {
-	struct expr *e = malloc(sizeof *e);
-	e->refs = 0;
-	e->type = T_LAMBDA;
+	struct expr *e = new_expr(T_LAMBDA);
 	e->data.lambda.params = params;
 	e->data.lambda.body = body;
+	e->data.lambda.calls = 0;
+	e->data.lambda.jit = NULL;
+	e->data.lambda.name = NULL;
 	return e;
 }
 
-/* Get the value of a variable.
+/* Construct a new promise of the value of expr.
  */
-struct expr *get_variable(const char *symbol)
+struct expr *make_promise(struct expr *expr)
+{
+	struct expr *e = new_expr(T_PROMISE);
+	e->data.promise.expr = expr;
+	if (expr) {
+		++expr->refs;
+	}
+	e->data.promise.value = NULL;
+	e->data.promise.forced = 0;
+	return e;
+}
+
+/* Hash a pointer for the table of hash-consed expressions.
+ */
+static unsigned long hash_pointer(const void *p)
+{
+	unsigned long h = (unsigned long) (size_t) p;
+	return (h >> 4) * 2654435761UL;
+}
+
+/* Hash an expression by its contents. The parts of a hash-consed pair
+ * are themselves unique, so pairs hash by the addresses of their parts.
+ */
+static unsigned long hash_contents(struct expr *e)
+{
+	switch (e->type) {
+	case T_SYMBOL:
+		return hash_pointer(e->data.symbol);
+	case T_NUMBER:
+		return hash_bytes((const char *) &e->data.number,
+				  sizeof e->data.number);
+	case T_STRING:
+		return hash_bytes(e->data.string.data, e->data.string.len);
+	case T_PAIR:
+		return hash_pointer(e->data.pair.car) * 31
+			+ hash_pointer(e->data.pair.cdr);
+	default:
+		assert(0);
+		return 0;
+	}
+}
+
+/* Check whether two expressions of a hash-consable type have the same
+ * contents.
+ */
+static int same_contents(struct expr *x, struct expr *y)
+{
+	if (x->type != y->type) {
+		return 0;
+	}
+	switch (x->type) {
+	case T_SYMBOL:
+		return x->data.symbol == y->data.symbol;
+	case T_NUMBER:
+		return !memcmp(&x->data.number, &y->data.number, sizeof(double));
+	case T_STRING:
+		return x->data.string.len == y->data.string.len
+			&& !memcmp(x->data.string.data, y->data.string.data,
+				   x->data.string.len);
+	case T_PAIR:
+		return x->data.pair.car == y->data.pair.car
+			&& x->data.pair.cdr == y->data.pair.cdr;
+	default:
+		return 0;
+	}
+}
+
+/* Check whether a hash-consed pair may refer to e. Equal values must be
+ * the same cell, so this holds for hash-consed values, and values that
+ * equal only compares by reference.
+ */
+static int is_canonical(struct expr *e)
+{
+	return !e || e->hashed
+		|| e->type == T_BUILTIN
+		|| e->type == T_LAMBDA
+		|| e->type == T_CONTINUATION
+		|| e->type == T_PROMISE
+		|| e->type == T_PORT
+		|| e->type == T_FUTURE
+		|| e->type == T_GENERATOR
+		|| e->type == T_MEMO
+		|| e->type == T_FOREIGN
+		|| e->type == T_F64;
+}
+
+/* Find the slot of an expression with the same contents as e in the
+ * table of hash-consed expressions, or the empty slot where it belongs.
+ */
+static struct expr **find_hashed(struct expr *e)
+{
+	size_t mask = globals.hashed_size - 1;
+	size_t i = hash_contents(e) & mask;
+	while (globals.hashed[i] && !same_contents(globals.hashed[i], e)) {
+		i = (i + 1) & mask;
+	}
+	return &globals.hashed[i];
+}
+
+/* Remove a hash-consed expression from the table, if it is freed.
+ * Moves the following entries back so that lookups need no tombstones.
+ */
+static void unhash_expr(struct expr *e)
+{
+	size_t mask = globals.hashed_size - 1;
+	size_t i = find_hashed(e) - globals.hashed;
+	size_t j = i;
+	assert(globals.hashed[i] == e);
+	while (1) {
+		size_t home;
+		globals.hashed[i] = NULL;
+		do {
+			j = (j + 1) & mask;
+			if (!globals.hashed[j]) {
+				--globals.hashed_count;
+				return;
+			}
+			home = hash_contents(globals.hashed[j]) & mask;
+			/* keep entries whose home slot is cyclically in (i, j] */
+		} while (i <= j ? i < home && home <= j : i < home || home <= j);
+		globals.hashed[i] = globals.hashed[j];
+		i = j;
+	}
+}
+
+/* Return the unique hash-consed expression with the same contents as
+ * e, which is freshly allocated and unreferenced. Frees e if an equal
+ * expression already exists. The table does not hold references and
+ * free_expr removes an entry, but nothing frees an expression when its
+ * last reference is dropped, so in practice entries are never reclaimed
+ * and the table only grows. It is guarded by hashed_lock.
+ */
+static struct expr *intern_expr(struct expr *e)
+{
+	struct expr **slot;
+	struct expr *found;
+	pthread_mutex_lock(&globals.hashed_lock);
+	if (2 * (globals.hashed_count + 1) > globals.hashed_size) {
+		/* grow the table, rehashing all entries */
+		struct expr **old = globals.hashed;
+		size_t old_size = globals.hashed_size;
+		size_t i;
+		globals.hashed_size = old_size ? 2 * old_size : 256;
+		globals.hashed = calloc(globals.hashed_size, sizeof *globals.hashed);
+		for (i = 0; i < old_size; ++i) {
+			if (old[i]) {
+				*find_hashed(old[i]) = old[i];
+			}
+		}
+		free(old);
+	}
+	slot = find_hashed(e);
+	found = *slot;
+	if (!found) {
+		e->hashed = 1;
+		*slot = e;
+		++globals.hashed_count;
+	}
+	pthread_mutex_unlock(&globals.hashed_lock);
+	if (found) {
+		free_expr(e);
+		return found;
+	}
+	return e;
+}
+
+/* Hash-cons a value on the heap. */
+static struct expr *hash_cons_heap(struct expr *e)
+{
+	size_t base = thread.values_count;
+	struct expr *p;
+	struct expr *rest;
+	if (!e || e->hashed) {
+		return e;
+	}
+	switch (e->type) {
+	case T_SYMBOL:
+		return intern_expr(make_symbol(e->data.symbol));
+	case T_NUMBER:
+		/* NaN is not equal to itself, and -0 is equal to 0 without
+		   being the same number, so neither can be shared */
+		if (e->data.number != e->data.number
+		    || (e->data.number == 0.0 && 1.0 / e->data.number < 0.0)) {
+			return e;
+		}
+		return intern_expr(make_number(e->data.number));
+	case T_STRING:
+		return intern_expr(make_string(e->data.string.data,
+					       e->data.string.len));
+	case T_PAIR:
+		break;
+	default:
+		return e;
+	}
+	/* push the elements, then rebuild the list from the end */
+	for (p = e; p && p->type == T_PAIR && !p->hashed; p = p->data.pair.cdr) {
+		if (push_value(p->data.pair.car)) {
+			thread.values_count = base;
+			return NULL;
+		}
+	}
+	rest = hash_cons_heap(p);
+	while (thread.values_count > base) {
+		struct expr *car =
+			hash_cons_heap(thread.values[thread.values_count - 1]);
+		--thread.values_count;
+		if (is_canonical(car) && is_canonical(rest)) {
+			rest = intern_expr(make_pair(car, rest));
+		} else {
+			rest = make_pair(car, rest);
+		}
+	}
+	return rest;
+}
+
+/* Hash-cons an immutable value, returning a structurally equal value in
+ * which all equal pairs, numbers, strings and symbols are shared, so that
+ * they can be compared by reference. Values that are already hash-consed
+ * are returned immediately. Iterates along lists, so only nesting uses
+ * the C stack. The shared values outlive any region, see region.c.
+ */
+struct expr *hash_cons(struct expr *e)
+{
+	int active;
+	if (!e || e->hashed) {
+		return e;
+	}
+	active = region_pause();
+	e = hash_cons_heap(promote(e));
+	region_resume(active);
+	return e;
+}
+
+/* Find a variable, or return null if it is undefined.
+ */
+struct variable *find_variable(const char *symbol)
 {
 	struct variable *v = globals.variables;
 	while (v) {
 		if (symbol == v->symbol) {
-			return v->value;
+			return v;
 		} else {
 			int c = strcmp(symbol, v->symbol);
 			if (c < 0) {
@@ -250,16 +920,39 @@ struct expr *get_variable(const char *symbol)
 			}
 		}
 	}
+	return NULL;
+}
+
+/* Get the value of a variable.
+ */
+struct expr *get_variable(const char *symbol)
+{
+	struct variable *v = find_variable(symbol);
+	if (v) {
+		if (v->stale) {
+			refresh_variable(v);
+		}
+		if (thread.defining) {
+			record_read(v);
+		}
+		return v->value;
+	}
 	fprintf(stderr, "Undefined variable %s!\n", symbol);
-	globals.error = ERR_USER;
+	thread.error = ERR_USER;
 	return NULL;
 }
 
-/* Set the value of a variable.
+/* Set the value of a variable, marking the definitions that read it
+ * stale if mark is non-zero. Threads only ever add nodes to the tree of
+ * variables and replace values, which are single stores, so that
+ * find_variable can read it without locking.
  */
-void set_variable(const char *symbol, struct expr *value)
+static void store_variable(const char *symbol, struct expr *value, int mark)
 {
 	struct variable **v = &globals.variables;
+	/* variables outlive the evaluation */
+	value = promote(value);
+	pthread_mutex_lock(&globals.variables_lock);
 	while (*v) {
 		if (symbol == (*v)->symbol) {
 			break;
@@ -279,32 +972,85 @@ void set_variable(const char *symbol, struct expr *value)
 			}
 		}
 	}
+	if (value) {
+		++value->refs;
+	}
 	if (*v) {
 		/* update refs if changing old variable */
-		--(*v)->value->refs;
+		if ((*v)->value) {
+			--(*v)->value->refs;
+		}
+		if ((*v)->value != value) {
+			/* compiled code may depend on the old value, and
+			   definitions that read it are out of date */
+			++globals.epoch;
+			if (mark) {
+				mark_dependents(*v);
+			}
+		}
+		(*v)->value = value;
+		++(*v)->generation;
+		(*v)->stale = 0;
+		if ((*v)->source) {
+			/* the source is kept again by end_tracking, if it
+			   still defines the variable */
+			--(*v)->source->refs;
+			(*v)->source = NULL;
+		}
 	} else  {
-		/* allocate if creating new variable */
-		*v = malloc(sizeof **v);
-		(*v)->symbol = symbol;
-		(*v)->left = NULL;
-		(*v)->right = NULL;
-	}
-	(*v)->value = value;
-	++value->refs;
+		/* allocate if creating new variable, and only link it
+		   into the tree once it is complete */
+		struct variable *new = malloc(sizeof *new);
+		new->symbol = symbol;
+		new->value = value;
+		new->left = NULL;
+		new->right = NULL;
+		new->source = NULL;
+		new->dependents = NULL;
+		new->dependents_count = 0;
+		new->dependents_limit = 0;
+		new->generation = 0;
+		new->stale = 0;
+		new->read_stamp = 0;
+		__atomic_store_n(v, new, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&globals.variables_lock);
 }
 
-/* Save a builtin as a variable.
+/* Set the value of a variable.
+ */
+void set_variable(const char *symbol, struct expr *value)
+{
+	store_variable(symbol, value, 1);
+}
+
+/* Set the value of a variable recomputed from its definition, see
+ * refresh_variable. The definitions that read it were marked stale with
+ * it, so they are not marked again, which would make a cycle of
+ * definitions recompute each other on every read.
  */
-void create_builtin(const char *symbol, func_t func, int sf)
+void set_refreshed_variable(const char *symbol, struct expr *value)
 {
-	struct expr *builtin = malloc(sizeof *builtin);
-	builtin->type = T_BUILTIN;
-	builtin->refs = 0;
+	store_variable(symbol, value, 0);
+}
+
+/* Construct a new builtin.
+ */
+struct expr *make_builtin(const char *name, func_t func, enum special sf)
+{
+	struct expr *builtin = new_expr(T_BUILTIN);
 	builtin->data.builtin.func = func;
 	builtin->data.builtin.spec_form = sf;
-	symbol = save_symbol(symbol);
-	builtin->data.builtin.name = symbol;
-	set_variable(symbol, builtin);
+	builtin->data.builtin.name = save_symbol(name);
+	return builtin;
+}
+
+/* Save a builtin as a variable.
+ */
+void create_builtin(const char *symbol, func_t func, enum special sf)
+{
+	struct expr *builtin = make_builtin(symbol, func, sf);
+	set_variable(builtin->data.builtin.name, builtin);
 }
 
 /* Save a function. Reads parameters and body from strings.
@@ -313,44 +1059,79 @@ void create_function(const char *symbol, const char *params, const char *body)
 {
 	struct expr *ps;
 	struct expr *b;
+	struct expr *lambda;
 	const char *endptr;
 	ps = read_list(params, &endptr);
 	assert(*endptr == '\0');
 	b = read_list(body, &endptr);
 	assert(*endptr == '\0');
 	symbol = save_symbol(symbol);
-	set_variable(symbol, make_lambda(ps, b));
+	lambda = make_lambda(ps, b);
+	lambda->data.lambda.name = symbol;
+	set_variable(symbol, lambda);
 }
 
-/* Create a deep copy of a list.
+/* Create a deep copy of a list. Iterates along the list, so only nesting
+ * uses the C stack.
  */
 struct expr *expr_copy(struct expr *e)
 {
-	if (!e) {
-		return NULL;
+	struct expr *copy;
+	struct expr **tail = &copy;
+	while (e && e->type == T_PAIR) {
+		*tail = make_pair(expr_copy(e->data.pair.car), NULL);
+		if (tail != &copy) {
+			++(*tail)->refs;
+		}
+		tail = &(*tail)->data.pair.cdr;
+		e = e->data.pair.cdr;
 	}
-	switch (e->type) {
-	case T_SYMBOL:
-	case T_NUMBER:
-	case T_BUILTIN:
-	case T_LAMBDA:
-		return e;
-	case T_STRING:
-		return make_string(e->data.string, strlen(e->data.string));
-	case T_PAIR:
-		return make_pair(expr_copy(e->data.pair.car),
-				 expr_copy(e->data.pair.cdr));
-	default:
-		/* invalid type */
-		assert(0);
+	if (e && e->type == T_STRING) {
+		e = make_string(e->data.string.data, e->data.string.len);
+	}
+	*tail = e;
+	if (e && tail != &copy) {
+		++e->refs;
+	}
+	return copy;
+}
+
+/* Check whether exp is a quote form, whose argument is not evaluated.
+ */
+static int is_quote(struct expr *exp)
+{
+	struct expr *car = exp->data.pair.car;
+	return car && car->type == T_SYMBOL
+		&& car->data.symbol == save_symbol("quote");
+}
+
+/* Append copies of the pairs from start up to end at tail, which is
+ * &head for the first pair of a new list. Returns the new tail.
+ */
+static struct expr **copy_pairs(struct expr *start, struct expr *end,
+				struct expr **tail, struct expr **head)
+{
+	for (; start != end; start = start->data.pair.cdr) {
+		*tail = make_pair(start->data.pair.car, NULL);
+		if (tail != head) {
+			++(*tail)->refs;
+		}
+		tail = &(*tail)->data.pair.cdr;
 	}
+	return tail;
 }
 
-/* Recursively replace all occurences of sym in exp with val.
+/* Replace all occurences of sym in exp with val. Iterates along lists,
+ * so only nesting uses the C stack, and does not enter quote forms, so
+ * arguments already substituted for other parameters are not walked.
  * Assumes that sym is "saved" so that pointer comparison can be done.
  */
 struct expr *replace_symbol(struct expr *exp, const char *sym, struct expr *val)
 {
+	struct expr *result;
+	struct expr **tail = &result;
+	struct expr *shared = exp;
+	struct expr *e;
 	if (!exp) {
 		return NULL;
 	}
@@ -366,156 +1147,974 @@ struct expr *replace_symbol(struct expr *exp, const char *sym, struct expr *val)
 		} else {
 			return exp;
 		}
-	} else if (exp->type == T_PAIR) {
-		struct expr *car = replace_symbol(exp->data.pair.car, sym, val);
-		struct expr *cdr = replace_symbol(exp->data.pair.cdr, sym, val);
-		if (car != exp->data.pair.car || cdr != exp->data.pair.cdr) {
-			/* if car or cdr changed, we need to
-			   construct a new pair */
-			/* TODO reference counting */
-			return make_pair(car, cdr);
-		} else {
-			return exp;
+	}
+	if (exp->type != T_PAIR || is_quote(exp)) {
+		return exp;
+	}
+	for (e = exp; e && e->type == T_PAIR; e = e->data.pair.cdr) {
+		struct expr *car = replace_symbol(e->data.pair.car, sym, val);
+		if (car == e->data.pair.car) {
+			continue;
 		}
-	} else {
+		/* copy the unchanged pairs since the last change, the
+		   rest of the list is shared */
+		tail = copy_pairs(shared, e, tail, &result);
+		*tail = make_pair(car, NULL);
+		if (tail != &result) {
+			++(*tail)->refs;
+		}
+		tail = &(*tail)->data.pair.cdr;
+		shared = e->data.pair.cdr;
+	}
+	if (e && e->type == T_SYMBOL && e->data.symbol == sym) {
+		/* a dotted list ends with the symbol */
+		tail = copy_pairs(shared, e, tail, &result);
+		shared = replace_symbol(e, sym, val);
+	}
+	if (tail == &result) {
 		return exp;
 	}
-}
-
-/* Evaluate each element of the list. Used for arguments to functions.
- */
-struct expr *eval_each(struct expr *list)
-{
-	struct expr *result = NULL;
-	struct expr **curr = &result;
-	while (list) {
-		assert(list->type = T_PAIR);
-		*curr = make_pair(eval_expr(list->data.pair.car), NULL);
-		curr = &(*curr)->data.pair.cdr;
-		list = list->data.pair.cdr;
+	/* TODO reference counting */
+	*tail = shared;
+	if (shared) {
+		++shared->refs;
 	}
 	return result;
 }
 
-struct expr *eval_lambda(struct lambda *lambda, struct expr *args)
+/* Substitute the arguments for the parameters in the body of a lambda.
+ * If the parameter list ends with a symbol instead of (), such as in
+ * (lambda args ...) or (lambda (x . rest) ...), the remaining arguments
+ * are passed as a list. Returns the body to evaluate.
+ */
+struct expr *bind_lambda(struct lambda *lambda, unsigned int argc, struct expr **argv)
 {
 	struct expr *result = lambda->body;
 	struct expr *param = lambda->params;
-	unsigned int param_count = list_length(lambda->params);
-	if (check_arg_count(args, param_count)) {
-		return NULL;
-	}
-	while (param) {
+	unsigned int i = 0;
+	while (param && param->type == T_PAIR) {
 		/* replace a single parameter with its argument value */
-		struct expr *sym;
-		struct expr *arg;
-		assert(param->type == T_PAIR && args->type == T_PAIR);
-		sym = param->data.pair.car;
+		struct expr *sym = param->data.pair.car;
 		assert(sym->type == T_SYMBOL);
-		arg = args->data.pair.car;
-		result = replace_symbol(result, sym->data.symbol, arg);
+		if (i == argc) {
+			break;
+		}
+		result = replace_symbol(result, sym->data.symbol, argv[i++]);
 		param = param->data.pair.cdr;
-		args = args->data.pair.cdr;
+	}
+	if (param && param->type == T_SYMBOL) {
+		result = replace_symbol(result, param->data.symbol,
+					make_list(argc - i, argv + i));
+	} else if (param || i < argc) {
+		fprintf(stderr,
+			"Invalid number of arguments: expected %u, got %u!\n",
+			list_length(lambda->params),
+			argc);
+		thread.error = ERR_USER;
+		return NULL;
 	}
 	if (globals.debug) {
 		fprintf(stderr, "Evaluating lambda: ");
 		print_expr(result, stderr);
 		putc('\n', stderr);
 	}
-	return eval_expr(result);
+	return result;
 }
 
-struct expr *eval_funcall(struct expr *f, struct expr *args)
+/* Push a frame on the evaluation stack. Returns non-zero and sets the
+ * global error state if the stack can not grow.
+ */
+int push_frame(enum frame_type type,
+	       struct expr *a, struct expr *b, size_t base)
 {
+	struct frame *top;
+	if (globals.limits.depth && thread.frames_count >= globals.limits.depth) {
+		fprintf(stderr, "Evaluation depth limit exceeded!\n");
+		thread.error = ERR_DEPTH;
+		return 1;
+	}
+	if (thread.frames_count == thread.frames_size) {
+		size_t size = thread.frames_size ? 2 * thread.frames_size : 256;
+		struct frame *frames;
+		/* the profiler must not read the frames while they move */
+		thread.frames_moving = 1;
+		frames = realloc(thread.frames, size * sizeof *frames);
+		thread.frames_moving = 0;
+		if (!frames) {
+			fprintf(stderr, "Out of memory for evaluation stack!\n");
+			thread.error = ERR_USER;
+			return 1;
+		}
+		thread.frames = frames;
+		thread.frames_size = size;
+	}
+	/* the frame is counted once written, for the profiler */
+	top = &thread.frames[thread.frames_count];
+	top->type = type;
+	top->a = a;
+	top->b = b;
+	top->base = base;
+	++thread.frames_count;
+	return 0;
+}
+
+/* Push a value on the value stack. Returns non-zero and sets the global
+ * error state if the stack can not grow.
+ */
+int push_value(struct expr *value)
+{
+	if (thread.values_count == thread.values_size) {
+		size_t size = thread.values_size ? 2 * thread.values_size : 256;
+		struct expr **values = realloc(thread.values, size * sizeof *values);
+		if (!values) {
+			fprintf(stderr, "Out of memory for value stack!\n");
+			thread.error = ERR_USER;
+			return 1;
+		}
+		thread.values = values;
+		thread.values_size = size;
+	}
+	thread.values[thread.values_count++] = value;
+	return 0;
+}
+
+/* Capture the frames and values above the given bases as a continuation.
+ */
+struct expr *make_continuation(size_t base, size_t values_base)
+{
+	struct expr *e = new_expr(T_CONTINUATION);
+	struct continuation *k = &e->data.continuation;
+	k->count = thread.frames_count - base;
+	charge_heap(k->count * sizeof *k->frames);
+	k->frames = malloc((k->count ? k->count : 1) * sizeof *k->frames);
+	memcpy(k->frames, thread.frames + base, k->count * sizeof *k->frames);
+	k->values_count = thread.values_count - values_base;
+	charge_heap(k->values_count * sizeof *k->values);
+	k->values = malloc((k->values_count ? k->values_count : 1) * sizeof *k->values);
+	memcpy(k->values,
+	       thread.values + values_base,
+	       k->values_count * sizeof *k->values);
+	/* frames refer to the value stack relative to the base */
+	k->values_base = values_base;
+	region_dirty(e);
+	return e;
+}
+
+/* Move the frames above the given one, a generator frame, and the values
+ * above its base into the generator, which is suspended. The generator
+ * frame itself is popped.
+ */
+static void suspend_generator(size_t frame)
+{
+	struct generator *g = &thread.frames[frame].a->data.generator;
+	size_t values_base = thread.frames[frame].base;
+	size_t i;
+	g->count = thread.frames_count - frame - 1;
+	if (g->count > g->frames_size) {
+		charge_heap((g->count - g->frames_size) * sizeof *g->frames);
+		g->frames_size = g->count;
+		g->frames = realloc(g->frames, g->frames_size * sizeof *g->frames);
+	}
+	memcpy(g->frames, thread.frames + frame + 1, g->count * sizeof *g->frames);
+	for (i = 0; i < g->count; ++i) {
+		g->frames[i].base -= values_base;
+	}
+	g->values_count = thread.values_count - values_base;
+	if (g->values_count > g->values_size) {
+		charge_heap((g->values_count - g->values_size) * sizeof *g->values);
+		g->values_size = g->values_count;
+		g->values = realloc(g->values, g->values_size * sizeof *g->values);
+	}
+	memcpy(g->values, thread.values + values_base,
+	       g->values_count * sizeof *g->values);
+	g->state = G_SUSPENDED;
+	region_dirty(thread.frames[frame].a);
+	thread.frames_count = frame;
+	thread.values_count = values_base;
+}
+
+/* Push the frames and values of a suspended generator above a generator
+ * frame for it. Returns non-zero if the stacks can not grow.
+ */
+static int resume_generator(struct generator *g)
+{
+	size_t values_base = thread.values_count;
+	size_t i;
+	g->state = G_RUNNING;
+	for (i = 0; i < g->values_count; ++i) {
+		if (push_value(g->values[i])) {
+			return 1;
+		}
+	}
+	for (i = 0; i < g->count; ++i) {
+		struct frame *fr = &g->frames[i];
+		if (push_frame(fr->type, fr->a, fr->b, fr->base + values_base)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* The name of a lambda for tracing.
+ */
+static const char *lambda_name(struct expr *lambda)
+{
+	return lambda->data.lambda.name ? lambda->data.lambda.name : "lambda";
+}
+
+/* Check whether a value is the given truth value.
+ */
+static int is_truth(struct expr *e, struct expr *truth)
+{
+	return e && e->type == T_SYMBOL && e->data.symbol == truth->data.symbol;
+}
+
+/* Evaluate an expression, or if f is non-null, apply f to the top argc
+ * values on the value stack.
+ * The evaluator keeps its control stack in thread.frames instead of on
+ * the C stack, so recursion depth is only bounded by memory. Each frame
+ * records what to do with the value of the expression currently being
+ * evaluated. Calls in tail position do not push frames. Nested calls to
+ * eval_expr, e.g. from the REPL, use the part of the stack above the
+ * current top, and continuations capture the frames of the innermost
+ * call to eval_expr.
+ * Evaluated arguments are pushed on thread.values, and functions are
+ * called with a pointer into it, so calls do not allocate argument lists.
+ * Every step uses up fuel, see struct limits.
+ */
+static struct expr *run(struct expr *e, struct expr *f, unsigned int argc)
+{
+	size_t base = thread.frames_count;
+	size_t values_base = thread.values_count - argc;
+	struct expr *value;
+	struct expr *args;
+	/* start of the arguments of f on the value stack */
+	size_t argv_base = values_base;
+	struct expr **argv;
+	struct frame top;
+	size_t i;
+	/* the expression evaluated, whose define is recorded, see depend.c */
+	struct expr *form = f ? NULL : e;
+	struct tracking tracking;
+	if (thread.evaluating++ == 0) {
+		/* start a new evaluation with fresh limits */
+		thread.fuel = globals.limits.fuel
+			? globals.limits.fuel : (unsigned long) -1;
+		thread.heap_max = globals.limits.heap
+			? thread.heap + globals.limits.heap : (size_t) -1;
+	}
+	if (f) {
+		goto apply;
+	}
+eval:
+	/* evaluate e, then continue with its value */
+	if (thread.fuel-- == 0) {
+		thread.fuel = 0;
+		fprintf(stderr, "Evaluation fuel exhausted!\n");
+		thread.error = ERR_FUEL;
+		goto fail;
+	}
+	if (!e) {
+		value = NULL;
+		goto ret;
+	} else if (e->type == T_SYMBOL) {
+		value = get_variable(e->data.symbol);
+		goto ret;
+	} else if (e->type == T_PAIR) {
+		if (push_frame(F_HEAD, e->data.pair.cdr, NULL, 0)) {
+			goto fail;
+		}
+		e = e->data.pair.car;
+		goto eval;
+	} else {
+		value = e;
+		goto ret;
+	}
+ret:
+	/* pass value to the frame on top of the stack */
+	if (thread.error != ERR_NONE) {
+		goto fail;
+	}
+	if (thread.frames_count == base) {
+		if (--thread.evaluating == 0) {
+			thread.heap_max = (size_t) -1;
+		}
+		return value;
+	}
+	top = thread.frames[--thread.frames_count];
+	switch (top.type) {
+	case F_HEAD:
+		/* value is the function, top.a the unevaluated arguments */
+		f = value;
+		args = top.a;
+		argv_base = thread.values_count;
+		if (globals.fuse && is_fusable(f, args)) {
+			/* a chain of list functions, run as one loop */
+			value = fuse(f, args);
+			goto ret;
+		}
+		if (f && f->type == T_BUILTIN) {
+			switch (f->data.builtin.spec_form) {
+			case SF_NONE:
+			case SF_APPLY:
+			case SF_CALLCC:
+			case SF_FORCE:
+			case SF_NEXT:
+			case SF_YIELD:
+				break;
+			case SF_QUOTED:
+				/* pass the unevaluated arguments */
+				for (; args; args = args->data.pair.cdr) {
+					if (push_value(args->data.pair.car)) {
+						goto fail;
+					}
+				}
+				argc = thread.values_count - argv_base;
+				value = f->data.builtin.func(argc, thread.values + argv_base);
+				thread.values_count = argv_base;
+				goto ret;
+			case SF_IF:
+				if (check_arg_count(list_length(args), 3)
+				    || push_frame(F_IF, args->data.pair.cdr, NULL, 0)) {
+					goto fail;
+				}
+				e = args->data.pair.car;
+				goto eval;
+			case SF_DEFINE:
+				if (check_arg_count(list_length(args), 2)
+				    || check_type(args->data.pair.car, T_SYMBOL)) {
+					goto fail;
+				}
+				e = list_index(args, 1);
+				if (form && form->type == T_PAIR
+				    && args == form->data.pair.cdr
+				    && e && e->type == T_PAIR) {
+					/* a top-level define of a computed
+					   value, whose reads are recorded and
+					   which keeps its value expression in
+					   the frame */
+					if (push_frame(F_DEFINE, args->data.pair.car, e, 0)) {
+						goto fail;
+					}
+					begin_tracking(&tracking);
+				} else if (push_frame(F_DEFINE, args->data.pair.car, NULL, 0)) {
+					goto fail;
+				}
+				goto eval;
+			case SF_AND:
+			case SF_OR:
+				if (!args) {
+					/* and of empty list is true, or is false */
+					value = f->data.builtin.spec_form == SF_AND
+						? globals.TRUE : globals.FALSE;
+					goto ret;
+				}
+				if (push_frame(f->data.builtin.spec_form == SF_AND ? F_AND : F_OR,
+					       args->data.pair.cdr, NULL, 0)) {
+					goto fail;
+				}
+				e = args->data.pair.car;
+				goto eval;
+			}
+		}
+		if (!args) {
+			goto apply;
+		}
+		/* evaluate the arguments onto the value stack */
+		if (push_frame(F_ARG, f, args->data.pair.cdr, argv_base)) {
+			goto fail;
+		}
+		e = args->data.pair.car;
+		goto eval;
+	case F_ARG:
+		/* top.a is the function, top.b the remaining arguments
+		   and top.base the start of the evaluated arguments */
+		if (push_value(value)) {
+			goto fail;
+		}
+		if (top.b) {
+			if (push_frame(F_ARG, top.a, top.b->data.pair.cdr, top.base)) {
+				goto fail;
+			}
+			e = top.b->data.pair.car;
+			goto eval;
+		}
+		f = top.a;
+		argv_base = top.base;
+		goto apply;
+	case F_IF:
+		/* top.a is the list of branches */
+		if (is_truth(value, globals.TRUE)) {
+			e = top.a->data.pair.car;
+		} else if (is_truth(value, globals.FALSE)) {
+			e = top.a->data.pair.cdr->data.pair.car;
+		} else {
+			fprintf(stderr, "Invalid truth value: ");
+			print_expr(value, stderr);
+			putc('\n', stderr);
+			thread.error = ERR_USER;
+			goto fail;
+		}
+		goto eval;
+	case F_AND:
+	case F_OR:
+		/* top.a is the list of remaining arguments */
+		if (top.type == F_AND && is_truth(value, globals.FALSE)) {
+			value = globals.FALSE;
+			goto ret;
+		} else if (top.type == F_OR && is_truth(value, globals.TRUE)) {
+			value = globals.TRUE;
+			goto ret;
+		} else if (!top.a) {
+			value = top.type == F_AND ? globals.TRUE : globals.FALSE;
+			goto ret;
+		}
+		if (push_frame(top.type, top.a->data.pair.cdr, NULL, 0)) {
+			goto fail;
+		}
+		e = top.a->data.pair.car;
+		goto eval;
+	case F_DEFINE:
+		/* top.a is the name, and top.b the value expression of a
+		   top-level define */
+		if (value && value->type == T_LAMBDA && !value->data.lambda.name) {
+			value->data.lambda.name = top.a->data.symbol;
+		}
+		set_variable(top.a->data.symbol, value);
+		if (top.b) {
+			end_tracking(&tracking, top.a->data.symbol, top.b);
+		}
+		value = NULL;
+		goto ret;
+	case F_FORCE:
+		/* top.a is the promise, which may have been forced while
+		   evaluating it, in which case the first value is kept */
+		if (!top.a->data.promise.forced) {
+			if (top.a->placement != PL_REGION) {
+				value = promote(value);
+			}
+			top.a->data.promise.value = value;
+			if (value) {
+				++value->refs;
+			}
+			/* other threads may read the value once it is
+			   marked as forced */
+			__atomic_store_n(&top.a->data.promise.forced, 1,
+					 __ATOMIC_RELEASE);
+			/* the expression is no longer needed */
+			if (top.a->data.promise.expr) {
+				--top.a->data.promise.expr->refs;
+				top.a->data.promise.expr = NULL;
+			}
+		}
+		value = top.a->data.promise.value;
+		goto ret;
+	case F_GENERATOR:
+		/* top.a is the generator, whose function has returned
+		   instead of yielding */
+		top.a->data.generator.state = G_DONE;
+		value = NULL;
+		goto ret;
+	case F_MEMO:
+		/* top.a is the memoized function, and top.b the list of
+		   arguments, which are hashed again since a continuation
+		   or generator may have moved the base of the frame */
+		memo_insert(top.a, top.b, value);
+		goto ret;
+	case F_TRACE:
+		/* top.a is the called lambda, which has returned, and top.b
+		   is non-null if its call was traced */
+		if (top.b) {
+			trace_event(TE_EXIT, lambda_name(top.a), 0);
+		}
+		goto ret;
+	}
+	assert(0);
+apply:
+	/* apply f to the arguments on the value stack from argv_base,
+	   which are popped before continuing */
+	argc = thread.values_count - argv_base;
+	argv = thread.values + argv_base;
+	++thread.calls;
 	if (!f) {
 		fprintf(stderr, "Trying to call non-function nil!\n");
-		globals.error = ERR_USER;
-		return NULL;
-	} if (f->type == T_BUILTIN) {
-		/* if it's not a special form
-		   the arguments are evaluated if non-null */
-		if (!f->data.builtin.spec_form) {
-			args = eval_each(args);
+		thread.error = ERR_USER;
+		goto fail;
+	} else if (f->type == T_BUILTIN) {
+		switch (f->data.builtin.spec_form) {
+		case SF_NONE:
+			value = f->data.builtin.func(argc, argv);
+			thread.values_count = argv_base;
+			goto ret;
+		case SF_APPLY:
+			if (check_arg_count(argc, 2)) {
+				goto fail;
+			}
+			/* spread the list onto the value stack */
+			f = argv[0];
+			args = argv[1];
+			thread.values_count = argv_base;
+			for (; args; args = args->data.pair.cdr) {
+				if (check_type(args, T_PAIR)
+				    || push_value(args->data.pair.car)) {
+					goto fail;
+				}
+			}
+			goto apply;
+		case SF_CALLCC:
+			if (check_arg_count(argc, 1)) {
+				goto fail;
+			}
+			f = argv[0];
+			thread.values_count = argv_base;
+			if (push_value(make_continuation(base, values_base))) {
+				goto fail;
+			}
+			goto apply;
+		case SF_FORCE:
+			if (check_arg_count(argc, 1)) {
+				goto fail;
+			}
+			value = argv[0];
+			thread.values_count = argv_base;
+			if (!value || value->type != T_PROMISE) {
+				/* forcing any other value gives the value */
+				goto ret;
+			} else if (value->data.promise.forced) {
+				value = value->data.promise.value;
+				goto ret;
+			}
+			if (push_frame(F_FORCE, value, NULL, 0)) {
+				goto fail;
+			}
+			e = value->data.promise.expr;
+			goto eval;
+		case SF_NEXT:
+			if (check_arg_count(argc, 1)
+			    || check_type(argv[0], T_GENERATOR)) {
+				goto fail;
+			}
+			value = argv[0];
+			thread.values_count = argv_base;
+			switch (value->data.generator.state) {
+			case G_DONE:
+				value = NULL;
+				goto ret;
+			case G_RUNNING:
+				fprintf(stderr, "Generator is already running!\n");
+				thread.error = ERR_USER;
+				goto fail;
+			case G_NEW:
+				/* the generator frame marks where the
+				   generator's part of the stacks starts */
+				if (push_frame(F_GENERATOR, value, NULL, argv_base)) {
+					goto fail;
+				}
+				value->data.generator.state = G_RUNNING;
+				f = value->data.generator.function;
+				goto apply;
+			case G_SUSPENDED:
+				if (push_frame(F_GENERATOR, value, NULL, argv_base)
+				    || resume_generator(&value->data.generator)) {
+					goto fail;
+				}
+				/* the value of yield */
+				value = NULL;
+				goto ret;
+			}
+			assert(0);
+		case SF_YIELD:
+			if (check_arg_count(argc, 1)) {
+				goto fail;
+			}
+			value = argv[0];
+			thread.values_count = argv_base;
+			/* find the innermost generator of this evaluation */
+			for (i = thread.frames_count; i > base; --i) {
+				if (thread.frames[i - 1].type == F_GENERATOR) {
+					break;
+				}
+			}
+			if (i == base) {
+				fprintf(stderr, "Yield outside of a generator!\n");
+				thread.error = ERR_USER;
+				goto fail;
+			}
+			/* pass the value to the caller of next */
+			suspend_generator(i - 1);
+			goto ret;
+		default:
+			fprintf(stderr, "Can not apply special form %s!\n",
+				f->data.builtin.name);
+			thread.error = ERR_USER;
+			goto fail;
 		}
-		return f->data.builtin.func(args);
 	} else if (f->type == T_LAMBDA) {
-		args = eval_each(args);
-		return eval_lambda(&f->data.lambda, args);
+		if (globals.trace || globals.profile) {
+			/* the lambda is kept on the stack for the tracer and
+			   the profiler, see profile.c; a call in tail position
+			   replaces it, keeping tail calls in constant space */
+			struct expr *traced = globals.trace ? globals.TRUE : NULL;
+			if (thread.frames_count > base
+			    && thread.frames[thread.frames_count - 1].type == F_TRACE) {
+				struct frame *fr = &thread.frames[thread.frames_count - 1];
+				if (fr->b) {
+					trace_event(TE_EXIT, lambda_name(fr->a), 0);
+				}
+				fr->a = f;
+				fr->b = traced;
+			} else if (push_frame(F_TRACE, f, traced, 0)) {
+				goto fail;
+			}
+			if (traced) {
+				trace_event(TE_ENTER, lambda_name(f), 0);
+			}
+		}
+		/* compiled code uses the fuel of the main thread */
+		if (globals.jit && thread.id == 0
+		    && jit_call(f, argc, argv, &value)) {
+			thread.values_count = argv_base;
+			goto ret;
+		}
+		e = bind_lambda(&f->data.lambda, argc, argv);
+		thread.values_count = argv_base;
+		if (thread.error != ERR_NONE) {
+			goto fail;
+		}
+		goto eval;
+	} else if (f->type == T_FOREIGN) {
+		value = ffi_call(f, argc, argv);
+		thread.values_count = argv_base;
+		goto ret;
+	} else if (f->type == T_MEMO) {
+		unsigned long hash = memo_hash(argc, argv);
+		if (memo_lookup(f, argc, argv, hash, &value)) {
+			thread.values_count = argv_base;
+			goto ret;
+		}
+		/* call the function with the same arguments, storing its
+		   value once it returns */
+		if (push_frame(F_MEMO, f, make_list(argc, argv), 0)) {
+			goto fail;
+		}
+		f = f->data.memo.function;
+		goto apply;
+	} else if (f->type == T_CONTINUATION) {
+		struct continuation *k = &f->data.continuation;
+		if (check_arg_count(argc, 1)) {
+			goto fail;
+		}
+		value = argv[0];
+		/* replace the stacks with the captured ones */
+		thread.frames_count = base;
+		thread.values_count = values_base;
+		for (i = 0; i < k->values_count; ++i) {
+			if (push_value(k->values[i])) {
+				goto fail;
+			}
+		}
+		for (i = 0; i < k->count; ++i) {
+			struct frame *fr = &k->frames[i];
+			if (push_frame(fr->type, fr->a, fr->b,
+				       fr->base - k->values_base + values_base)) {
+				goto fail;
+			}
+		}
+		goto ret;
 	} else {
 		fprintf(stderr,
 			"Trying to call non-function of type %s!\n",
 			TYPE_NAMES[f->type]);
-		globals.error = ERR_USER;
-		return NULL;
+		thread.error = ERR_USER;
+		goto fail;
+	}
+fail:
+	/* unwind the stacks of this evaluation, ending the generators
+	   that were running in it */
+	for (i = thread.frames_count; i > base; --i) {
+		struct frame *fr = &thread.frames[i - 1];
+		if (fr->type == F_GENERATOR) {
+			fr->a->data.generator.state = G_DONE;
+		} else if (fr->type == F_TRACE && fr->b) {
+			trace_event(TE_EXIT, lambda_name(fr->a), 0);
+		} else if (fr->type == F_DEFINE && fr->b) {
+			end_tracking(&tracking, NULL, NULL);
+		}
+	}
+	thread.frames_count = base;
+	thread.values_count = values_base;
+	if (--thread.evaluating == 0) {
+		thread.heap_max = (size_t) -1;
 	}
+	return NULL;
 }
 
 /* Evaluate an expression.
  */
 struct expr *eval_expr(struct expr *e)
 {
-	/* TODO reference counting */
-	if (!e) {
+	return run(e, NULL, 0);
+}
+
+/* Apply a function to arguments, evaluating it like eval_expr.
+ */
+struct expr *apply_function(struct expr *f, unsigned int argc, struct expr **argv)
+{
+	unsigned int i;
+	if (!f) {
+		fprintf(stderr, "Trying to call non-function nil!\n");
+		thread.error = ERR_USER;
 		return NULL;
-	} else if (e->type == T_SYMBOL) {
-		return get_variable(e->data.symbol);
-	} else if (e->type == T_PAIR) {
-		struct expr *f = eval_expr(e->data.pair.car);
-		struct expr *args = e->data.pair.cdr;
-		return eval_funcall(f, args);
-	} else {
-		return e;
+	}
+	for (i = 0; i < argc; ++i) {
+		if (push_value(argv[i])) {
+			thread.values_count -= i;
+			return NULL;
+		}
+	}
+	return run(NULL, f, argc);
+}
+
+/* Make sure that there is room for len more characters and a terminating
+ * null character in the buffer.
+ */
+void buffer_reserve(struct buffer *b, size_t len)
+{
+	if (b->len + len + 1 > b->size) {
+		size_t size = b->size ? b->size : 4096;
+		while (b->len + len + 1 > size) {
+			size *= 2;
+		}
+		b->data = realloc(b->data, size);
+		assert(b->data);
+		b->size = size;
+	}
+}
+
+/* Append len characters of data to the buffer.
+ */
+void buffer_write(struct buffer *b, const char *data, size_t len)
+{
+	buffer_reserve(b, len);
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	b->data[b->len] = '\0';
+}
+
+void buffer_putc(struct buffer *b, char c)
+{
+	buffer_reserve(b, 1);
+	b->data[b->len++] = c;
+	b->data[b->len] = '\0';
+}
+
+void buffer_puts(struct buffer *b, const char *s)
+{
+	buffer_write(b, s, strlen(s));
+}
+
+/* Write the contents of the buffer to the file with a single write,
+ * and empty the buffer while keeping its memory for reuse.
+ */
+void buffer_flush(struct buffer *b, FILE *f)
+{
+	if (b->len > 0) {
+		fwrite(b->data, 1, b->len, f);
+		b->len = 0;
+		b->data[0] = '\0';
+	}
+}
+
+/* Format a number into out, which must hold NUMBER_MAXLEN characters,
+ * returning the length. The shortest representation that reads back as
+ * exactly the same double is used. Any decimal with at most DBL_DIG (15)
+ * significant digits survives a round trip through a double, so if the
+ * shortest representation has at most 15 digits it is what "%.15g"
+ * produces. Otherwise 16 or, at most, 17 digits are needed.
+ */
+size_t format_number(double number, char *out)
+{
+	int prec;
+	if (number == floor(number) && fabs(number) < 1e15) {
+		/* fast path for integers, which are exact in a double */
+		char digits[NUMBER_MAXLEN];
+		double rest = fabs(number);
+		size_t n = 0;
+		size_t len = 0;
+		do {
+			double next = floor(rest / 10);
+			digits[n++] = '0' + (int) (rest - next * 10);
+			rest = next;
+		} while (rest > 0);
+		if (number < 0 || (number == 0 && 1 / number < 0)) {
+			out[len++] = '-';
+		}
+		while (n > 0) {
+			out[len++] = digits[--n];
+		}
+		out[len] = '\0';
+		return len;
+	}
+	if (number != number || number - number != 0) {
+		/* nan or infinite, which never compare equal after reading */
+		return sprintf(out, "%g", number);
+	}
+	for (prec = 15; prec < 17; ++prec) {
+		sprintf(out, "%.*g", prec, number);
+		if (strtod(out, NULL) == number) {
+			return strlen(out);
+		}
+	}
+	return sprintf(out, "%.17g", number);
+}
+
+/* States of a print_frame. */
+enum {
+	P_LIST_FIRST,
+	P_LIST_REST,
+	P_LAMBDA_PARAMS,
+	P_LAMBDA_BODY,
+	P_CLOSE
+};
+
+/* Push a frame on the print stack.
+ */
+static void print_push(struct expr *e, int state, size_t *count)
+{
+	if (*count >= thread.print_stack_size) {
+		thread.print_stack_size = thread.print_stack_size
+			? 2 * thread.print_stack_size : 64;
+		thread.print_stack = realloc(thread.print_stack,
+					      thread.print_stack_size
+					      * sizeof *thread.print_stack);
+		assert(thread.print_stack);
+	}
+	thread.print_stack[*count].e = e;
+	thread.print_stack[*count].state = state;
+	++*count;
+}
+
+/* Print an atom, or print the opening of a list or lambda and push a frame
+ * for the rest of it.
+ */
+static void print_open(struct expr *e, struct buffer *b, size_t *count)
+{
+	char num[NUMBER_MAXLEN];
+	if (!e) {
+		buffer_write(b, "()", 2);
+		return;
+	}
+	switch (e->type) {
+	case T_SYMBOL:
+		buffer_puts(b, e->data.symbol);
+		break;
+	case T_NUMBER:
+		buffer_write(b, num, format_number(e->data.number, num));
+		break;
+	case T_STRING:
+		buffer_putc(b, '"');
+		buffer_write(b, e->data.string.data, e->data.string.len);
+		buffer_putc(b, '"');
+		break;
+	case T_PAIR:
+		buffer_putc(b, '(');
+		print_push(e, P_LIST_FIRST, count);
+		break;
+	case T_BUILTIN:
+		buffer_write(b, "[builtin ", 9);
+		buffer_puts(b, e->data.builtin.name);
+		buffer_putc(b, ']');
+		break;
+	case T_LAMBDA:
+		buffer_write(b, "(lambda ", 8);
+		print_push(e, P_LAMBDA_PARAMS, count);
+		break;
+	case T_CONTINUATION:
+		buffer_puts(b, "[continuation]");
+		break;
+	case T_PROMISE:
+		buffer_puts(b, "[promise]");
+		break;
+	case T_PORT:
+		buffer_puts(b, "[port]");
+		break;
+	case T_FUTURE:
+		buffer_puts(b, "[future]");
+		break;
+	case T_GENERATOR:
+		buffer_puts(b, "[generator]");
+		break;
+	case T_MEMO:
+		buffer_puts(b, "[memo]");
+		break;
+	case T_FOREIGN:
+		buffer_puts(b, "[foreign ");
+		buffer_puts(b, e->data.foreign.name);
+		buffer_putc(b, ']');
+		break;
+	case T_F64:
+		buffer_puts(b, "[f64]");
+		break;
 	}
 }
 
-/* Print an expression to the file.
+/* Append the printed representation of an expression to the buffer.
+ * Nested lists are traversed with an explicit stack, so that deeply
+ * nested expressions can not overflow the C stack.
  */
-void print_expr(struct expr *e, FILE *f)
+void print_buffer(struct expr *e, struct buffer *b)
 {
-	if (!e) {
-		fprintf(f, "()");
-	} else {
-		switch (e->type) {
-		case T_SYMBOL:
-			fprintf(f, "%s", e->data.symbol);
-			break;
-		case T_NUMBER:
-			fprintf(f, "%g", e->data.number);
-			break;
-		case T_STRING:
-			fprintf(f, "\"%s\"", e->data.string);
-			break;
-		case T_PAIR:
-			/* print a list, modifying e locally */
-			putc('(', f);
-			while (e && e->type == T_PAIR) {
-				print_expr(e->data.pair.car, f);
-				e = e->data.pair.cdr;
-				if (e && e->type == T_PAIR) {
-					putc(' ', f);
+	size_t count = 0;
+	print_open(e, b, &count);
+	while (count > 0) {
+		struct print_frame *top = &thread.print_stack[count - 1];
+		e = top->e;
+		switch (top->state) {
+		case P_LIST_FIRST:
+		case P_LIST_REST:
+			if (e && e->type == T_PAIR) {
+				if (top->state == P_LIST_REST) {
+					buffer_putc(b, ' ');
 				}
-			}
-			if (e) {
+				top->state = P_LIST_REST;
+				top->e = e->data.pair.cdr;
+				print_open(e->data.pair.car, b, &count);
+			} else if (e) {
 				/* print trailing element */
-				fprintf(f, " . ");
-				print_expr(e, f);
+				buffer_write(b, " . ", 3);
+				top->state = P_CLOSE;
+				print_open(e, b, &count);
+			} else {
+				buffer_putc(b, ')');
+				--count;
 			}
-			putc(')', f);
 			break;
-		case T_BUILTIN:
-			fprintf(f, "[builtin %s]", e->data.builtin.name);
+		case P_LAMBDA_PARAMS:
+			top->state = P_LAMBDA_BODY;
+			print_open(e->data.lambda.params, b, &count);
 			break;
-		case T_LAMBDA:
-			fprintf(f, "(lambda ");
-			print_expr(e->data.lambda.params, f);
-			putc(' ', f);
-			print_expr(e->data.lambda.body, f);
-			putc(')', f);
+		case P_LAMBDA_BODY:
+			buffer_putc(b, ' ');
+			top->state = P_CLOSE;
+			print_open(e->data.lambda.body, b, &count);
+			break;
+		case P_CLOSE:
+			buffer_putc(b, ')');
+			--count;
 			break;
 		}
 	}
 }
 
+/* Print an expression to the file.
+ */
+void print_expr(struct expr *e, FILE *f)
+{
+	thread.out.len = 0;
+	print_buffer(e, &thread.out);
+	buffer_flush(&thread.out, f);
+}
+
 /* Print an expression with extra debugging information.
  */
 void print_dbg_expr(struct expr *e, FILE *f)
@@ -539,52 +2138,101 @@ void print_dbg_expr(struct expr *e, FILE *f)
 	putc(']', f);
 }
 
+#ifdef __SSE2__
+/* Get a bit mask of the characters in the aligned block of 16 characters
+ * starting at p that are spaces, i.e. in the range 9-13 or ' '.
+ */
+static unsigned int space_mask(const char *p)
+{
+	__m128i x = _mm_load_si128((const __m128i *) p);
+	__m128i ctrl = _mm_and_si128(
+		_mm_cmpeq_epi8(_mm_max_epu8(x, _mm_set1_epi8(9)), x),
+		_mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(13)), x));
+	return _mm_movemask_epi8(
+		_mm_or_si128(ctrl, _mm_cmpeq_epi8(x, _mm_set1_epi8(' '))));
+}
+
+/* Get a bit mask of the characters in the aligned block of 16 characters
+ * starting at p that end a symbol, that is spaces, null characters and
+ * NON_SYMBOL_CHARS.
+ */
+static unsigned int delim_mask(const char *p)
+{
+	__m128i x = _mm_load_si128((const __m128i *) p);
+	__m128i m = _mm_cmpeq_epi8(x, _mm_setzero_si128());
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\'')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('(')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(')')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('"')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('.')));
+	return _mm_movemask_epi8(m) | space_mask(p);
+}
+
+/* Get a bit mask of the characters in the aligned block of 16 characters
+ * starting at p that end a string, that is '"' and null characters.
+ */
+static unsigned int string_end_mask(const char *p)
+{
+	__m128i x = _mm_load_si128((const __m128i *) p);
+	return _mm_movemask_epi8(
+		_mm_or_si128(_mm_cmpeq_epi8(x, _mm_setzero_si128()),
+			     _mm_cmpeq_epi8(x, _mm_set1_epi8('"'))));
+}
+
+/* Find the first character at or after text for which the mask function
+ * sets a bit, or for which it does not when invert is set. Only aligned
+ * blocks are loaded, which never cross a page boundary, so reading past
+ * the terminating null character is safe.
+ */
+static const char *scan(const char *text,
+			unsigned int (*mask)(const char *), int invert)
+{
+	size_t offset = (size_t) text & 15;
+	const char *p = text - offset;
+	unsigned int bits = mask(p) ^ (invert ? 0xffff : 0);
+	/* ignore characters before text */
+	bits &= 0xffff << offset;
+	while (!bits) {
+		p += 16;
+		bits = mask(p) ^ (invert ? 0xffff : 0);
+	}
+	offset = 0;
+	while (!(bits & 1)) {
+		bits >>= 1;
+		++offset;
+	}
+	return p + offset;
+}
+#endif
+
 /* Return a pointer to the first non-space in text.
  * May be end of string.
  */
 const char *skip_spaces(const char *text)
 {
-	while (isspace(*text)) ++text;
+	if (!(CHAR_CLASS[(unsigned char) *text] & C_SPACE)) {
+		/* usually there are no or few spaces */
+		return text;
+	}
+#ifdef __SSE2__
+	return scan(text, space_mask, 1);
+#else
+	while (CHAR_CLASS[(unsigned char) *text] & C_SPACE) ++text;
 	return text;
+#endif
 }
 
-/* Read a list.
+/* Read a list. text must point at the opening '('.
  */
 struct expr *read_list(const char *text, const char **endptr)
 {
-	struct expr *e;
-	struct expr **f = &e;
-	*f = NULL;
-	text = skip_spaces(text + 1);
-	while (*text != ')') {
-		if (!*text) {
-			fprintf(stderr, "Unexpected end of input!\n");
-			globals.error = ERR_PARSE;
-			return NULL;
-		}
-		*f = make_pair(read_expr(text, &text), NULL);
-		/* wrong refs for the first pair, but that
-		   is corrected at the end */
-		++(*f)->refs;
-		f = &(*f)->data.pair.cdr;
-		text = skip_spaces(text);
-	}
-	/* skip the trailing ')' */
-	++text;
-	if (e) {
-		e->refs = 0;
-	}
-	if (endptr) {
-		*endptr = text;
-	}
-	return e;
+	assert(*text == '(');
+	return read_expr(text, endptr);
 }
 
 int is_symbol_char(char c)
 {
-	return c != '\0'
-		&& !isspace(c)
-		&& !strchr(NON_SYMBOL_CHARS, c);
+	return !(CHAR_CLASS[(unsigned char) c] & C_DELIM);
 }
 
 /* Read a symbol.
@@ -593,68 +2241,122 @@ int is_symbol_char(char c)
 struct expr *read_symbol(const char *text, const char **endptr)
 {
 	char buf[SYMBOL_MAXLEN];
-	struct expr *symbol;
-	size_t i = 0;
-	while (is_symbol_char(*text)) {
-		if (!*text) {
-			fprintf(stderr, "Unexpected end of input!\n");
-			globals.error = ERR_PARSE;
-			return NULL;
-		}
-		buf[i++] = *text++;
-		if (i >= SYMBOL_MAXLEN) {
-			fprintf(stderr, "Too long symbol!\n");
-			globals.error = ERR_PARSE;
-			return NULL;
-		}
+	const char *end;
+	size_t len;
+#ifdef __SSE2__
+	end = scan(text, delim_mask, 0);
+#else
+	end = text;
+	while (is_symbol_char(*end)) ++end;
+#endif
+	len = end - text;
+	if (len >= SYMBOL_MAXLEN) {
+		fprintf(stderr, "Too long symbol!\n");
+		thread.error = ERR_PARSE;
+		return NULL;
 	}
-	buf[i] = '\0';
+	memcpy(buf, text, len);
+	buf[len] = '\0';
 	if (endptr) {
-		*endptr = text;
+		*endptr = end;
 	}
-	symbol = make_symbol(buf);
-	return symbol;
+	return make_symbol(buf);
 }
 
 /* Read a string terminated by '"' from text.
  */
 struct expr *read_string(const char *text, const char **endptr)
 {
-	size_t buf_len = 100;
-	char *str_buf = malloc(buf_len);
+	const char *end;
 	struct expr *string;
-	size_t i = 0;
-	while (*text != '"') {
-		if (!*text) {
-			free(str_buf);
-			fprintf(stderr, "Unexpected end of input!\n");
-			globals.error = ERR_PARSE;
-			return NULL;
-		}
-		if (i + 1 >= buf_len) {
-			char *new_str_buf;
-			buf_len *= 2;
-			new_str_buf = realloc(str_buf, buf_len);
-			if (!new_str_buf) {
-				fprintf(stderr, "Cannot allocate input buffer!\n");
-				return NULL;
-			}
-			str_buf = new_str_buf;
-		}
-		str_buf[i++] = *text++;
+#ifdef __SSE2__
+	end = scan(text, string_end_mask, 0);
+#else
+	end = text;
+	while (*end && *end != '"') ++end;
+#endif
+	if (!*end) {
+		fprintf(stderr, "Unexpected end of input!\n");
+		thread.error = ERR_PARSE;
+		return NULL;
 	}
-	str_buf[i] = '\0';
+	string = make_string(text, end - text);
 	if (endptr) {
-		*endptr = text + 1;
+		*endptr = end + 1;
 	}
-	string = make_string(str_buf, i + 1);
-	free(str_buf);
 	return string;
 }
 
 /* Reads a number from text. Follows the same rules as strtod.
+ * Decimal numbers with at most 15 significant digits and a small exponent
+ * are converted exactly with a single multiplication or division, since
+ * both the digits and the power of ten are exact doubles. Other numbers
+ * are left to strtod.
  */
 struct expr *read_number(const char *text, const char **endptr)
+{
+	const char *p = text;
+	double mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	int negative = 0;
+	if (*p == '-') {
+		negative = 1;
+		++p;
+	}
+	if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		/* hexadecimal */
+		digits = 16;
+	}
+	for (; CHAR_CLASS[(unsigned char) *p] & C_DIGIT; ++p) {
+		if (mantissa > 0 || *p != '0') {
+			mantissa = mantissa * 10 + (*p - '0');
+			++digits;
+		}
+	}
+	if (*p == '.') {
+		for (++p; CHAR_CLASS[(unsigned char) *p] & C_DIGIT; ++p) {
+			mantissa = mantissa * 10 + (*p - '0');
+			--exponent;
+			if (mantissa > 0) {
+				++digits;
+			}
+		}
+	}
+	if (*p == 'e' || *p == 'E') {
+		const char *q = p + 1;
+		int exp_negative = 0;
+		int exp = 0;
+		if (*q == '-' || *q == '+') {
+			exp_negative = *q++ == '-';
+		}
+		if (CHAR_CLASS[(unsigned char) *q] & C_DIGIT) {
+			for (; CHAR_CLASS[(unsigned char) *q] & C_DIGIT; ++q) {
+				if (exp < 10000) {
+					exp = exp * 10 + (*q - '0');
+				}
+			}
+			exponent += exp_negative ? -exp : exp;
+			p = q;
+		}
+	}
+	if (digits > 15 || exponent < -22 || exponent > 22) {
+		return read_number_slow(text, endptr);
+	}
+	if (exponent < 0) {
+		mantissa /= POW10[-exponent];
+	} else {
+		mantissa *= POW10[exponent];
+	}
+	if (endptr) {
+		*endptr = p;
+	}
+	return make_number(negative ? -mantissa : mantissa);
+}
+
+/* Reads a number from text using strtod.
+ */
+struct expr *read_number_slow(const char *text, const char **endptr)
 {
 	struct expr *number;
 	number = make_number(strtod(text, (char **) &text));
@@ -664,24 +2366,120 @@ struct expr *read_number(const char *text, const char **endptr)
 	return number;
 }
 
-/* Read an expression from the text. Stores a pointer to after the
- * last read character in endptr, if it is non-null.
+/* Read an atom, i.e. anything but a list, from the text.
  */
-struct expr *read_expr(const char *text, const char **endptr) {
+struct expr *read_atom(const char *text, const char **endptr)
+{
 	struct expr *e = NULL;
-	text = skip_spaces(text);
-	if (*text == '(') {
-		e = read_list(text, &text);
-	} else if (*text == '"') {
+	if (*text == '"') {
 		e = read_string(text + 1, &text);
-	} else if (isdigit(*text) || (*text == '-' && isdigit(text[1]))) {
+	} else if (CHAR_CLASS[(unsigned char) *text] & C_DIGIT
+		   || (*text == '-'
+		       && CHAR_CLASS[(unsigned char) text[1]] & C_DIGIT)) {
 		/* pretty ugly hack to handle reading of negative numbers */
 		e = read_number(text, &text);
 	} else if (is_symbol_char(*text)) {
 		e = read_symbol(text, &text);
+	} else if (!*text) {
+		fprintf(stderr, "Unexpected end of input!\n");
+		thread.error = ERR_PARSE;
 	} else {
 		fprintf(stderr, "No parse for \"%s\"!\n", text);
-		globals.error = ERR_PARSE;
+		thread.error = ERR_PARSE;
+	}
+	*endptr = text;
+	return e;
+}
+
+/* Replace the constant in a quote form with its hash-consed value.
+ * Constants that contain other quote forms are read after those, so
+ * only the outermost level is not already hash-consed.
+ */
+static void hash_quoted(struct expr *e)
+{
+	struct expr *arg;
+	if (!e || e->data.pair.car == NULL
+	    || e->data.pair.car->type != T_SYMBOL
+	    || e->data.pair.car->data.symbol != save_symbol("quote")) {
+		return;
+	}
+	arg = e->data.pair.cdr;
+	if (arg && !arg->data.pair.cdr && arg->data.pair.car) {
+		struct expr *value = hash_cons(arg->data.pair.car);
+		--arg->data.pair.car->refs;
+		arg->data.pair.car = value;
+		++value->refs;
+	}
+}
+
+/* Push a frame for a list or a quote on the read stack.
+ */
+static void read_push(size_t count, int quote)
+{
+	if (count == thread.read_stack_size) {
+		thread.read_stack_size = count ? 2 * count : 64;
+		thread.read_stack = realloc(thread.read_stack,
+					     thread.read_stack_size
+					     * sizeof *thread.read_stack);
+		assert(thread.read_stack);
+	}
+	thread.read_stack[count].head = NULL;
+	thread.read_stack[count].last = NULL;
+	thread.read_stack[count].quote = quote;
+}
+
+/* Read an expression from the text. Stores a pointer to after the
+ * last read character in endptr, if it is non-null.
+ * Lists that are being read are kept on an explicit stack, so that
+ * deeply nested input can not overflow the C stack. 'e is read as
+ * (quote e), using a frame that is finished by the next expression.
+ */
+struct expr *read_expr(const char *text, const char **endptr) {
+	size_t count = 0;
+	struct expr *e;
+	while (1) {
+		struct read_frame *top;
+		text = skip_spaces(text);
+		if (*text == '(' || *text == '\'') {
+			/* start a new list or quote */
+			read_push(count++, *text == '\'');
+			++text;
+			continue;
+		} else if (*text == ')' && count > 0
+			   && !thread.read_stack[count - 1].quote) {
+			/* finish the innermost list */
+			e = thread.read_stack[--count].head;
+			++text;
+			if (globals.hash_quotes) {
+				hash_quoted(e);
+			}
+		} else {
+			e = read_atom(text, &text);
+			if (thread.error != ERR_NONE) {
+				e = NULL;
+				break;
+			}
+		}
+		/* finish the quotes waiting for this expression */
+		while (count > 0 && thread.read_stack[count - 1].quote) {
+			--count;
+			e = make_pair(make_symbol("quote"), make_pair(e, NULL));
+			if (globals.hash_quotes) {
+				hash_quoted(e);
+			}
+		}
+		if (count == 0) {
+			break;
+		}
+		/* append the expression to the innermost list */
+		top = &thread.read_stack[count - 1];
+		if (top->last) {
+			top->last->data.pair.cdr = make_pair(e, NULL);
+			top->last = top->last->data.pair.cdr;
+			++top->last->refs;
+		} else {
+			top->head = top->last = make_pair(e, NULL);
+		}
 	}
 	if (endptr) {
 		*endptr = text;
@@ -709,7 +2507,7 @@ struct expr *list_index(struct expr *list, unsigned int idx)
 	while (idx > 0) {
 		if (!list) {
 			fprintf(stderr, "Index out of range!\n");
-			globals.error = ERR_USER;
+			thread.error = ERR_USER;
 			return NULL;
 		}
 		assert(list->type == T_PAIR);
@@ -723,20 +2521,30 @@ struct expr *list_index(struct expr *list, unsigned int idx)
  * Prints an error message, sets the global error state and returns non-zero
  * if the number of arguments is incorrect.
  */
-int check_arg_count(struct expr *args, unsigned int argc)
+int check_arg_count(unsigned int argc, unsigned int expected)
 {
-	unsigned int len = list_length(args);
-	if (argc != len) {
+	if (argc != expected) {
 		fprintf(stderr,
 			"Invalid number of arguments: expected %u, got %u!\n",
-			argc,
-			len);
-		globals.error = ERR_USER;
+			expected,
+			argc);
+		thread.error = ERR_USER;
 		return 1;
 	}
 	return 0;
 }
 
+/* Make a list of the arguments.
+ */
+struct expr *make_list(unsigned int argc, struct expr **argv)
+{
+	struct expr *list = NULL;
+	while (argc > 0) {
+		list = make_pair(argv[--argc], list);
+	}
+	return list;
+}
+
 /* Check that the expression has the correct type.
  * Prints an error message, sets the global error state and returns non-zero
  * if the expression has the wrong type.
@@ -747,7 +2555,7 @@ int check_type(struct expr *e, enum type t)
 		fprintf(stderr,
 			"Invalid type: expected %s, got nil!\n",
 			TYPE_NAMES[t]);
-		globals.error = ERR_USER;
+		thread.error = ERR_USER;
 		return 1;
 	}
 	if (e->type != t) {
@@ -755,7 +2563,7 @@ int check_type(struct expr *e, enum type t)
 			"Invalid type: expected %s, got %s!\n",
 			TYPE_NAMES[t],
 			TYPE_NAMES[e->type]);
-		globals.error = ERR_USER;
+		thread.error = ERR_USER;
 		return 1;
 	}
 	return 0;
@@ -763,123 +2571,64 @@ int check_type(struct expr *e, enum type t)
 
 /* Built-in functions. */
 
-struct expr *bi_define(struct expr *args)
-{
-	struct expr *name;
-	struct expr *value;
-	if (check_arg_count(args, 2)) {
-		return NULL;
-	}
-	name = list_index(args, 0);
-	if (check_type(name, T_SYMBOL)) {
-		return NULL;
-	}
-	value = eval_expr(list_index(args, 1));
-	set_variable(name->data.symbol, value);
-	return NULL;
-}
-
-struct expr *bi_lambda(struct expr *args)
+struct expr *bi_lambda(unsigned int argc, struct expr **argv)
 {
 	struct expr *params;
-	struct expr *body;
-	if (check_arg_count(args, 2)) {
+	if (check_arg_count(argc, 2)) {
 		return NULL;
 	}
-	params = list_index(args, 0);
-	if (args->type != T_PAIR) {
+	params = argv[0];
+	if (params && params->type != T_PAIR && params->type != T_SYMBOL) {
 		fprintf(stderr, "Invalid parameter list ");
 		print_expr(params, stderr);
 		fprintf(stderr, "!\n");
-		globals.error = ERR_USER;
-		return NULL;
-	}
-	body = list_index(args, 1);
-	return make_lambda(params, body);
-}
-
-struct expr *bi_if(struct expr *args)
-{
-	/* TODO: create a type for booleans (and make numbers primitive) */
-	struct expr *test;
-	if (check_arg_count(args, 3)) {
-		return NULL;
-	}
-	test = eval_expr(list_index(args, 0));
-	if (check_type(test, T_SYMBOL)) {
-		return NULL;
-	} else if (test->data.symbol == globals.TRUE->data.symbol) {
-		return eval_expr(list_index(args, 1));
-	} else if (test->data.symbol == globals.FALSE->data.symbol) {
-		return eval_expr(list_index(args, 2));
-	} else {
-		fprintf(stderr, "Invalid truth value: ");
-		print_expr(test, stderr);
-		globals.error = ERR_USER;
-		return NULL;
-	}
-}
-
-struct expr *bi_apply(struct expr *args)
-{
-	if (check_arg_count(args, 2)) {
+		thread.error = ERR_USER;
 		return NULL;
 	}
-	return eval_funcall(list_index(args, 0), list_index(args, 1));
+	return make_lambda(params, argv[1]);
 }
 
-struct expr *bi_quote(struct expr *args)
+struct expr *bi_quote(unsigned int argc, struct expr **argv)
 {
-	if (check_arg_count(args, 1)) {
+	if (check_arg_count(argc, 1)) {
 		return NULL;
 	}
-	return list_index(args, 0);
+	return argv[0];
 }
 
-struct expr *bi_cons(struct expr *args)
+struct expr *bi_cons(unsigned int argc, struct expr **argv)
 {
-	if (check_arg_count(args, 2)) {
+	if (check_arg_count(argc, 2)) {
 		return NULL;
 	}
-	return make_pair(list_index(args, 0),
-			 list_index(args, 1));
+	return make_pair(argv[0], argv[1]);
 }
 
-struct expr *bi_car(struct expr *args)
+struct expr *bi_car(unsigned int argc, struct expr **argv)
 {
-	struct expr *e;
-	if (check_arg_count(args, 1)) {
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_PAIR)) {
 		return NULL;
 	}
-	e = list_index(args, 0);
-	if (check_type(e, T_PAIR)) {
-		return NULL;
-	}
-	return e->data.pair.car;
+	return argv[0]->data.pair.car;
 }
 
-struct expr *bi_cdr(struct expr *args)
+struct expr *bi_cdr(unsigned int argc, struct expr **argv)
 {
-	struct expr *e;
-	if (check_arg_count(args, 1)) {
-		return NULL;
-	}
-	e = list_index(args, 0);
-        if (check_type(e, T_PAIR)) {
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_PAIR)) {
 		return NULL;
 	}
-	return e->data.pair.cdr;
+	return argv[0]->data.pair.cdr;
 }
 
-struct expr *bi_eq(struct expr *args)
+struct expr *bi_eq(unsigned int argc, struct expr **argv)
 {
 	struct expr *x;
 	struct expr *y;
-	if (check_arg_count(args, 2)) {
+	if (check_arg_count(argc, 2)) {
 		return NULL;
 	}
-	x = list_index(args, 0);
-	y = list_index(args, 1);
+	x = argv[0];
+	y = argv[1];
 	if (x == y) {
 		/* handles reference equality and symbols */
 		return globals.TRUE;
@@ -894,234 +2643,350 @@ struct expr *bi_eq(struct expr *args)
 	}
 }
 
-struct expr *bi_list(struct expr *args)
+/* Compare structurally. Iterates along lists, so only nesting uses the
+ * C stack. Hash-consed values are equal only if they are the same.
+ */
+int equal(struct expr *x, struct expr *y)
+{
+	while (x != y) {
+		if (!x || !y || x->type != y->type) {
+			return 0;
+		}
+		switch (x->type) {
+		case T_PAIR:
+			if (x->hashed && y->hashed) {
+				return 0;
+			}
+			if (!equal(x->data.pair.car, y->data.pair.car)) {
+				return 0;
+			}
+			x = x->data.pair.cdr;
+			y = y->data.pair.cdr;
+			break;
+		case T_SYMBOL:
+			return x->data.symbol == y->data.symbol;
+		case T_NUMBER:
+			return x->data.number == y->data.number;
+		case T_STRING:
+			return x->data.string.len == y->data.string.len
+				&& !memcmp(x->data.string.data, y->data.string.data,
+					   x->data.string.len);
+		default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Hash an expression consistently with equal, so that equal expressions
+ * have the same hash. Iterates along lists, so only nesting uses the C
+ * stack.
+ */
+unsigned long hash_equal(struct expr *e)
+{
+	unsigned long h = 2166136261UL;
+	double number;
+	for (; e && e->type == T_PAIR; e = e->data.pair.cdr) {
+		h = (h ^ hash_equal(e->data.pair.car)) * 16777619UL;
+	}
+	if (!e) {
+		return h;
+	}
+	switch (e->type) {
+	case T_SYMBOL:
+		return h ^ hash_pointer(e->data.symbol);
+	case T_NUMBER:
+		/* -0 is equal to 0 */
+		number = e->data.number == 0.0 ? 0.0 : e->data.number;
+		return h ^ hash_bytes((const char *) &number, sizeof number);
+	case T_STRING:
+		return h ^ hash_bytes(e->data.string.data, e->data.string.len);
+	default:
+		return h ^ hash_pointer(e);
+	}
+}
+
+struct expr *bi_equal(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 2)) {
+		return NULL;
+	}
+	return equal(argv[0], argv[1]) ? globals.TRUE : globals.FALSE;
+}
+
+struct expr *bi_list(unsigned int argc, struct expr **argv)
 {
-	/* maybe not the best to simply return the list of args? */
-	return args;
+	return make_list(argc, argv);
 }
 
-struct expr *bi_append(struct expr *args)
+struct expr *bi_append(unsigned int argc, struct expr **argv)
 {
-	struct expr *before;
-	struct expr *after;
+	struct expr *list = NULL;
+	struct expr **tail = &list;
 	struct expr *iter;
-	if (check_arg_count(args, 2)) {
+	if (check_arg_count(argc, 2)) {
 		return NULL;
 	}
-	before = list_index(args, 0);
-	after = list_index(args, 1);
-	if (!before) {
-		return after;
+	/* copy the pairs of the first list, sharing the elements */
+	for (iter = argv[0]; iter; iter = iter->data.pair.cdr) {
+		if (check_type(iter, T_PAIR)) {
+			return NULL;
+		}
+		*tail = make_pair(iter->data.pair.car, NULL);
+		if (tail != &list) {
+			++(*tail)->refs;
+		}
+		tail = &(*tail)->data.pair.cdr;
 	}
-	before = expr_copy(before);
-	iter = before;
-	assert(iter->type == T_PAIR);
-	while (iter->data.pair.cdr) {
-		assert(iter->type == T_PAIR);
-		iter = iter->data.pair.cdr;
+	*tail = argv[1];
+	if (argv[1] && tail != &list) {
+		++argv[1]->refs;
 	}
-	iter->data.pair.cdr = after;
-	return before;
+	return list;
 }
 
-struct expr *bi_sum(struct expr *args)
+struct expr *bi_sum(unsigned int argc, struct expr **argv)
 {
 	double tot = 0;
-	while (args) {
-		struct expr *num;
-		assert(args->type == T_PAIR);
-		num = args->data.pair.car;
-		if (check_type(num, T_NUMBER)) {
+	unsigned int i;
+	for (i = 0; i < argc; ++i) {
+		if (check_type(argv[i], T_NUMBER)) {
 			return NULL;
 		}
-		tot += num->data.number;
-		args = args->data.pair.cdr;
+		tot += argv[i]->data.number;
 	}
 	return make_number(tot);
 }
 
-struct expr *bi_prod(struct expr *args)
+struct expr *bi_prod(unsigned int argc, struct expr **argv)
 {
 	/* should be an exact copy of bi_sum, except the operator */
 	double tot = 1;
-	while (args) {
-		struct expr *num;
-		assert(args->type == T_PAIR);
-		num = args->data.pair.car;
-		if (check_type(num, T_NUMBER)) {
+	unsigned int i;
+	for (i = 0; i < argc; ++i) {
+		if (check_type(argv[i], T_NUMBER)) {
 			return NULL;
 		}
-		tot *= num->data.number;
-		args = args->data.pair.cdr;
+		tot *= argv[i]->data.number;
 	}
 	return make_number(tot);
 }
 
-struct expr *bi_diff(struct expr *args)
+struct expr *bi_diff(unsigned int argc, struct expr **argv)
 {
-	int processed = 0;
 	double tot = 0.0;
-	while (args) {
-		struct expr *num;
-		assert(args->type == T_PAIR);
-		num = args->data.pair.car;
-		if (check_type(num, T_NUMBER)) {
+	unsigned int i;
+	for (i = 0; i < argc; ++i) {
+		if (check_type(argv[i], T_NUMBER)) {
 			return NULL;
 		}
-		if (processed == 0) {
-			tot = num->data.number;
+		if (i == 0) {
+			tot = argv[i]->data.number;
 		} else {
-			tot -= num->data.number;
+			tot -= argv[i]->data.number;
 		}
-		++processed;
-		args = args->data.pair.cdr;
 	}
-	return processed == 1 ? make_number(-tot) : make_number(tot);
+	return argc == 1 ? make_number(-tot) : make_number(tot);
 }
 
-struct expr *bi_quot(struct expr *args)
+struct expr *bi_quot(unsigned int argc, struct expr **argv)
 {
 	/* should be an exact copy of bi_diff, except the operator */
-	int first = 1;
 	double tot = 0.0;
-	while (args) {
-		struct expr *num;
-		assert(args->type == T_PAIR);
-		num = args->data.pair.car;
-		if (check_type(num, T_NUMBER)) {
+	unsigned int i;
+	for (i = 0; i < argc; ++i) {
+		if (check_type(argv[i], T_NUMBER)) {
 			return NULL;
 		}
-		if (first) {
-			tot = num->data.number;
-			first = 0;
+		if (i == 0) {
+			tot = argv[i]->data.number;
 		} else {
-			tot /= num->data.number;
+			tot /= argv[i]->data.number;
 		}
-		args = args->data.pair.cdr;
 	}
 	return make_number(tot);
 }
 
-struct expr *bi_pow(struct expr *args)
+struct expr *bi_pow(unsigned int argc, struct expr **argv)
 {
-	struct expr *base;
-	struct expr *expt;
-	if (check_arg_count(args, 2)) {
+	if (check_arg_count(argc, 2)
+	    || check_type(argv[0], T_NUMBER)
+	    || check_type(argv[1], T_NUMBER)) {
 		return NULL;
 	}
-	base = list_index(args, 0);
-	expt = list_index(args, 1);
-	if (check_type(base, T_NUMBER) || check_type(expt, T_NUMBER)) {
-		return NULL;
-	}
-	return make_number(pow(base->data.number, expt->data.number));
+	return make_number(pow(argv[0]->data.number, argv[1]->data.number));
 }
 
-struct expr *bi_numle(struct expr *args)
+struct expr *bi_numle(unsigned int argc, struct expr **argv)
 {
-	struct expr *lhs;
-	struct expr *rhs;
-	if (check_arg_count(args, 2)) {
-		return NULL;
-	}
-	lhs = list_index(args, 0);
-	rhs = list_index(args, 1);
-	if (check_type(lhs, T_NUMBER) || check_type(rhs, T_NUMBER)) {
+	if (check_arg_count(argc, 2)
+	    || check_type(argv[0], T_NUMBER)
+	    || check_type(argv[1], T_NUMBER)) {
 		return NULL;
 	}
-	return lhs->data.number < rhs->data.number ? globals.TRUE : globals.FALSE;
+	return argv[0]->data.number < argv[1]->data.number
+		? globals.TRUE : globals.FALSE;
 }
 
-struct expr *bi_numeq(struct expr *args)
+struct expr *bi_numeq(unsigned int argc, struct expr **argv)
 {
-	struct expr *lhs;
-	struct expr *rhs;
-	if (check_arg_count(args, 2)) {
+	if (check_arg_count(argc, 2)
+	    || check_type(argv[0], T_NUMBER)
+	    || check_type(argv[1], T_NUMBER)) {
 		return NULL;
 	}
-	lhs = list_index(args, 0);
-	rhs = list_index(args, 1);
-	if (check_type(lhs, T_NUMBER) || check_type(rhs, T_NUMBER)) {
-		return NULL;
-	}
-	return lhs->data.number == rhs->data.number ? globals.TRUE : globals.FALSE;
-}
-
-struct expr *bi_and(struct expr *args)
-{
-	while (args) {
-		assert(args->type == T_PAIR);
-		if (eval_expr(args->data.pair.car)->data.symbol == globals.FALSE->data.symbol) {
-			return globals.FALSE;
-		}
-		args = args->data.pair.cdr;
-	}
-	/* and of empty list is true */
-	return globals.TRUE;
-}
-
-struct expr *bi_or(struct expr *args)
-{
-	while (args) {
-		assert(args->type == T_PAIR);
-		if (eval_expr(args->data.pair.car)->data.symbol == globals.TRUE->data.symbol) {
-			return globals.TRUE;
-		}
-		args = args->data.pair.cdr;
-	}
-	/* or of empty list is false */
-	return globals.FALSE;
+	return argv[0]->data.number == argv[1]->data.number
+		? globals.TRUE : globals.FALSE;
 }
 
-struct expr *bi_pair(struct expr *args)
+struct expr *bi_pair(unsigned int argc, struct expr **argv)
 {
-	struct expr *e;
-	if (check_arg_count(args, 1)) {
+	if (check_arg_count(argc, 1)) {
 		return NULL;
 	}
-	e = list_index(args, 0);
-	if (e && e->type == T_PAIR) {
+	if (argv[0] && argv[0]->type == T_PAIR) {
 		return globals.TRUE;
 	} else {
 		return globals.FALSE;
 	}
 }
 
-struct expr *bi_debug(struct expr *args)
+/* Set a flag from a truth value argument, used by debug, jit and trace.
+ */
+static struct expr *set_flag(unsigned int argc, struct expr **argv, int *flag)
 {
 	struct expr *e;
-	if (check_arg_count(args, 1)) {
+	if (check_arg_count(argc, 1)) {
 		return NULL;
 	}
-	e = list_index(args, 0);
+	e = argv[0];
 	if (check_type(e, T_SYMBOL)) {
 		return NULL;
 	}
 	if (e->data.symbol == globals.TRUE->data.symbol) {
-		globals.debug = 1;
+		*flag = 1;
 	} else if (e->data.symbol == globals.FALSE->data.symbol) {
-		globals.debug = 0;
+		*flag = 0;
 	} else {
 		fprintf(stderr, "Invalid truth value: ");
 		print_expr(e, stderr);
-		globals.error = ERR_USER;
+		thread.error = ERR_USER;
 	}
 	return NULL;
 }
 
-struct expr *bi_exit(struct expr *args)
+struct expr *bi_debug(unsigned int argc, struct expr **argv)
+{
+	return set_flag(argc, argv, &globals.debug);
+}
+
+struct expr *bi_jit(unsigned int argc, struct expr **argv)
+{
+	return set_flag(argc, argv, &globals.jit);
+}
+
+struct expr *bi_fuse(unsigned int argc, struct expr **argv)
+{
+	return set_flag(argc, argv, &globals.fuse);
+}
+
+struct expr *bi_trace(unsigned int argc, struct expr **argv)
+{
+	return set_flag(argc, argv, &globals.trace);
+}
+
+struct expr *bi_exit(unsigned int argc, struct expr **argv)
 {
-	int length = list_length(args);
-	if (length == 0) {
+	if (argc == 0) {
 		exit(0);
-	} else if (length == 1) {
-		struct expr *ret = list_index(args, 0);
-		if (check_type(ret, T_NUMBER)) {
+	} else if (argc == 1) {
+		if (check_type(argv[0], T_NUMBER)) {
 			return NULL;
 		}
-		exit(ret->data.number);
+		exit(argv[0]->data.number);
 	} else {
 		fprintf(stderr, "Too many arguments, expected 0 or 1!\n");
 		return NULL;
 	}
 }
+
+struct expr *bi_to_string(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 1)) {
+		return NULL;
+	}
+	thread.out.len = 0;
+	print_buffer(argv[0], &thread.out);
+	return make_string(thread.out.data, thread.out.len);
+}
+
+struct expr *bi_hash_cons(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 1)) {
+		return NULL;
+	}
+	return hash_cons(argv[0]);
+}
+
+struct expr *bi_hash_quotes(unsigned int argc, struct expr **argv)
+{
+	return set_flag(argc, argv, &globals.hash_quotes);
+}
+
+/* Read a string as data, which is hash-consed.
+ */
+struct expr *bi_read_data(unsigned int argc, struct expr **argv)
+{
+	const char *endptr;
+	struct expr *e;
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_STRING)) {
+		return NULL;
+	}
+	e = read_expr(string_text(argv[0]), &endptr);
+	if (thread.error != ERR_NONE) {
+		return NULL;
+	}
+	if (*skip_spaces(endptr)) {
+		fprintf(stderr, "Trailing text \"%s\"!\n", endptr);
+		thread.error = ERR_PARSE;
+		return NULL;
+	}
+	return hash_cons(e);
+}
+
+struct expr *bi_delay(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 1)) {
+		return NULL;
+	}
+	return make_promise(argv[0]);
+}
+
+/* Make a generator, which calls the function without arguments when next
+ * is first called on it. The function passes values to the callers of
+ * next with yield, which suspends it until next is called again. Once it
+ * returns, next gives nil.
+ */
+struct expr *bi_make_generator(unsigned int argc, struct expr **argv)
+{
+	struct expr *e;
+	struct generator *g;
+	if (check_arg_count(argc, 1)) {
+		return NULL;
+	}
+	e = new_expr(T_GENERATOR);
+	g = &e->data.generator;
+	g->function = argv[0];
+	if (argv[0]) {
+		++argv[0]->refs;
+	}
+	g->frames = NULL;
+	g->count = 0;
+	g->frames_size = 0;
+	g->values = NULL;
+	g->values_count = 0;
+	g->values_size = 0;
+	g->state = G_NEW;
+	region_dirty(e);
+	return e;
+}
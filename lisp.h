@@ -3,13 +3,43 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <signal.h>
 
 #define SYMBOL_MAXLEN 30
+#define SYMBOL_CHUNK_SIZE 256
+/* number of calls before a lambda is compiled */
+#define JIT_THRESHOLD 100
+/* enough for any double printed by format_number */
+#define NUMBER_MAXLEN 32
+/* events kept by each thread for tracing, a power of two */
+#define TRACE_EVENTS 65536
+/* events counted by perf-stat, see perf.c */
+#define PERF_EVENTS 7
+/* expressions allocated at once by each thread, see new_expr */
+#define EXPR_CHUNK_SIZE 1024
 
 enum error {
 	ERR_NONE,
 	ERR_PARSE,
-	ERR_USER
+	ERR_USER,
+	/* limits exceeded, see struct limits */
+	ERR_FUEL,
+	ERR_MEMORY,
+	ERR_DEPTH
+};
+
+/* Limits on a single evaluation, 0 meaning no limit. They are applied
+ * from the start of every evaluation that is not nested in another, such
+ * as the evaluation of a module.
+ */
+struct limits {
+	/* evaluation steps */
+	unsigned long fuel;
+	/* bytes of expressions allocated and not freed */
+	size_t heap;
+	/* frames on the evaluation stack */
+	size_t depth;
 };
 
 enum type {
@@ -18,7 +48,34 @@ enum type {
 	T_STRING,
 	T_PAIR,
 	T_BUILTIN,
-	T_LAMBDA
+	T_LAMBDA,
+	T_CONTINUATION,
+	T_PROMISE,
+	T_PORT,
+	T_FUTURE,
+	T_GENERATOR,
+	T_MEMO,
+	T_FOREIGN,
+	T_F64
+};
+
+/* How a builtin is called. Builtins without a function are implemented
+ * directly by the evaluator, see eval_expr.
+ */
+enum special {
+	/* the function is called with the evaluated arguments */
+	SF_NONE,
+	/* the function is called with the unevaluated arguments */
+	SF_QUOTED,
+	SF_IF,
+	SF_DEFINE,
+	SF_AND,
+	SF_OR,
+	SF_APPLY,
+	SF_CALLCC,
+	SF_FORCE,
+	SF_NEXT,
+	SF_YIELD
 };
 
 struct pair {
@@ -26,18 +83,201 @@ struct pair {
 	struct expr *cdr;
 };
 
-typedef struct expr *(*func_t)(struct expr *args);
+typedef struct expr *(*func_t)(unsigned int argc, struct expr **argv);
 
 struct builtin {
 	func_t func;
-	int spec_form;
+	enum special spec_form;
 	/* the name is only used for info messages */
 	const char *name;
 };
 
+/* A builtin created by the prelude, see create_prelude.
+ */
+struct builtin_def {
+	const char *name;
+	func_t func;
+	enum special spec_form;
+	/* the name of func in C, for generated code */
+	const char *c_name;
+};
+
 struct lambda {
 	struct expr *params;
 	struct expr *body;
+	/* number of calls, until it is compiled */
+	unsigned int calls;
+	/* compiled code, see jit.c */
+	struct jit_code *jit;
+	/* the first variable defined as the lambda, for tracing */
+	const char *name;
+};
+
+/* Kinds of frames on the evaluation stack, see eval_expr. */
+enum frame_type {
+	F_HEAD,
+	F_ARG,
+	F_IF,
+	F_AND,
+	F_OR,
+	F_DEFINE,
+	F_FORCE,
+	F_GENERATOR,
+	F_TRACE,
+	F_MEMO
+};
+
+/* A frame on the evaluation stack. The meaning of the fields depends on
+ * the type.
+ */
+struct frame {
+	enum frame_type type;
+	struct expr *a;
+	struct expr *b;
+	/* a position on the value stack */
+	size_t base;
+};
+
+struct continuation {
+	struct frame *frames;
+	size_t count;
+	struct expr **values;
+	size_t values_count;
+	/* the base of the value stack when captured */
+	size_t values_base;
+};
+
+/* A growable character buffer, reused between writes to avoid
+ * reallocating. The contents are always kept null-terminated.
+ */
+struct buffer {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/* States of a generator. */
+enum generator_state {
+	G_NEW,
+	G_RUNNING,
+	G_SUSPENDED,
+	G_DONE
+};
+
+/* A coroutine running a function, which passes values to next with
+ * yield. While suspended it keeps the frames and values of its part of
+ * the evaluation stacks, with bases relative to its own, and the arrays
+ * are reused by later suspensions.
+ */
+struct generator {
+	struct expr *function;
+	struct frame *frames;
+	size_t count;
+	size_t frames_size;
+	struct expr **values;
+	size_t values_count;
+	size_t values_size;
+	enum generator_state state;
+};
+
+/* A function that keeps the values of earlier calls, see memo.c.
+ */
+struct memo {
+	struct expr *function;
+	/* maximum number of values kept, or 0 */
+	size_t capacity;
+	unsigned long hits;
+	unsigned long misses;
+	struct memo_table *table;
+};
+
+/* Types of the parameters and results of foreign functions, see ffi.c.
+ */
+enum ffi_type {
+	FFI_VOID,
+	FFI_DOUBLE,
+	FFI_INT,
+	FFI_LONG,
+	FFI_STRING,
+	FFI_F64
+};
+
+/* registers for arguments of foreign functions, see ffi_call */
+#define FFI_MAX_INTS 6
+#define FFI_MAX_DOUBLES 8
+#define FFI_MAX_ARGS (FFI_MAX_INTS + FFI_MAX_DOUBLES)
+
+/* A shared library, or a function in one, see ffi.c.
+ */
+struct foreign {
+	/* the library, or null for a function */
+	void *handle;
+	void (*func)(void);
+	/* the path of the library or the name of the function, owned */
+	char *name;
+	/* enum ffi_type of each parameter and of the result */
+	unsigned char params[FFI_MAX_ARGS];
+	unsigned char param_count;
+	unsigned char result;
+};
+
+/* A buffer of doubles, passed to foreign functions as a pointer.
+ */
+struct f64 {
+	double *data;
+	size_t len;
+};
+
+/* A delayed expression, which is evaluated the first time it is forced.
+ */
+struct promise {
+	struct expr *expr;
+	struct expr *value;
+	int forced;
+};
+
+/* States of a future. */
+enum future_state {
+	/* waiting in the deque of a thread */
+	FUTURE_PENDING,
+	FUTURE_RUNNING,
+	FUTURE_DONE
+};
+
+/* An expression that may be evaluated by another thread, see future.c.
+ */
+struct future {
+	struct expr *expr;
+	struct expr *value;
+	/* the error of the evaluation */
+	enum error error;
+	enum future_state state;
+};
+
+/* A string, which either owns its null-terminated data or borrows it
+ * from the mapped file of a port, see string_text.
+ */
+struct string {
+	char *data;
+	size_t len;
+	/* the port that holds the data, or null if it is owned */
+	struct expr *port;
+};
+
+/* A file opened for reading lines, see io.c.
+ */
+struct port {
+	/* the file, unless it is mapped */
+	FILE *file;
+	/* the contents of a mapped regular file */
+	char *map;
+	size_t size;
+	size_t pos;
+	/* number of strings borrowing from the mapped contents */
+	size_t borrowers;
+	int closed;
+	/* the last line read from the file */
+	struct buffer line;
 };
 
 struct expr {
@@ -45,12 +285,96 @@ struct expr {
 	union {
 		const char *symbol;
 		double number;
-		char *string;
+		struct string string;
 		struct pair pair;
 		struct builtin builtin;
 		struct lambda lambda;
+		struct continuation continuation;
+		struct promise promise;
+		struct port port;
+		struct future future;
+		struct generator generator;
+		struct memo memo;
+		struct foreign foreign;
+		struct f64 f64;
 	} data;
 	unsigned int refs;
+	/* whether this is the unique hash-consed copy, see hash_cons */
+	unsigned char hashed;
+	/* an enum placement */
+	unsigned char placement;
+};
+
+/* Where an expression is allocated, see region.c.
+ */
+enum placement {
+	PL_HEAP,
+	PL_REGION,
+	/* in the region, and promoted */
+	PL_MOVED,
+	/* on the heap, but may refer into the region */
+	PL_DIRTY,
+	/* dirty, and being promoted */
+	PL_FIXING
+};
+
+/* A block of memory of a region, followed by its data.
+ */
+struct region_block {
+	struct region_block *next;
+	size_t size;
+};
+
+/* Memory of the expressions of a top-level evaluation, see region.c.
+ */
+struct region {
+	int active;
+	struct region_block *first;
+	/* the block being allocated from, and its free part */
+	struct region_block *block;
+	char *next;
+	char *end;
+	/* bytes allocated, which are charged to the heap */
+	size_t bytes;
+	struct expr **dirty;
+	size_t dirty_count;
+	size_t dirty_size;
+	struct expr **compiled;
+	size_t compiled_count;
+	size_t compiled_size;
+};
+
+/* A list or quote being read, see read_expr.
+ */
+struct read_frame {
+	struct expr *head;
+	struct expr *last;
+	/* whether this is a quote waiting for its expression */
+	int quote;
+};
+
+/* A pending part of an expression being printed, see print_buffer.
+ */
+struct print_frame {
+	struct expr *e;
+	int state;
+};
+
+/* Storage for symbol names, see save_symbol.
+ */
+struct symbol_chunk {
+	struct symbol_chunk *next;
+	size_t count;
+	char names[SYMBOL_CHUNK_SIZE][SYMBOL_MAXLEN + 1];
+};
+
+/* An open addressing hash table of saved symbols, see save_symbol.
+ */
+struct symbol_table {
+	const char **slots;
+	size_t size;
+	/* the smaller table this one replaced, which is never freed */
+	struct symbol_table *old;
 };
 
 struct variable {
@@ -58,31 +382,92 @@ struct variable {
 	struct expr *value;
 	struct variable *left;
 	struct variable *right;
+	/* the expression of a top-level definition, see depend.c */
+	struct expr *source;
+	/* definitions that read the variable, and their number when they
+	   are next pruned, see add_dependent */
+	struct dependent *dependents;
+	size_t dependents_count;
+	size_t dependents_limit;
+	/* incremented whenever the variable is set */
+	unsigned long generation;
+	/* whether the value must be recomputed from the source */
+	int stale;
+	/* the last definition that recorded reading it */
+	unsigned long read_stamp;
+};
+
+/* A definition that read a variable, while its variable had the given
+ * generation.
+ */
+struct dependent {
+	struct variable *variable;
+	unsigned long generation;
+	struct dependent *next;
 };
 
+/* State of recording the reads of a definition, see begin_tracking.
+ */
+struct tracking {
+	size_t reads_base;
+	unsigned long defining;
+};
+
+extern const struct builtin_def BUILTIN_DEFS[];
+extern const size_t BUILTIN_DEFS_COUNT;
+extern const struct builtin_def PORT_STREAM_DEF;
+
+void init_thread(unsigned int id);
 void init_globals(void);
+void create_prelude(void);
+void load_prelude(void);
+void init_char_classes(void);
 void free_expr(struct expr *e);
 void free_unused(void);
 
+unsigned long hash_string(const char *s);
+unsigned long hash_bytes(const char *s, size_t len);
+struct symbol_table *make_symbol_table(size_t size);
 const char *save_symbol(const char *symbol);
+void charge_heap(size_t bytes);
+struct expr *new_expr(enum type type);
 struct expr *make_symbol(const char *symbol);
 struct expr *make_pair(struct expr *car, struct expr *cdr);
 struct expr *make_string(const char *string, size_t len);
+const char *string_text(struct expr *e);
 struct expr *make_number(double number);
+struct expr *hash_cons(struct expr *e);
+unsigned long hash_equal(struct expr *e);
+int equal(struct expr *x, struct expr *y);
 
+struct variable *find_variable(const char *symbol);
 struct expr *get_variable(const char *symbol);
 void set_variable(const char *symbol, struct expr *value);
-void create_builtin(const char *symbol, func_t func, int sf);
+void set_refreshed_variable(const char *symbol, struct expr *value);
+struct expr *make_promise(struct expr *expr);
+struct expr *make_builtin(const char *name, func_t func, enum special sf);
+void create_builtin(const char *symbol, func_t func, enum special sf);
 void create_function(const char *symbol, const char *params, const char *body);
 
 struct expr *expr_copy(struct expr *e);
 
 struct expr *replace_symbol(struct expr *exp, const char *sym, struct expr *val);
-struct expr *eval_each(struct expr *list);
-struct expr *eval_lambda(struct lambda *lambda, struct expr *args);
-struct expr *eval_funcall(struct expr *f, struct expr *args);
+struct expr *bind_lambda(struct lambda *lambda, unsigned int argc, struct expr **argv);
+int push_frame(enum frame_type type,
+	       struct expr *a, struct expr *b, size_t base);
+int push_value(struct expr *value);
+struct expr *make_continuation(size_t base, size_t values_base);
 struct expr *eval_expr(struct expr *e);
+struct expr *apply_function(struct expr *f, unsigned int argc, struct expr **argv);
 
+void buffer_reserve(struct buffer *b, size_t len);
+void buffer_write(struct buffer *b, const char *data, size_t len);
+void buffer_putc(struct buffer *b, char c);
+void buffer_puts(struct buffer *b, const char *s);
+void buffer_flush(struct buffer *b, FILE *f);
+
+size_t format_number(double number, char *out);
+void print_buffer(struct expr *e, struct buffer *b);
 void print_expr(struct expr *e, FILE *f);
 void print_dbg_expr(struct expr *e, FILE *f);
 
@@ -91,50 +476,261 @@ struct expr *read_list(const char *text, const char **endptr);
 struct expr *read_symbol(const char *text, const char **endptr);
 struct expr *read_string(const char *text, const char **endptr);
 struct expr *read_number(const char *text, const char **endptr);
+struct expr *read_number_slow(const char *text, const char **endptr);
+struct expr *read_atom(const char *text, const char **endptr);
 struct expr *read_expr(const char *text, const char **endptr);
 
 unsigned int list_length(struct expr *list);
 struct expr *list_index(struct expr *list, unsigned int idx);
-int check_arg_count(struct expr *list, unsigned int l);
-
-struct expr *bi_define(struct expr *args);
-struct expr *bi_lambda(struct expr *args);
-struct expr *bi_if(struct expr *args);
-struct expr *bi_apply(struct expr *args);
-struct expr *bi_quote(struct expr *args);
-struct expr *bi_cons(struct expr *args);
-struct expr *bi_car(struct expr *args);
-struct expr *bi_cdr(struct expr *args);
-struct expr *bi_eq(struct expr *args);
-struct expr *bi_list(struct expr *args);
-struct expr *bi_append(struct expr *args);
-struct expr *bi_sum(struct expr *args);
-struct expr *bi_prod(struct expr *args);
-struct expr *bi_diff(struct expr *args);
-struct expr *bi_quot(struct expr *args);
-struct expr *bi_pow(struct expr *args);
-struct expr *bi_numle(struct expr *args);
-struct expr *bi_numeq(struct expr *args);
-struct expr *bi_and(struct expr *args);
-struct expr *bi_or(struct expr *args);
-struct expr *bi_pair(struct expr *args);
-struct expr *bi_debug(struct expr *args);
-struct expr *bi_exit(struct expr *args);
-
-/* All global state. Can later pass around a pointer to this.
- */
-struct globals {
-	char (*symbols)[SYMBOL_MAXLEN + 1];
-	size_t symbols_size;
+int check_arg_count(unsigned int argc, unsigned int expected);
+struct expr *make_list(unsigned int argc, struct expr **argv);
+int check_type(struct expr *e, enum type t);
+
+struct expr *bi_lambda(unsigned int argc, struct expr **argv);
+struct expr *bi_quote(unsigned int argc, struct expr **argv);
+struct expr *bi_cons(unsigned int argc, struct expr **argv);
+struct expr *bi_car(unsigned int argc, struct expr **argv);
+struct expr *bi_cdr(unsigned int argc, struct expr **argv);
+struct expr *bi_eq(unsigned int argc, struct expr **argv);
+struct expr *bi_equal(unsigned int argc, struct expr **argv);
+struct expr *bi_list(unsigned int argc, struct expr **argv);
+struct expr *bi_append(unsigned int argc, struct expr **argv);
+struct expr *bi_sum(unsigned int argc, struct expr **argv);
+struct expr *bi_prod(unsigned int argc, struct expr **argv);
+struct expr *bi_diff(unsigned int argc, struct expr **argv);
+struct expr *bi_quot(unsigned int argc, struct expr **argv);
+struct expr *bi_pow(unsigned int argc, struct expr **argv);
+struct expr *bi_numle(unsigned int argc, struct expr **argv);
+struct expr *bi_numeq(unsigned int argc, struct expr **argv);
+struct expr *bi_pair(unsigned int argc, struct expr **argv);
+struct expr *bi_debug(unsigned int argc, struct expr **argv);
+struct expr *bi_exit(unsigned int argc, struct expr **argv);
+struct expr *bi_to_string(unsigned int argc, struct expr **argv);
+struct expr *bi_jit(unsigned int argc, struct expr **argv);
+struct expr *bi_trace(unsigned int argc, struct expr **argv);
+struct expr *bi_hash_cons(unsigned int argc, struct expr **argv);
+struct expr *bi_hash_quotes(unsigned int argc, struct expr **argv);
+struct expr *bi_read_data(unsigned int argc, struct expr **argv);
+struct expr *bi_require(unsigned int argc, struct expr **argv);
+struct expr *bi_delay(unsigned int argc, struct expr **argv);
+struct expr *bi_make_generator(unsigned int argc, struct expr **argv);
+
+struct expr *open_port(const char *path);
+void free_port(struct port *port);
+struct expr *make_borrowed(struct expr *port, char *data, size_t len);
+void release_string(struct expr *string);
+struct expr *bi_stream_from_file(unsigned int argc, struct expr **argv);
+struct expr *bi_port_stream(unsigned int argc, struct expr **argv);
+struct expr *bi_open_input_file(unsigned int argc, struct expr **argv);
+struct expr *bi_read_line(unsigned int argc, struct expr **argv);
+struct expr *bi_read_lines(unsigned int argc, struct expr **argv);
+struct expr *bi_for_each_line(unsigned int argc, struct expr **argv);
+struct expr *bi_write_string(unsigned int argc, struct expr **argv);
+struct expr *bi_close_port(unsigned int argc, struct expr **argv);
+
+enum trace_type {
+	TE_ENTER,
+	TE_EXIT,
+	/* the heap of the thread, in bytes */
+	TE_HEAP
+};
+
+/* An event recorded by the tracer, see trace.c.
+ */
+struct trace_event {
+	/* nanoseconds of the monotonic clock */
+	unsigned long time;
+	const char *name;
+	size_t value;
+	enum trace_type type;
+};
+
+/* The last TRACE_EVENTS events of a thread.
+ */
+struct trace_ring {
+	struct trace_event events[TRACE_EVENTS];
+	/* number of events recorded */
+	unsigned long count;
+	unsigned int tid;
+	struct trace_ring *next;
+};
+
+void trace_event(enum trace_type type, const char *name, size_t value);
+struct expr *bi_trace_dump(unsigned int argc, struct expr **argv);
+
+/* Event counts of an evaluation, see perf.c. Counts of unavailable
+ * events are negative.
+ */
+struct perf_counts {
+	double counts[PERF_EVENTS];
+	unsigned long calls;
+	double seconds;
+};
+
+void perf_begin(struct perf_counts *c);
+void perf_end(struct perf_counts *c);
+void perf_print(struct perf_counts *c, FILE *f);
+struct expr *bi_perf_stat(unsigned int argc, struct expr **argv);
+
+/* names kept by the sampling profiler by default, see profile_start */
+#define PROFILE_BUFFER (1 << 20)
+
+int profile_start(unsigned int rate, size_t capacity);
+int profile_stop(const char *path);
+
+void region_begin(void);
+struct expr *region_end(struct expr *result);
+void *region_alloc(size_t size);
+struct expr *region_expr(void);
+int region_pause(void);
+void region_resume(int active);
+void region_dirty(struct expr *e);
+void region_compiled(struct expr *lambda);
+struct expr *promote(struct expr *e);
+
+void begin_tracking(struct tracking *t);
+void record_read(struct variable *v);
+void end_tracking(struct tracking *t, const char *symbol, struct expr *source);
+void mark_dependents(struct variable *v);
+void refresh_variable(struct variable *v);
+
+int is_fusable(struct expr *f, struct expr *args);
+struct expr *fuse(struct expr *f, struct expr *args);
+struct expr *bi_fuse(unsigned int argc, struct expr **argv);
+
+struct expr *make_memo(struct expr *function, size_t capacity);
+void free_memo(struct memo *m);
+unsigned long memo_hash(unsigned int argc, struct expr **argv);
+int memo_lookup(struct expr *memo, unsigned int argc, struct expr **argv,
+		unsigned long hash, struct expr **value);
+void memo_insert(struct expr *memo, struct expr *args, struct expr *value);
+struct expr *bi_memoize(unsigned int argc, struct expr **argv);
+struct expr *bi_memo_stats(unsigned int argc, struct expr **argv);
+
+struct expr *bi_ffi_load(unsigned int argc, struct expr **argv);
+struct expr *bi_ffi_func(unsigned int argc, struct expr **argv);
+struct expr *ffi_call(struct expr *f, unsigned int argc, struct expr **argv);
+struct expr *bi_make_f64(unsigned int argc, struct expr **argv);
+struct expr *bi_f64_ref(unsigned int argc, struct expr **argv);
+struct expr *bi_f64_set(unsigned int argc, struct expr **argv);
+struct expr *bi_f64_length(unsigned int argc, struct expr **argv);
+
+struct scheduler *make_scheduler(void);
+struct expr *bi_future(unsigned int argc, struct expr **argv);
+struct expr *bi_touch(unsigned int argc, struct expr **argv);
+struct expr *bi_workers(unsigned int argc, struct expr **argv);
+
+int serve(const char *path, int port, int workers);
+
+char *read_file(const char *path);
+int compile_file(const char *in, const char *out);
+int compiled_truth(struct expr *value);
+int compiled_is(struct expr *value, struct expr *truth);
+struct expr *compiled_constant(const char *text);
+void compiled_run(const char *text);
+
+void jit_compile(struct expr *lambda);
+void jit_free(struct jit_code *jit);
+int jit_call(struct expr *lambda, unsigned int argc, struct expr **argv,
+	     struct expr **value);
+
+/* Global state shared by all threads. Tables that evaluation may change
+ * are guarded by their locks, see future.c.
+ */
+extern struct globals {
+	struct symbol_chunk *symbol_chunks;
+	/* read without locking, see save_symbol */
+	struct symbol_table *symbols;
 	size_t symbols_count;
+	pthread_mutex_t symbols_lock;
 	struct expr **exprs;
 	size_t exprs_size;
 	size_t exprs_count;
-	enum error error;
 	int debug;
+	int jit;
+	/* whether events are traced, see trace.c */
+	int trace;
+	/* whether the stack of lambdas is kept for the profiler, see
+	   profile.c */
+	int profile;
+	/* incremented whenever a variable is redefined */
+	unsigned long epoch;
+	/* top-level definitions evaluated, see depend.c */
+	unsigned long definitions;
+	/* whether top-level evaluations allocate in regions, see region.c */
+	int regions;
 	struct variable *variables;
+	pthread_mutex_t variables_lock;
 	struct expr *TRUE;
 	struct expr *FALSE;
+	/* reads the rest of a stream from a port */
+	struct expr *PORT_STREAM;
+	/* list functions of the prelude, see fuse.c */
+	struct expr *MAP;
+	struct expr *FILTER;
+	struct expr *FOLD;
+	struct expr *LENGTH;
+	/* whether chains of list functions are fused */
+	int fuse;
+	/* weak table of hash-consed expressions */
+	struct expr **hashed;
+	size_t hashed_size;
+	size_t hashed_count;
+	pthread_mutex_t hashed_lock;
+	/* whether the reader hash-conses quoted constants */
+	int hash_quotes;
+	struct limits limits;
+	/* directories searched by require, separated by colons */
+	const char *module_path;
+	struct module *modules;
+	/* worker threads evaluating futures */
+	struct scheduler *scheduler;
 } globals;
 
+/* State of the evaluation running on the current thread.
+ */
+extern __thread struct thread {
+	/* 0 for the thread that called init_globals, see future.c */
+	unsigned int id;
+	enum error error;
+	/* reused by print_expr and to-string */
+	struct buffer out;
+	struct print_frame *print_stack;
+	size_t print_stack_size;
+	struct read_frame *read_stack;
+	size_t read_stack_size;
+	struct frame *frames;
+	size_t frames_count;
+	size_t frames_size;
+	/* set while the frames are reallocated, see push_frame */
+	volatile sig_atomic_t frames_moving;
+	struct expr **values;
+	size_t values_count;
+	size_t values_size;
+	/* remaining steps of the current evaluation */
+	unsigned long fuel;
+	/* functions applied by the interpreter */
+	unsigned long calls;
+	/* bytes of allocated expressions, and the maximum */
+	size_t heap;
+	size_t heap_max;
+	/* number of nested calls of eval_expr */
+	unsigned int evaluating;
+	/* freed expressions, linked through their cdr, and the unused
+	   rest of the last chunk allocated, see new_expr */
+	struct expr *free_exprs;
+	struct expr *chunk;
+	size_t chunk_left;
+	/* recent events, if any were traced */
+	struct trace_ring *trace;
+	/* the definition being evaluated, or 0, and the globals it read,
+	   see depend.c */
+	unsigned long defining;
+	struct variable **reads;
+	size_t reads_count;
+	size_t reads_size;
+	/* memory of the current top-level evaluation, see region.c */
+	struct region *region;
+} thread;
+
 #endif
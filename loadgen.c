@@ -0,0 +1,202 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* A load generator for the server mode, see server.c.
+ *
+ * Opens a number of connections, each of which sends a request and waits
+ * for its response before sending the next one, for a number of seconds.
+ * Reports the requests per second and percentiles of the latency.
+ */
+
+#define LOADGEN_EVENTS 64
+
+struct connection {
+	int fd;
+	/* when the pending request was sent */
+	double sent;
+	/* bytes of the response read so far */
+	size_t received;
+};
+
+/* Latencies in seconds of all completed requests. */
+static double *latencies;
+static size_t latencies_count;
+static size_t latencies_size;
+static unsigned long errors;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(const char *path, int port)
+{
+	int fd;
+	if (port) {
+		struct sockaddr_in addr;
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		memset(&addr, 0, sizeof addr);
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof addr)) {
+			perror("connect");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		struct sockaddr_un addr;
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		memset(&addr, 0, sizeof addr);
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+		if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof addr)) {
+			perror("connect");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return fd;
+}
+
+static void send_request(struct connection *c, const char *request, size_t len)
+{
+	c->sent = now();
+	c->received = 0;
+	if (write(c->fd, request, len) != (ssize_t) len) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void record_latency(double latency)
+{
+	if (latencies_count == latencies_size) {
+		latencies_size = latencies_size ? 2 * latencies_size : 4096;
+		latencies = realloc(latencies, latencies_size * sizeof *latencies);
+		if (!latencies) {
+			fprintf(stderr, "Out of memory for latencies!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	latencies[latencies_count++] = latency;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double p)
+{
+	size_t i = (size_t) (p / 100 * (latencies_count - 1));
+	return latencies[i] * 1e6;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s (--socket PATH | --tcp PORT) [--connections N]"
+		" [--seconds S] [--expr EXPR]\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	int port = 0;
+	int connections = 16;
+	double seconds = 5;
+	const char *expr = "(+ 1 2)";
+	char *request;
+	size_t request_len;
+	struct connection *conns;
+	struct epoll_event events[LOADGEN_EVENTS];
+	int epfd;
+	double start;
+	double elapsed;
+	int i;
+	for (i = 1; i < argc; ++i) {
+		if (i + 1 < argc && !strcmp(argv[i], "--socket")) {
+			path = argv[++i];
+		} else if (i + 1 < argc && !strcmp(argv[i], "--tcp")) {
+			port = atoi(argv[++i]);
+		} else if (i + 1 < argc && !strcmp(argv[i], "--connections")) {
+			connections = atoi(argv[++i]);
+		} else if (i + 1 < argc && !strcmp(argv[i], "--seconds")) {
+			seconds = atof(argv[++i]);
+		} else if (i + 1 < argc && !strcmp(argv[i], "--expr")) {
+			expr = argv[++i];
+		} else {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if ((!path && !port) || connections < 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	request_len = strlen(expr) + 1;
+	request = malloc(request_len + 1);
+	sprintf(request, "%s\n", expr);
+	epfd = epoll_create1(0);
+	conns = malloc(connections * sizeof *conns);
+	for (i = 0; i < connections; ++i) {
+		struct epoll_event ev;
+		conns[i].fd = connect_server(path, port);
+		ev.events = EPOLLIN;
+		ev.data.ptr = &conns[i];
+		epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+	}
+	start = now();
+	for (i = 0; i < connections; ++i) {
+		send_request(&conns[i], request, request_len);
+	}
+	while ((elapsed = now() - start) < seconds) {
+		int n = epoll_wait(epfd, events, LOADGEN_EVENTS, 100);
+		for (i = 0; i < n; ++i) {
+			struct connection *c = events[i].data.ptr;
+			char buf[4096];
+			ssize_t len = read(c->fd, buf, sizeof buf);
+			if (len <= 0) {
+				fprintf(stderr, "Connection closed by server!\n");
+				return EXIT_FAILURE;
+			}
+			if (c->received == 0 && !strncmp(buf, "error: ", len < 7 ? len : 7)) {
+				++errors;
+			}
+			c->received += len;
+			if (buf[len - 1] == '\n') {
+				record_latency(now() - c->sent);
+				send_request(c, request, request_len);
+			}
+		}
+	}
+
+	if (latencies_count == 0) {
+		fprintf(stderr, "No requests completed!\n");
+		return EXIT_FAILURE;
+	}
+	qsort(latencies, latencies_count, sizeof *latencies, compare_doubles);
+	printf("%lu requests in %.2f s over %d connections, %lu errors\n",
+	       (unsigned long) latencies_count, elapsed, connections, errors);
+	printf("%.0f requests/s\n", latencies_count / elapsed);
+	printf("latency us: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+	       percentile(50), percentile(90), percentile(99), percentile(99.9),
+	       percentile(100));
+	return 0;
+}
@@ -1,33 +1,113 @@
+#define _DEFAULT_SOURCE
+
 #ifdef USE_READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
 #endif
 
+#include <string.h>
+#include <unistd.h>
+
 #include "lisp.h"
 
 #define REPL_MAXLEN 100
 
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [--serve SOCKET | --serve-tcp PORT] [--workers N] [--perf]\n"
+		"          [--sample-profile=FILE] [--sample-rate=HZ] [--regions]\n"
+		"       %s --compile-c IN -o OUT\n",
+		name, name);
+}
+
+/* file of the sampling profile, written at exit, see profile.c */
+static const char *profile_path;
+
+static void write_profile(void)
+{
+	if (profile_stop(profile_path)) {
+		fprintf(stderr, "Can not write profile to %s!\n", profile_path);
+	}
+}
+
 int main(int argc, char **argv)
 {
 #ifndef USE_READLINE
 	char repl_buf[REPL_MAXLEN];
 #endif
-	if (argc > 1) {
-		printf("No args expected, got: %s ...", argv[0]);
+	const char *socket_path = NULL;
+	int port = 0;
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	/* source and output of the compiler, see compile.c */
+	const char *compile_in = NULL;
+	const char *compile_out = NULL;
+	/* whether to print event counts of every evaluation */
+	int perf = 0;
+	struct perf_counts counts;
+	/* samples per second of processor time */
+	unsigned int sample_rate = 997;
+	/* whether to allocate each evaluation in a region, see region.c */
+	int regions = 0;
+	int i;
+	for (i = 1; i < argc; ++i) {
+		if (i + 1 < argc && !strcmp(argv[i], "--serve")) {
+			socket_path = argv[++i];
+		} else if (i + 1 < argc && !strcmp(argv[i], "--serve-tcp")) {
+			port = atoi(argv[++i]);
+		} else if (i + 1 < argc && !strcmp(argv[i], "--workers")) {
+			workers = atoi(argv[++i]);
+		} else if (i + 1 < argc && !strcmp(argv[i], "--compile-c")) {
+			compile_in = argv[++i];
+		} else if (i + 1 < argc && !strcmp(argv[i], "-o")) {
+			compile_out = argv[++i];
+		} else if (!strcmp(argv[i], "--perf")) {
+			perf = 1;
+		} else if (!strcmp(argv[i], "--regions")) {
+			regions = 1;
+		} else if (!strncmp(argv[i], "--sample-profile=", 17) && argv[i][17]) {
+			profile_path = argv[i] + 17;
+		} else if (!strncmp(argv[i], "--sample-rate=", 14)
+			   && atoi(argv[i] + 14) > 0) {
+			sample_rate = atoi(argv[i] + 14);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!compile_in != !compile_out) {
+		usage(argv[0]);
 		return 1;
 	}
 
 	init_globals();
+	globals.regions = regions;
+	if (compile_in) {
+		return compile_file(compile_in, compile_out);
+	}
+	if (profile_path) {
+		if (profile_start(sample_rate, PROFILE_BUFFER)) {
+			fprintf(stderr, "Can not start the profiler!\n");
+			return 1;
+		}
+		/* (exit) ends the process from a builtin */
+		atexit(write_profile);
+	}
+	if (socket_path || port) {
+		return serve(socket_path, port, workers > 0 ? workers : 1);
+	}
 	while (1) {
 		const char *endptr = NULL;
 		struct expr *e;
 		struct expr *r;
 #ifdef USE_READLINE
 		char *repl_line = readline("> ");
+		region_begin();
 		e = read_expr(repl_line, &endptr);
 #else
 		printf("> ");
 		fgets(repl_buf, REPL_MAXLEN, stdin);
+		region_begin();
 		e = read_expr(repl_buf, &endptr);
 #endif
 		if (globals.debug) {
@@ -38,8 +118,15 @@ int main(int argc, char **argv)
 		if (*skip_spaces(endptr)) {
 			fprintf(stderr, "Trailing text \"%s\"!\n", endptr);
 		} else {
+			if (perf) {
+				perf_begin(&counts);
+			}
 			r = eval_expr(e);
-			if (globals.error == ERR_NONE) {
+			if (perf) {
+				perf_end(&counts);
+				perf_print(&counts, stderr);
+			}
+			if (thread.error == ERR_NONE) {
 				if (globals.debug) {
 					print_dbg_expr(r, stdout);
 				} else {
@@ -53,9 +140,10 @@ int main(int argc, char **argv)
 
 			} else {
 				/* error message has already been printed */
-				globals.error = ERR_NONE;
+				thread.error = ERR_NONE;
 			}
 		}
+		region_end(NULL);
 	}
 	return 0;
 }
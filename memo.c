@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "lisp.h"
+
+/* Memoized functions, see memoize.
+ *
+ * A memoized function keeps the values of earlier calls in a hash table
+ * keyed by the list of arguments, which are hashed with hash_equal and
+ * compared with equal. A call that is not in the table calls the
+ * function through an F_MEMO frame, which stores the value once it
+ * returns. With a capacity, the least recently used entry is evicted
+ * when the table is full. The table is locked, so that futures can share
+ * a memoized function.
+ */
+
+#define MEMO_BUCKETS 64
+
+struct memo_entry {
+	struct expr *args;
+	struct expr *value;
+	unsigned long hash;
+	/* next entry in the same bucket */
+	struct memo_entry *next;
+	/* neighbours in the order of use, most recent first */
+	struct memo_entry *newer;
+	struct memo_entry *older;
+};
+
+struct memo_table {
+	struct memo_entry **buckets;
+	size_t buckets_count;
+	size_t count;
+	struct memo_entry *newest;
+	struct memo_entry *oldest;
+	pthread_mutex_t lock;
+};
+
+/* Construct a memoized function, keeping at most capacity values, or any
+ * number if capacity is 0.
+ */
+struct expr *make_memo(struct expr *function, size_t capacity)
+{
+	struct expr *e = new_expr(T_MEMO);
+	struct memo *m = &e->data.memo;
+	struct memo_table *t = malloc(sizeof *t);
+	function = promote(function);
+	m->function = function;
+	if (function) {
+		++function->refs;
+	}
+	m->capacity = capacity;
+	m->hits = 0;
+	m->misses = 0;
+	t->buckets_count = MEMO_BUCKETS;
+	t->buckets = calloc(t->buckets_count, sizeof *t->buckets);
+	t->count = 0;
+	t->newest = NULL;
+	t->oldest = NULL;
+	pthread_mutex_init(&t->lock, NULL);
+	m->table = t;
+	return e;
+}
+
+static void release_entry(struct memo_entry *entry)
+{
+	--entry->args->refs;
+	if (entry->value) {
+		--entry->value->refs;
+	}
+	free(entry);
+}
+
+void free_memo(struct memo *m)
+{
+	struct memo_entry *entry = m->table->newest;
+	while (entry) {
+		struct memo_entry *older = entry->older;
+		release_entry(entry);
+		entry = older;
+	}
+	if (m->function) {
+		--m->function->refs;
+	}
+	pthread_mutex_destroy(&m->table->lock);
+	free(m->table->buckets);
+	free(m->table);
+}
+
+#define MEMO_HASH_BASIS 2166136261UL
+
+/* Add an argument to the hash of the ones before it. */
+static unsigned long hash_arg(unsigned long h, struct expr *arg)
+{
+	return (h ^ hash_equal(arg)) * 16777619UL;
+}
+
+/* Hash a list of arguments like hash_equal hashes a list of them.
+ */
+unsigned long memo_hash(unsigned int argc, struct expr **argv)
+{
+	unsigned long h = MEMO_HASH_BASIS;
+	unsigned int i;
+	for (i = 0; i < argc; ++i) {
+		h = hash_arg(h, argv[i]);
+	}
+	return h;
+}
+
+static int same_args(struct expr *args, unsigned int argc, struct expr **argv)
+{
+	unsigned int i;
+	for (i = 0; i < argc; ++i, args = args->data.pair.cdr) {
+		if (!args || !equal(args->data.pair.car, argv[i])) {
+			return 0;
+		}
+	}
+	return !args;
+}
+
+static void unlink_entry(struct memo_table *t, struct memo_entry *entry)
+{
+	if (entry->newer) {
+		entry->newer->older = entry->older;
+	} else {
+		t->newest = entry->older;
+	}
+	if (entry->older) {
+		entry->older->newer = entry->newer;
+	} else {
+		t->oldest = entry->newer;
+	}
+}
+
+static void link_newest(struct memo_table *t, struct memo_entry *entry)
+{
+	entry->newer = NULL;
+	entry->older = t->newest;
+	if (t->newest) {
+		t->newest->newer = entry;
+	} else {
+		t->oldest = entry;
+	}
+	t->newest = entry;
+}
+
+/* Look up the value of a call with the given arguments and hash, which
+ * becomes the most recently used. Returns non-zero and stores the value
+ * if it was found.
+ */
+int memo_lookup(struct expr *memo, unsigned int argc, struct expr **argv,
+		unsigned long hash, struct expr **value)
+{
+	struct memo *m = &memo->data.memo;
+	struct memo_table *t = m->table;
+	struct memo_entry *entry;
+	pthread_mutex_lock(&t->lock);
+	entry = t->buckets[hash & (t->buckets_count - 1)];
+	while (entry && (entry->hash != hash || !same_args(entry->args, argc, argv))) {
+		entry = entry->next;
+	}
+	if (entry) {
+		++m->hits;
+		unlink_entry(t, entry);
+		link_newest(t, entry);
+		*value = entry->value;
+	} else {
+		++m->misses;
+	}
+	pthread_mutex_unlock(&t->lock);
+	return entry != NULL;
+}
+
+/* Remove an entry from its bucket.
+ */
+static void unchain_entry(struct memo_table *t, struct memo_entry *entry)
+{
+	struct memo_entry **p = &t->buckets[entry->hash & (t->buckets_count - 1)];
+	while (*p != entry) {
+		p = &(*p)->next;
+	}
+	*p = entry->next;
+}
+
+/* Store the value of a call with a list of arguments, evicting the least
+ * recently used value if the table is full. The arguments are hashed
+ * like memo_hash hashes them.
+ */
+void memo_insert(struct expr *memo, struct expr *args, struct expr *value)
+{
+	struct memo *m = &memo->data.memo;
+	struct memo_table *t = m->table;
+	struct memo_entry *entry = malloc(sizeof *entry);
+	unsigned long hash = MEMO_HASH_BASIS;
+	struct expr *p;
+	size_t i;
+	for (p = args; p; p = p->data.pair.cdr) {
+		hash = hash_arg(hash, p->data.pair.car);
+	}
+	/* the table outlives the evaluation */
+	args = promote(args);
+	value = promote(value);
+	entry->args = args;
+	++args->refs;
+	entry->value = value;
+	if (value) {
+		++value->refs;
+	}
+	entry->hash = hash;
+	pthread_mutex_lock(&t->lock);
+	if (m->capacity && t->count == m->capacity) {
+		struct memo_entry *oldest = t->oldest;
+		unlink_entry(t, oldest);
+		unchain_entry(t, oldest);
+		release_entry(oldest);
+		--t->count;
+	}
+	if (t->count + 1 > t->buckets_count) {
+		/* grow, keeping the table at most fully loaded */
+		struct memo_entry **old = t->buckets;
+		size_t old_count = t->buckets_count;
+		t->buckets_count *= 2;
+		t->buckets = calloc(t->buckets_count, sizeof *t->buckets);
+		for (i = 0; i < old_count; ++i) {
+			struct memo_entry *e = old[i];
+			while (e) {
+				struct memo_entry *next = e->next;
+				struct memo_entry **bucket =
+					&t->buckets[e->hash & (t->buckets_count - 1)];
+				e->next = *bucket;
+				*bucket = e;
+				e = next;
+			}
+		}
+		free(old);
+	}
+	/* a future may have stored the same call meanwhile, which is
+	   then kept twice */
+	entry->next = t->buckets[hash & (t->buckets_count - 1)];
+	t->buckets[hash & (t->buckets_count - 1)] = entry;
+	link_newest(t, entry);
+	++t->count;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/* Memoize a function, optionally keeping only the given number of most
+ * recently used values.
+ */
+struct expr *bi_memoize(unsigned int argc, struct expr **argv)
+{
+	double capacity = 0;
+	if (argc != 1 && check_arg_count(argc, 2)) {
+		return NULL;
+	}
+	if (argc == 2) {
+		if (check_type(argv[1], T_NUMBER)) {
+			return NULL;
+		}
+		capacity = argv[1]->data.number;
+		if (capacity < 1 || capacity != (size_t) capacity) {
+			fprintf(stderr, "Invalid capacity, expected a positive integer!\n");
+			thread.error = ERR_USER;
+			return NULL;
+		}
+	}
+	return make_memo(argv[0], capacity);
+}
+
+/* The hits, misses and number of values of a memoized function as a
+ * list.
+ */
+struct expr *bi_memo_stats(unsigned int argc, struct expr **argv)
+{
+	struct memo *m;
+	struct expr *stats[3];
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_MEMO)) {
+		return NULL;
+	}
+	m = &argv[0]->data.memo;
+	pthread_mutex_lock(&m->table->lock);
+	stats[0] = make_number(m->hits);
+	stats[1] = make_number(m->misses);
+	stats[2] = make_number(m->table->count);
+	pthread_mutex_unlock(&m->table->lock);
+	return make_list(3, stats);
+}
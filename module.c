@@ -0,0 +1,495 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#include "lisp.h"
+
+/* Modules loaded with (require 'name).
+ *
+ * The file name.lisp is looked up in the directories of the search path,
+ * globals.module_path, and its expressions are evaluated once per
+ * process. The names defined at the top level of a module are renamed to
+ * name/definition, in the module itself as well, so that modules do not
+ * clash with each other or with the program.
+ *
+ * The renamed expressions are saved in a cache file, name.lispc, next to
+ * the source. Later loads read the cache instead of the source, as long
+ * as the modification time and size of the source are unchanged.
+ */
+
+#define MODULE_PATH_MAXLEN 4096
+#define CACHE_MAGIC "LISPC\001\n"
+#define CACHE_MAGIC_LEN 8
+
+enum cache_tag {
+	TAG_NIL = 'n',
+	TAG_SYMBOL = 's',
+	TAG_NUMBER = 'd',
+	TAG_STRING = 't',
+	TAG_LIST = 'l'
+};
+
+/* A module that has been required.
+ */
+struct module {
+	const char *name;
+	/* whether the module has been evaluated, or is being evaluated */
+	int loaded;
+	struct module *next;
+};
+
+/* Find the module with the saved name, or add it.
+ */
+static struct module *find_module(const char *name)
+{
+	struct module *m;
+	for (m = globals.modules; m; m = m->next) {
+		if (m->name == name) {
+			return m;
+		}
+	}
+	m = malloc(sizeof *m);
+	m->name = name;
+	m->loaded = 0;
+	m->next = globals.modules;
+	globals.modules = m;
+	return m;
+}
+
+/* Find the source of a module on the search path. Stores its path in
+ * path and its status in st, and returns non-zero if it is not found.
+ */
+static int find_source(const char *name, char *path, struct stat *st)
+{
+	const char *dir = globals.module_path;
+	while (*dir) {
+		size_t len = strcspn(dir, ":");
+		if (len + strlen(name) + 7 < MODULE_PATH_MAXLEN) {
+			memcpy(path, dir, len);
+			sprintf(path + len, "/%s.lisp", name);
+			if (!stat(path, st)) {
+				return 0;
+			}
+		}
+		dir += len;
+		if (*dir == ':') {
+			++dir;
+		}
+	}
+	return 1;
+}
+
+/* Read a whole file into a null-terminated buffer.
+ */
+char *read_file(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	char *text;
+	long len;
+	if (!f) {
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	text = malloc(len + 1);
+	if (len < 0 || fread(text, 1, len, f) != (size_t) len) {
+		free(text);
+		fclose(f);
+		return NULL;
+	}
+	text[len] = '\0';
+	fclose(f);
+	return text;
+}
+
+/* Lengths are written in little-endian order. Numbers are written in
+ * native byte order, since the cache is only used on the machine that
+ * wrote it.
+ */
+
+static void write_u32(FILE *f, unsigned long n)
+{
+	unsigned char bytes[4];
+	int i;
+	for (i = 0; i < 4; ++i) {
+		bytes[i] = (unsigned char) ((n >> (8 * i)) & 0xff);
+	}
+	fwrite(bytes, 1, 4, f);
+}
+
+static unsigned long read_u32(FILE *f)
+{
+	unsigned char bytes[4];
+	unsigned long n = 0;
+	int i;
+	if (fread(bytes, 1, 4, f) != 4) {
+		return 0;
+	}
+	for (i = 3; i >= 0; --i) {
+		n = (n << 8) | bytes[i];
+	}
+	return n;
+}
+
+/* Write an expression to the cache. Iterates along lists, so only
+ * nesting uses the C stack.
+ */
+static void write_expr(FILE *f, struct expr *e)
+{
+	size_t len;
+	struct expr *p;
+	if (!e) {
+		putc(TAG_NIL, f);
+		return;
+	}
+	switch (e->type) {
+	case T_SYMBOL:
+		len = strlen(e->data.symbol);
+		putc(TAG_SYMBOL, f);
+		putc((int) len, f);
+		fwrite(e->data.symbol, 1, len, f);
+		break;
+	case T_NUMBER:
+		putc(TAG_NUMBER, f);
+		fwrite(&e->data.number, sizeof e->data.number, 1, f);
+		break;
+	case T_STRING:
+		putc(TAG_STRING, f);
+		write_u32(f, e->data.string.len);
+		fwrite(e->data.string.data, 1, e->data.string.len, f);
+		break;
+	case T_PAIR:
+		putc(TAG_LIST, f);
+		for (len = 0, p = e; p && p->type == T_PAIR; p = p->data.pair.cdr) {
+			++len;
+		}
+		write_u32(f, len);
+		for (p = e; p && p->type == T_PAIR; p = p->data.pair.cdr) {
+			write_expr(f, p->data.pair.car);
+		}
+		/* the tail of a dotted list */
+		write_expr(f, p);
+		break;
+	default:
+		/* the reader produces no other types */
+		assert(0);
+	}
+}
+
+/* Read an expression from the cache. Strings are no longer than the
+ * source, max_len bytes. Returns non-zero if the cache is invalid.
+ */
+static int read_cached_expr(FILE *f, unsigned long max_len, struct expr **e)
+{
+	char symbol[SYMBOL_MAXLEN + 1];
+	char *string;
+	double number;
+	unsigned long len;
+	unsigned long i;
+	struct expr **tail;
+	switch (getc(f)) {
+	case TAG_NIL:
+		*e = NULL;
+		return 0;
+	case TAG_SYMBOL:
+		len = (unsigned long) getc(f);
+		if (len > SYMBOL_MAXLEN || fread(symbol, 1, len, f) != len) {
+			return 1;
+		}
+		symbol[len] = '\0';
+		*e = make_symbol(symbol);
+		return 0;
+	case TAG_NUMBER:
+		if (fread(&number, sizeof number, 1, f) != 1) {
+			return 1;
+		}
+		*e = make_number(number);
+		return 0;
+	case TAG_STRING:
+		len = read_u32(f);
+		if (len > max_len || !(string = malloc(len + 1))) {
+			return 1;
+		}
+		if (fread(string, 1, len, f) != len) {
+			free(string);
+			return 1;
+		}
+		*e = make_string(string, len);
+		free(string);
+		return 0;
+	case TAG_LIST:
+		len = read_u32(f);
+		tail = e;
+		for (i = 0; i < len; ++i) {
+			struct expr *car;
+			if (read_cached_expr(f, max_len, &car)) {
+				return 1;
+			}
+			*tail = make_pair(car, NULL);
+			if (tail != e) {
+				++(*tail)->refs;
+			}
+			tail = &(*tail)->data.pair.cdr;
+		}
+		if (read_cached_expr(f, max_len, tail)) {
+			return 1;
+		}
+		if (*tail && tail != e) {
+			++(*tail)->refs;
+		}
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/* Read the expressions of a module from its cache, if it is up to date
+ * with the source. Returns null if it is not.
+ */
+static struct expr *read_cache(const char *path, struct stat *st)
+{
+	char magic[CACHE_MAGIC_LEN];
+	struct expr *forms;
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		return NULL;
+	}
+	if (fread(magic, 1, CACHE_MAGIC_LEN, f) != CACHE_MAGIC_LEN
+	    || memcmp(magic, CACHE_MAGIC, CACHE_MAGIC_LEN)
+	    || read_u32(f) != ((unsigned long) st->st_mtime & 0xffffffffUL)
+	    || read_u32(f) != ((unsigned long) st->st_size & 0xffffffffUL)
+	    || read_cached_expr(f, st->st_size, &forms)
+	    || !forms) {
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	return forms;
+}
+
+/* Save the expressions of a module in its cache. The cache is written to
+ * a temporary file first, so that a partly written cache is never read.
+ * Failing to write it is not an error.
+ */
+static void write_cache(const char *path, struct stat *st, struct expr *forms)
+{
+	char tmp[MODULE_PATH_MAXLEN + 8];
+	FILE *f;
+	sprintf(tmp, "%s.tmp", path);
+	f = fopen(tmp, "wb");
+	if (!f) {
+		return;
+	}
+	fwrite(CACHE_MAGIC, 1, CACHE_MAGIC_LEN, f);
+	write_u32(f, (unsigned long) st->st_mtime);
+	write_u32(f, (unsigned long) st->st_size);
+	write_expr(f, forms);
+	if (fclose(f) || rename(tmp, path)) {
+		remove(tmp);
+	}
+}
+
+/* Check whether the expression is (define symbol ...).
+ */
+static const char *defined_name(struct expr *e)
+{
+	struct expr *name;
+	if (!e || e->type != T_PAIR
+	    || !e->data.pair.car || e->data.pair.car->type != T_SYMBOL
+	    || e->data.pair.car->data.symbol != save_symbol("define")
+	    || !e->data.pair.cdr || e->data.pair.cdr->type != T_PAIR) {
+		return NULL;
+	}
+	name = e->data.pair.cdr->data.pair.car;
+	return name && name->type == T_SYMBOL ? name->data.symbol : NULL;
+}
+
+/* A hash table from the names defined by a module to their renamed
+ * symbols. Slot i holds a name in names[2 * i] and the renamed symbol
+ * in names[2 * i + 1].
+ */
+struct renames {
+	const char **names;
+	size_t size;
+	size_t count;
+};
+
+static size_t rename_index(struct renames *r, const char *name)
+{
+	size_t mask = r->size - 1;
+	size_t i = (((size_t) name >> 4) * 2654435761UL) & mask;
+	while (r->names[2 * i] && r->names[2 * i] != name) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static void add_rename(struct renames *r, const char *name, const char *renamed)
+{
+	size_t i;
+	if (2 * (r->count + 1) > r->size) {
+		struct renames old = *r;
+		r->size = old.size ? 2 * old.size : 64;
+		r->count = 0;
+		r->names = calloc(2 * r->size, sizeof *r->names);
+		for (i = 0; i < old.size; ++i) {
+			if (old.names[2 * i]) {
+				add_rename(r, old.names[2 * i], old.names[2 * i + 1]);
+			}
+		}
+		free(old.names);
+	}
+	i = rename_index(r, name);
+	if (!r->names[2 * i]) {
+		++r->count;
+	}
+	r->names[2 * i] = name;
+	r->names[2 * i + 1] = renamed;
+}
+
+static void rename_symbols(struct expr *e, struct renames *r);
+
+/* Rename the expression in slot if it is a symbol defined by the module,
+ * or the symbols in it if it is a list.
+ */
+static void rename_slot(struct expr **slot, struct renames *r)
+{
+	struct expr *e = *slot;
+	size_t i;
+	if (!e) {
+		return;
+	} else if (e->type == T_PAIR) {
+		rename_symbols(e, r);
+		return;
+	} else if (e->type != T_SYMBOL || !r->count) {
+		return;
+	}
+	i = rename_index(r, e->data.symbol);
+	if (r->names[2 * i]) {
+		*slot = make_symbol(r->names[2 * i + 1]);
+		++(*slot)->refs;
+		--e->refs;
+	}
+}
+
+/* Rename the symbols defined by the module in a list, in place. Quoted
+ * data is left alone. Iterates along the list, so only nesting uses the
+ * C stack.
+ */
+static void rename_symbols(struct expr *e, struct renames *r)
+{
+	struct expr *head = e->data.pair.car;
+	if (head && head->type == T_SYMBOL
+	    && head->data.symbol == save_symbol("quote")) {
+		return;
+	}
+	for (; e && e->type == T_PAIR; e = e->data.pair.cdr) {
+		rename_slot(&e->data.pair.car, r);
+	}
+}
+
+/* Read the source of a module, namespacing its definitions. Returns the
+ * list of its expressions.
+ */
+static struct expr *read_module(const char *name, const char *path)
+{
+	char *text = read_file(path);
+	const char *p = text;
+	struct expr *forms = NULL;
+	struct expr **tail = &forms;
+	struct expr *e;
+	struct renames renames = {NULL, 0, 0};
+	if (!text) {
+		fprintf(stderr, "Can not read module %s!\n", path);
+		thread.error = ERR_USER;
+		return NULL;
+	}
+	while (*(p = skip_spaces(p))) {
+		const char *def;
+		e = read_expr(p, &p);
+		if (thread.error != ERR_NONE) {
+			break;
+		}
+		*tail = make_pair(e, NULL);
+		if (tail != &forms) {
+			++(*tail)->refs;
+		}
+		tail = &(*tail)->data.pair.cdr;
+		def = defined_name(e);
+		if (def) {
+			/* as long as the reader allows */
+			char renamed[SYMBOL_MAXLEN];
+			size_t name_len = strlen(name);
+			size_t def_len = strlen(def);
+			if (name_len + def_len + 1 >= SYMBOL_MAXLEN) {
+				fprintf(stderr, "Name too long: %s/%s!\n", name, def);
+				thread.error = ERR_USER;
+				break;
+			}
+			memcpy(renamed, name, name_len);
+			renamed[name_len] = '/';
+			memcpy(renamed + name_len + 1, def, def_len + 1);
+			add_rename(&renames, def, save_symbol(renamed));
+		}
+	}
+	free(text);
+	if (thread.error == ERR_NONE) {
+		for (e = forms; e; e = e->data.pair.cdr) {
+			rename_slot(&e->data.pair.car, &renames);
+		}
+	}
+	free(renames.names);
+	return forms;
+}
+
+/* Load a module unless it has been loaded already.
+ */
+static void require_module(const char *name)
+{
+	struct module *m = find_module(name);
+	char path[MODULE_PATH_MAXLEN];
+	char cache[MODULE_PATH_MAXLEN + 1];
+	struct stat st;
+	struct expr *forms;
+	if (m->loaded) {
+		return;
+	}
+	if (find_source(name, path, &st)) {
+		fprintf(stderr, "Module not found: %s!\n", name);
+		thread.error = ERR_USER;
+		return;
+	}
+	sprintf(cache, "%sc", path);
+	forms = read_cache(cache, &st);
+	if (!forms) {
+		forms = read_module(name, path);
+		if (thread.error != ERR_NONE) {
+			return;
+		}
+		write_cache(cache, &st, forms);
+	}
+	/* mark it first, so that a cyclic require does nothing */
+	m->loaded = 1;
+	for (; forms; forms = forms->data.pair.cdr) {
+		eval_expr(forms->data.pair.car);
+		if (thread.error != ERR_NONE) {
+			fprintf(stderr, "Failed to load module %s!\n", name);
+			m->loaded = 0;
+			return;
+		}
+	}
+}
+
+struct expr *bi_require(unsigned int argc, struct expr **argv)
+{
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_SYMBOL)) {
+		return NULL;
+	}
+	require_module(argv[0]->data.symbol);
+	return NULL;
+}
@@ -0,0 +1,184 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "lisp.h"
+
+/* Hardware and software event counts around an evaluation, read with the
+ * Linux perf_event_open system call.
+ *
+ * The counters of a thread are opened the first time it measures an
+ * evaluation and are then kept, so that a measurement only costs a few
+ * system calls. They only count the thread itself in user space, which
+ * is allowed without privileges. Events that the processor or the
+ * kernel does not provide, e.g. hardware events in most virtual
+ * machines, are left out of the report. When counters are multiplexed,
+ * counts are scaled by the share of the time they were running.
+ */
+
+enum perf_event {
+	PE_CYCLES,
+	PE_INSTRUCTIONS,
+	PE_L1D_MISSES,
+	PE_LLC_MISSES,
+	PE_BRANCHES,
+	PE_BRANCH_MISSES,
+	PE_PAGE_FAULTS
+};
+
+static const struct {
+	const char *name;
+	unsigned int type;
+	unsigned long config;
+} EVENTS[PERF_EVENTS] = {
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{"L1D misses", PERF_TYPE_HW_CACHE,
+	 PERF_COUNT_HW_CACHE_L1D
+	 | PERF_COUNT_HW_CACHE_OP_READ << 8
+	 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+	{"LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+	{"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	{"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}
+};
+
+/* Counters of the current thread, -1 if unavailable. */
+static __thread int fds[PERF_EVENTS];
+static __thread int opened;
+/* why the first unavailable counter could not be opened */
+static __thread int open_errno;
+
+/* The value read from a counter, with read_format set as below. */
+struct reading {
+	__u64 value;
+	__u64 enabled;
+	__u64 running;
+};
+
+static void open_counters(void)
+{
+	int i;
+	opened = 1;
+	for (i = 0; i < PERF_EVENTS; ++i) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof attr);
+		attr.size = sizeof attr;
+		attr.type = EVENTS[i].type;
+		attr.config = EVENTS[i].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+			| PERF_FORMAT_TOTAL_TIME_RUNNING;
+		fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fds[i] < 0 && !open_errno) {
+			open_errno = errno;
+		}
+	}
+}
+
+/* Read a counter, scaled to the time it was enabled.
+ */
+static double read_counter(int fd)
+{
+	struct reading r;
+	if (read(fd, &r, sizeof r) != sizeof r) {
+		return 0;
+	}
+	if (r.running == 0) {
+		return 0;
+	}
+	return (double) r.value * r.enabled / r.running;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Start measuring the current thread.
+ */
+void perf_begin(struct perf_counts *c)
+{
+	int i;
+	if (!opened) {
+		open_counters();
+	}
+	for (i = 0; i < PERF_EVENTS; ++i) {
+		c->counts[i] = fds[i] >= 0 ? read_counter(fds[i]) : -1;
+	}
+	c->calls = thread.calls;
+	c->seconds = now();
+}
+
+/* Stop measuring, leaving the differences since perf_begin in c.
+ */
+void perf_end(struct perf_counts *c)
+{
+	int i;
+	c->seconds = now() - c->seconds;
+	c->calls = thread.calls - c->calls;
+	for (i = 0; i < PERF_EVENTS; ++i) {
+		if (fds[i] >= 0) {
+			c->counts[i] = read_counter(fds[i]) - c->counts[i];
+		}
+	}
+}
+
+/* Print a measurement, with the instructions per cycle and the misses
+ * per call of a function.
+ */
+void perf_print(struct perf_counts *c, FILE *f)
+{
+	const double *n = c->counts;
+	double calls = c->calls ? c->calls : 1;
+	int i;
+	fprintf(f, "perf: %.6f s, %lu calls\n", c->seconds, c->calls);
+	if (n[PE_CYCLES] >= 0 && n[PE_INSTRUCTIONS] >= 0) {
+		fprintf(f, "  %.0f cycles, %.0f instructions, %.2f IPC\n",
+			n[PE_CYCLES], n[PE_INSTRUCTIONS],
+			n[PE_CYCLES] > 0 ? n[PE_INSTRUCTIONS] / n[PE_CYCLES] : 0);
+	}
+	for (i = PE_L1D_MISSES; i < PERF_EVENTS; ++i) {
+		if (i == PE_BRANCHES || n[i] < 0) {
+			continue;
+		}
+		fprintf(f, "  %.0f %s, %.2f per call", n[i], EVENTS[i].name, n[i] / calls);
+		if (i == PE_BRANCH_MISSES && n[PE_BRANCHES] > 0) {
+			fprintf(f, ", %.2f%% of branches",
+				100 * n[i] / n[PE_BRANCHES]);
+		}
+		putc('\n', f);
+	}
+	if (open_errno) {
+		fprintf(f, "  some counters are unavailable: %s\n",
+			strerror(open_errno));
+	}
+}
+
+/* Evaluate an expression, printing its event counts to the standard
+ * error.
+ */
+struct expr *bi_perf_stat(unsigned int argc, struct expr **argv)
+{
+	struct perf_counts c;
+	struct expr *value;
+	if (check_arg_count(argc, 1)) {
+		return NULL;
+	}
+	perf_begin(&c);
+	value = eval_expr(argv[0]);
+	perf_end(&c);
+	perf_print(&c, stderr);
+	return value;
+}
@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lisp.h"
+
+/* Generates prelude.c, which holds the prelude as static data.
+ *
+ * Runs create_prelude, then writes the symbol table, every expression
+ * reachable from the variables and the tree of variables as initialized
+ * arrays, with pointers between them as addresses of array elements, so
+ * that load_prelude only has to point the globals at them. Symbol names
+ * are constant. The rest may change at run time, e.g. when a variable is
+ * redefined, a symbol is saved or a lambda is compiled, so it lives in
+ * writable data.
+ */
+
+static struct expr **exprs;
+static size_t exprs_count;
+static size_t exprs_size;
+
+static struct variable **variables;
+static size_t variables_count;
+static size_t variables_size;
+
+static const char **names;
+static size_t names_count;
+
+/* The prelude is created at run time here, where it is generated.
+ */
+void load_prelude(void)
+{
+	globals.symbols = make_symbol_table(256);
+	globals.symbols_count = 0;
+	create_prelude();
+}
+
+static void *grow(void *array, size_t *size, size_t count, size_t elem)
+{
+	if (count == *size) {
+		*size = *size ? 2 * *size : 256;
+		array = realloc(array, *size * elem);
+		if (!array) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return array;
+}
+
+static size_t name_index(const char *symbol)
+{
+	size_t i;
+	for (i = 0; i < names_count; ++i) {
+		if (names[i] == symbol) {
+			return i;
+		}
+	}
+	fprintf(stderr, "Symbol %s is not saved!\n", symbol);
+	exit(EXIT_FAILURE);
+}
+
+static size_t expr_index(struct expr *e)
+{
+	size_t i;
+	for (i = 0; i < exprs_count; ++i) {
+		if (exprs[i] == e) {
+			return i;
+		}
+	}
+	fprintf(stderr, "Expression was not collected!\n");
+	exit(EXIT_FAILURE);
+}
+
+static size_t variable_index(struct variable *v)
+{
+	size_t i;
+	for (i = 0; i < variables_count; ++i) {
+		if (variables[i] == v) {
+			return i;
+		}
+	}
+	fprintf(stderr, "Variable was not collected!\n");
+	exit(EXIT_FAILURE);
+}
+
+/* Collect an expression and the expressions it refers to.
+ */
+static void collect_expr(struct expr *e)
+{
+	size_t i;
+	if (!e) {
+		return;
+	}
+	for (i = 0; i < exprs_count; ++i) {
+		if (exprs[i] == e) {
+			return;
+		}
+	}
+	exprs = grow(exprs, &exprs_size, exprs_count, sizeof *exprs);
+	exprs[exprs_count++] = e;
+	switch (e->type) {
+	case T_SYMBOL:
+	case T_NUMBER:
+	case T_BUILTIN:
+		break;
+	case T_PAIR:
+		collect_expr(e->data.pair.car);
+		collect_expr(e->data.pair.cdr);
+		break;
+	case T_LAMBDA:
+		collect_expr(e->data.lambda.params);
+		collect_expr(e->data.lambda.body);
+		break;
+	default:
+		fprintf(stderr, "Can not write expressions of type %d!\n", e->type);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void collect_variables(struct variable *v)
+{
+	if (!v) {
+		return;
+	}
+	variables = grow(variables, &variables_size, variables_count,
+			 sizeof *variables);
+	variables[variables_count++] = v;
+	collect_expr(v->value);
+	collect_variables(v->left);
+	collect_variables(v->right);
+}
+
+/* The C name of the function of a builtin. */
+static const char *c_name(struct builtin *b)
+{
+	size_t i;
+	for (i = 0; i < BUILTIN_DEFS_COUNT; ++i) {
+		if (BUILTIN_DEFS[i].func == b->func) {
+			return BUILTIN_DEFS[i].c_name;
+		}
+	}
+	if (PORT_STREAM_DEF.func == b->func) {
+		return PORT_STREAM_DEF.c_name;
+	}
+	fprintf(stderr, "Builtin %s is not in BUILTIN_DEFS!\n", b->name);
+	exit(EXIT_FAILURE);
+}
+
+static void print_name(const char *symbol)
+{
+	if (symbol) {
+		printf("names[%lu]", (unsigned long) name_index(symbol));
+	} else {
+		printf("NULL");
+	}
+}
+
+static void print_expr_ref(struct expr *e)
+{
+	if (e) {
+		printf("&exprs[%lu]", (unsigned long) expr_index(e));
+	} else {
+		printf("NULL");
+	}
+}
+
+static void print_variable_ref(struct variable *v)
+{
+	if (v) {
+		printf("&variables[%lu]", (unsigned long) variable_index(v));
+	} else {
+		printf("NULL");
+	}
+}
+
+/* Write an expression as an initializer. Members are designated, so
+ * that the output does not depend on their order, and the ones not
+ * written are zero. Enumerations are written as numbers, since prelude.c
+ * is generated again whenever lisp.h changes.
+ */
+static void write_expr(struct expr *e)
+{
+	printf("\t{.type = %d, .data = {", (int) e->type);
+	switch (e->type) {
+	case T_SYMBOL:
+		printf(".symbol = ");
+		print_name(e->data.symbol);
+		break;
+	case T_NUMBER:
+		printf(".number = %.17g", e->data.number);
+		break;
+	case T_PAIR:
+		printf(".pair = {.car = ");
+		print_expr_ref(e->data.pair.car);
+		printf(", .cdr = ");
+		print_expr_ref(e->data.pair.cdr);
+		printf("}");
+		break;
+	case T_BUILTIN:
+		printf(".builtin = {.func = %s, .spec_form = %d, .name = ",
+		       c_name(&e->data.builtin),
+		       (int) e->data.builtin.spec_form);
+		print_name(e->data.builtin.name);
+		printf("}");
+		break;
+	case T_LAMBDA:
+		printf(".lambda = {.params = ");
+		print_expr_ref(e->data.lambda.params);
+		printf(", .body = ");
+		print_expr_ref(e->data.lambda.body);
+		printf(", .name = ");
+		print_name(e->data.lambda.name);
+		printf("}");
+		break;
+	default:
+		break;
+	}
+	printf("}, .refs = %u}", e->refs);
+}
+
+int main(void)
+{
+	struct symbol_table *table;
+	size_t i;
+	init_globals();
+	table = globals.symbols;
+	names = malloc(table->size * sizeof *names);
+	for (i = 0; i < table->size; ++i) {
+		if (table->slots[i]) {
+			names[names_count++] = table->slots[i];
+		}
+	}
+	collect_expr(globals.TRUE);
+	collect_expr(globals.FALSE);
+	collect_expr(globals.PORT_STREAM);
+	collect_variables(globals.variables);
+
+	printf("/* Generated by preludegen from create_prelude, do not edit. */\n\n");
+	printf("#include \"lisp.h\"\n\n");
+	printf("static const char names[%lu][SYMBOL_MAXLEN + 1] = {\n",
+	       (unsigned long) names_count);
+	for (i = 0; i < names_count; ++i) {
+		const char *c;
+		printf("\t\"");
+		for (c = names[i]; *c; ++c) {
+			if (*c == '"' || *c == '\\') {
+				putchar('\\');
+			}
+			putchar(*c);
+		}
+		printf(i + 1 < names_count ? "\",\n" : "\"\n");
+	}
+	printf("};\n\n");
+
+	printf("static const char *slots[%lu] = {\n", (unsigned long) table->size);
+	for (i = 0; i < table->size; ++i) {
+		putchar('\t');
+		print_name(table->slots[i]);
+		printf(i + 1 < table->size ? ",\n" : "\n");
+	}
+	printf("};\n\n");
+	printf("static struct symbol_table symbols = {slots, %lu, NULL};\n\n",
+	       (unsigned long) table->size);
+
+	/* designated initializers are not C89 */
+	printf("__extension__ static struct expr exprs[%lu] = {\n",
+	       (unsigned long) exprs_count);
+	for (i = 0; i < exprs_count; ++i) {
+		write_expr(exprs[i]);
+		printf(i + 1 < exprs_count ? ",\n" : "\n");
+	}
+	printf("};\n\n");
+
+	printf("__extension__ static struct variable variables[%lu] = {\n",
+	       (unsigned long) variables_count);
+	for (i = 0; i < variables_count; ++i) {
+		struct variable *v = variables[i];
+		printf("\t{.symbol = ");
+		print_name(v->symbol);
+		printf(", .value = ");
+		print_expr_ref(v->value);
+		printf(", .left = ");
+		print_variable_ref(v->left);
+		printf(", .right = ");
+		print_variable_ref(v->right);
+		printf(i + 1 < variables_count ? "},\n" : "}\n");
+	}
+	printf("};\n\n");
+
+	printf("void load_prelude(void)\n{\n");
+	printf("\tglobals.symbols = &symbols;\n");
+	printf("\tglobals.symbols_count = %lu;\n", (unsigned long) names_count);
+	printf("\tglobals.variables = &variables[0];\n");
+	printf("\tglobals.TRUE = ");
+	print_expr_ref(globals.TRUE);
+	printf(";\n\tglobals.FALSE = ");
+	print_expr_ref(globals.FALSE);
+	printf(";\n\tglobals.PORT_STREAM = ");
+	print_expr_ref(globals.PORT_STREAM);
+	printf(";\n\tglobals.MAP = ");
+	print_expr_ref(globals.MAP);
+	printf(";\n\tglobals.FILTER = ");
+	print_expr_ref(globals.FILTER);
+	printf(";\n\tglobals.FOLD = ");
+	print_expr_ref(globals.FOLD);
+	printf(";\n\tglobals.LENGTH = ");
+	print_expr_ref(globals.LENGTH);
+	printf(";\n}\n");
+	return 0;
+}
@@ -0,0 +1,211 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "lisp.h"
+
+/* A sampling profiler of Lisp functions.
+ *
+ * While profiling, the evaluator keeps an F_TRACE frame for every lambda
+ * being called, as when tracing, and a SIGPROF timer interrupts the
+ * process at a rate of processor time. The signal handler walks the
+ * frames of the interrupted thread and stores the names of the lambdas,
+ * innermost first, in a preallocated buffer, without locking or
+ * allocating. Samples that do not fit are dropped and counted.
+ *
+ * The samples are written in the folded stack format of flamegraph.pl,
+ * which speedscope also reads: one line per distinct stack, with the
+ * names from the outermost call separated by semicolons, followed by the
+ * number of samples.
+ *
+ * Calls inside compiled code, see jit.c, are not seen: a compiled lambda
+ * appears as a single frame, whatever it calls.
+ */
+
+/* frames kept of each sample, from the innermost */
+#define PROFILE_DEPTH 256
+
+/* names stored for all samples, each sample ended by a null */
+static const char **samples;
+static size_t samples_capacity;
+/* names reserved by samples, which may be past the capacity */
+static size_t samples_used;
+/* the end of the last sample that was written completely */
+static size_t samples_end;
+static unsigned long samples_dropped;
+static struct sigaction old_action;
+
+/* The name of a lambda on the evaluation stack. The frame may be written
+ * while it is read, so the type is checked.
+ */
+static const char *frame_name(struct frame *fr)
+{
+	struct expr *lambda = fr->a;
+	if (!lambda || lambda->type != T_LAMBDA) {
+		return NULL;
+	}
+	return lambda->data.lambda.name ? lambda->data.lambda.name : "lambda";
+}
+
+static void take_sample(int sig)
+{
+	const char *stack[PROFILE_DEPTH];
+	size_t depth = 0;
+	size_t i;
+	size_t pos;
+	size_t end;
+	(void) sig;
+	if (!thread.frames_moving) {
+		struct frame *frames = thread.frames;
+		for (i = thread.frames_count; i > 0 && depth < PROFILE_DEPTH; --i) {
+			if (frames[i - 1].type == F_TRACE
+			    && (stack[depth] = frame_name(&frames[i - 1]))) {
+				++depth;
+			}
+		}
+	}
+	if (depth == 0) {
+		/* evaluating outside of any lambda, or a thread that does
+		   not evaluate */
+		stack[depth++] = "[toplevel]";
+	}
+	/* threads may take samples at the same time */
+	pos = __atomic_fetch_add(&samples_used, depth + 1, __ATOMIC_RELAXED);
+	if (pos + depth + 1 > samples_capacity) {
+		__atomic_fetch_add(&samples_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	for (i = 0; i < depth; ++i) {
+		samples[pos + i] = stack[i];
+	}
+	samples[pos + depth] = NULL;
+	/* samples are reserved in order, so once one does not fit no
+	   later one does, and the names up to the furthest end are written */
+	end = __atomic_load_n(&samples_end, __ATOMIC_RELAXED);
+	while (end < pos + depth + 1
+	       && !__atomic_compare_exchange_n(&samples_end, &end,
+					       pos + depth + 1, 0,
+					       __ATOMIC_RELEASE,
+					       __ATOMIC_RELAXED)) {
+		;
+	}
+}
+
+/* Start taking samples at the given rate per second of processor time,
+ * keeping at most capacity names, see PROFILE_BUFFER. Returns non-zero if
+ * the buffer can not be allocated or the timer can not be set.
+ */
+int profile_start(unsigned int rate, size_t capacity)
+{
+	struct sigaction action;
+	struct itimerval timer;
+	if (samples_capacity != capacity) {
+		free(samples);
+		samples = malloc(capacity * sizeof *samples);
+		samples_capacity = samples ? capacity : 0;
+		if (!samples) {
+			return 1;
+		}
+	}
+	samples_used = 0;
+	samples_end = 0;
+	samples_dropped = 0;
+	globals.profile = 1;
+	memset(&action, 0, sizeof action);
+	action.sa_handler = take_sample;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, &old_action)) {
+		globals.profile = 0;
+		return 1;
+	}
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = rate > 1 ? 1000000 / rate : 999999;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL)) {
+		sigaction(SIGPROF, &old_action, NULL);
+		globals.profile = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* Compare samples by their stacks, for sorting pointers to their first
+ * names.
+ */
+static int compare_samples(const void *a, const void *b)
+{
+	const char **x = *(const char ***) a;
+	const char **y = *(const char ***) b;
+	for (; *x && *y; ++x, ++y) {
+		int c = strcmp(*x, *y);
+		if (c) {
+			return c;
+		}
+	}
+	return (*x != NULL) - (*y != NULL);
+}
+
+static void write_stack(FILE *f, const char **sample)
+{
+	size_t depth = 0;
+	while (sample[depth]) {
+		++depth;
+	}
+	while (depth-- > 0) {
+		fputs(sample[depth], f);
+		if (depth) {
+			putc(';', f);
+		}
+	}
+}
+
+/* Stop taking samples, and write them to a file in the folded stack
+ * format. Returns non-zero if it can not be written.
+ */
+int profile_stop(const char *path)
+{
+	struct itimerval timer;
+	const char ***sorted;
+	size_t used;
+	size_t count = 0;
+	size_t i;
+	FILE *f;
+	memset(&timer, 0, sizeof timer);
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &old_action, NULL);
+	globals.profile = 0;
+	used = __atomic_load_n(&samples_end, __ATOMIC_ACQUIRE);
+	sorted = malloc((used + 1) * sizeof *sorted);
+	for (i = 0; i < used; ++i) {
+		sorted[count++] = &samples[i];
+		while (samples[i]) {
+			++i;
+		}
+	}
+	qsort(sorted, count, sizeof *sorted, compare_samples);
+	f = fopen(path, "w");
+	if (!f) {
+		free(sorted);
+		return 1;
+	}
+	for (i = 0; i < count; ) {
+		size_t j = i + 1;
+		while (j < count && !compare_samples(&sorted[i], &sorted[j])) {
+			++j;
+		}
+		write_stack(f, sorted[i]);
+		fprintf(f, " %lu\n", (unsigned long) (j - i));
+		i = j;
+	}
+	free(sorted);
+	if (samples_dropped) {
+		fprintf(stderr, "Profile buffer full, %lu samples dropped\n",
+			samples_dropped);
+	}
+	return fclose(f) != 0;
+}
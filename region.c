@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "lisp.h"
+
+/* Region allocation of the expressions of one top-level evaluation.
+ *
+ * Between region_begin and region_end, the current thread allocates
+ * expressions, and the data of strings, by bumping a pointer through the
+ * blocks of its region. At the end, the result is promoted, i.e. copied
+ * to the heap along with everything it refers to in the region, and the
+ * region is reset by moving the pointer back to its first block, so the
+ * memory of an evaluation is reused by the next one.
+ *
+ * This requires that nothing outside the region refers into it once it
+ * ends. Values stored in the heap during the evaluation are promoted
+ * when they are stored, e.g. by set_variable, when forcing a promise
+ * from the heap, memoizing or starting a future. Expressions that hold
+ * other resources or are shared between threads, i.e. continuations,
+ * ports, futures, generators and memoized functions, are allocated on
+ * the heap. Continuations and generators are changed while they are
+ * used, so those created or suspended during the evaluation are instead
+ * kept as dirty, and their contents are promoted at the end. A promoted
+ * expression is a copy, so code that keeps using the original after
+ * storing it, e.g. comparing it with eq, sees a different value.
+ */
+
+/* size of the data of a block, unless a single allocation is larger */
+#define REGION_BLOCK (64 * 1024)
+
+/* Allocate a block of at least size bytes, after the given one. */
+static struct region_block *new_block(struct region_block *after, size_t size)
+{
+	struct region_block *b;
+	if (size < REGION_BLOCK) {
+		size = REGION_BLOCK;
+	}
+	b = malloc(sizeof *b + size);
+	assert(b);
+	b->size = size;
+	if (after) {
+		b->next = after->next;
+		after->next = b;
+	} else {
+		b->next = NULL;
+	}
+	return b;
+}
+
+/* The data of a block, which follows it. */
+static char *block_data(struct region_block *b)
+{
+	return (char *) (b + 1);
+}
+
+/* Start allocating in the region of the current thread, if regions are
+ * used, see globals.regions.
+ */
+void region_begin(void)
+{
+	struct region *r = thread.region;
+	if (!globals.regions) {
+		return;
+	}
+	if (!r) {
+		r = calloc(1, sizeof *r);
+		assert(r);
+		r->first = new_block(NULL, REGION_BLOCK);
+		r->block = r->first;
+		r->next = block_data(r->first);
+		r->end = r->next + r->first->size;
+		thread.region = r;
+	}
+	r->active = 1;
+}
+
+/* Take size bytes from the region. */
+static void *bump(struct region *r, size_t size)
+{
+	char *p;
+	/* keep expressions aligned for doubles and pointers */
+	size = (size + sizeof (double) - 1) / sizeof (double) * sizeof (double);
+	while ((size_t) (r->end - r->next) < size) {
+		if (!r->block->next || r->block->next->size < size) {
+			new_block(r->block, size);
+		}
+		r->block = r->block->next;
+		r->next = block_data(r->block);
+		r->end = r->next + r->block->size;
+	}
+	p = r->next;
+	r->next += size;
+	return p;
+}
+
+/* Allocate bytes in the active region of the current thread, which the
+ * caller charges to the heap.
+ */
+void *region_alloc(size_t size)
+{
+	thread.region->bytes += size;
+	return bump(thread.region, size);
+}
+
+/* The address of the copy of a promoted expression, which is kept before
+ * it, so that the expression is left intact for the evaluation.
+ */
+static struct expr **forward(struct expr *e)
+{
+	return (struct expr **) e - 1;
+}
+
+/* Allocate an expression in the active region of the current thread,
+ * which the caller charges to the heap.
+ */
+struct expr *region_expr(void)
+{
+	struct expr **p = bump(thread.region, sizeof *p + sizeof **p);
+	struct expr *e = (struct expr *) (p + 1);
+	thread.region->bytes += sizeof *e;
+	*p = NULL;
+	e->placement = PL_REGION;
+	return e;
+}
+
+/* Stop allocating in the region, returning whether it was active, for
+ * region_resume.
+ */
+int region_pause(void)
+{
+	int active = thread.region && thread.region->active;
+	if (active) {
+		thread.region->active = 0;
+	}
+	return active;
+}
+
+void region_resume(int active)
+{
+	if (active) {
+		thread.region->active = 1;
+	}
+}
+
+/* Add an expression to a growable array of the region. */
+static void add_expr(struct expr ***array, size_t *count, size_t *size,
+		     struct expr *e)
+{
+	if (*count == *size) {
+		*size = *size ? 2 * *size : 64;
+		*array = realloc(*array, *size * sizeof **array);
+		assert(*array);
+	}
+	(*array)[(*count)++] = e;
+}
+
+/* Keep an expression on the heap, whose contents may refer into the
+ * active region, to be promoted when the region ends.
+ */
+void region_dirty(struct expr *e)
+{
+	struct region *r = thread.region;
+	if (r && r->active && e->placement == PL_HEAP) {
+		e->placement = PL_DIRTY;
+		add_expr(&r->dirty, &r->dirty_count, &r->dirty_size, e);
+	}
+}
+
+/* Keep a lambda in the region which has been compiled, so that its code
+ * is freed when the region ends, unless its copy uses it.
+ */
+void region_compiled(struct expr *lambda)
+{
+	struct region *r = thread.region;
+	if (r && (lambda->placement == PL_REGION
+		  || lambda->placement == PL_MOVED)) {
+		add_expr(&r->compiled, &r->compiled_count, &r->compiled_size,
+			 lambda);
+	}
+}
+
+static struct expr *copy_out(struct expr *e);
+
+/* Promote the contents of a dirty expression in place. */
+static void promote_contents(struct expr *e)
+{
+	size_t i;
+	e->placement = PL_FIXING;
+	switch (e->type) {
+	case T_CONTINUATION:
+		for (i = 0; i < e->data.continuation.count; ++i) {
+			struct frame *fr = &e->data.continuation.frames[i];
+			fr->a = promote(fr->a);
+			fr->b = promote(fr->b);
+		}
+		for (i = 0; i < e->data.continuation.values_count; ++i) {
+			e->data.continuation.values[i] =
+				promote(e->data.continuation.values[i]);
+		}
+		break;
+	case T_GENERATOR:
+		e->data.generator.function = promote(e->data.generator.function);
+		for (i = 0; i < e->data.generator.count; ++i) {
+			struct frame *fr = &e->data.generator.frames[i];
+			fr->a = promote(fr->a);
+			fr->b = promote(fr->b);
+		}
+		for (i = 0; i < e->data.generator.values_count; ++i) {
+			e->data.generator.values[i] =
+				promote(e->data.generator.values[i]);
+		}
+		break;
+	default:
+		break;
+	}
+	e->placement = PL_DIRTY;
+}
+
+/* Return an expression that is not in the region of the current thread,
+ * copying it and what it refers to if needed.
+ */
+struct expr *promote(struct expr *e)
+{
+	int active;
+	if (!e || e->placement == PL_HEAP || e->placement == PL_FIXING) {
+		return e;
+	} else if (e->placement == PL_MOVED) {
+		return *forward(e);
+	} else if (e->placement == PL_DIRTY) {
+		/* promoted again when the region ends, since it may still
+		   change */
+		promote_contents(e);
+		return e;
+	}
+	active = region_pause();
+	e = copy_out(e);
+	region_resume(active);
+	return e;
+}
+
+/* Copy an expression in the region to the heap, keeping the address of
+ * the copy with the original. Iterates along lists, so only nesting uses
+ * the C stack.
+ */
+static struct expr *copy_out(struct expr *e)
+{
+	struct expr *copy = NULL;
+	struct expr **tail = &copy;
+	while (e && e->placement == PL_REGION && e->type == T_PAIR) {
+		struct expr *car = e->data.pair.car;
+		struct expr *cdr = e->data.pair.cdr;
+		struct expr *pair = new_expr(T_PAIR);
+		pair->data.pair.car = NULL;
+		pair->data.pair.cdr = NULL;
+		e->placement = PL_MOVED;
+		*forward(e) = pair;
+		*tail = pair;
+		if (tail != &copy) {
+			++pair->refs;
+		}
+		pair->data.pair.car = promote(car);
+		if (pair->data.pair.car) {
+			++pair->data.pair.car->refs;
+		}
+		tail = &pair->data.pair.cdr;
+		e = cdr;
+	}
+	if (e && e->placement == PL_REGION) {
+		struct expr *moved;
+		if (e->type == T_STRING) {
+			/* with its data, charged to the heap */
+			moved = make_string(e->data.string.data,
+					    e->data.string.len);
+		} else {
+			moved = new_expr(e->type);
+			moved->data = e->data;
+		}
+		e->placement = PL_MOVED;
+		*forward(e) = moved;
+		switch (moved->type) {
+		case T_LAMBDA:
+			moved->data.lambda.params = promote(moved->data.lambda.params);
+			moved->data.lambda.body = promote(moved->data.lambda.body);
+			break;
+		case T_PROMISE:
+			moved->data.promise.expr = promote(moved->data.promise.expr);
+			moved->data.promise.value = promote(moved->data.promise.value);
+			break;
+		default:
+			break;
+		}
+		e = moved;
+	} else {
+		e = promote(e);
+	}
+	*tail = e;
+	if (e && tail != &copy) {
+		++e->refs;
+	}
+	return copy;
+}
+
+/* Promote the result of the evaluation and the dirty expressions, and
+ * reset the region of the current thread. Returns the promoted result.
+ */
+struct expr *region_end(struct expr *result)
+{
+	struct region *r = thread.region;
+	size_t i;
+	if (!r || !r->active) {
+		return result;
+	}
+	r->active = 0;
+	result = promote(result);
+	for (i = 0; i < r->dirty_count; ++i) {
+		promote_contents(r->dirty[i]);
+		r->dirty[i]->placement = PL_HEAP;
+	}
+	for (i = 0; i < r->compiled_count; ++i) {
+		struct expr *lambda = r->compiled[i];
+		if (lambda->placement == PL_REGION
+		    || (*forward(lambda))->data.lambda.jit != lambda->data.lambda.jit) {
+			jit_free(lambda->data.lambda.jit);
+		}
+	}
+	r->dirty_count = 0;
+	r->compiled_count = 0;
+	thread.heap -= r->bytes;
+	r->bytes = 0;
+	r->block = r->first;
+	r->next = block_data(r->first);
+	r->end = r->next + r->first->size;
+	return result;
+}
@@ -0,0 +1,374 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lisp.h"
+
+/* A server evaluating expressions sent over a socket.
+ *
+ * Every request is a single expression on one line, and the response is
+ * its printed value on one line, or a line starting with "error: ". A
+ * client can send any number of requests on a connection, without
+ * waiting for the responses, which are sent in order.
+ *
+ * The interpreter state is global, so instead of threads the server
+ * forks worker processes after initializing the interpreter. Each worker
+ * has its own copy of the environment and accepts connections on the
+ * shared listening socket in its own epoll loop.
+ */
+
+#define SERVER_EVENTS 64
+#define SERVER_READ_SIZE 4096
+/* longest request line kept, longer ones are answered with a parse error */
+#define SERVER_LINE_MAXLEN (1 << 20)
+
+/* Names of enum error, for responses. */
+static const char *ERROR_NAMES[] = {
+	"none",
+	"parse",
+	"user",
+	"fuel",
+	"memory",
+	"depth"
+};
+
+/* A client connection, with the unread part of its requests and the
+ * unsent part of its responses.
+ */
+struct client {
+	int fd;
+	struct buffer in;
+	struct buffer out;
+	size_t out_sent;
+	/* whether the client is waiting to be writable */
+	int writing;
+	/* whether the rest of a too long line is being dropped */
+	int skipping;
+};
+
+static int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Create the listening socket, on a unix socket path if port is 0 and
+ * otherwise on the TCP port of the loopback address.
+ */
+static int listen_socket(const char *path, int port)
+{
+	int fd;
+	if (port) {
+		struct sockaddr_in addr;
+		int one = 1;
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			perror("socket");
+			return -1;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		memset(&addr, 0, sizeof addr);
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(fd, (struct sockaddr *) &addr, sizeof addr)) {
+			perror("bind");
+			close(fd);
+			return -1;
+		}
+	} else {
+		struct sockaddr_un addr;
+		if (strlen(path) >= sizeof addr.sun_path) {
+			fprintf(stderr, "Socket path too long: %s!\n", path);
+			return -1;
+		}
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) {
+			perror("socket");
+			return -1;
+		}
+		memset(&addr, 0, sizeof addr);
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path);
+		unlink(path);
+		if (bind(fd, (struct sockaddr *) &addr, sizeof addr)) {
+			perror("bind");
+			close(fd);
+			return -1;
+		}
+	}
+	if (listen(fd, SOMAXCONN) || set_nonblocking(fd)) {
+		perror("listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Evaluate one request line, appending the response to out.
+ */
+static void handle_request(char *line, struct buffer *out)
+{
+	const char *endptr;
+	struct expr *e;
+	struct expr *value = NULL;
+	thread.error = ERR_NONE;
+	region_begin();
+	e = read_expr(line, &endptr);
+	if (thread.error == ERR_NONE && *skip_spaces(endptr)) {
+		thread.error = ERR_PARSE;
+	}
+	if (thread.error == ERR_NONE) {
+		value = eval_expr(e);
+	}
+	if (thread.error != ERR_NONE) {
+		buffer_puts(out, "error: ");
+		buffer_puts(out, ERROR_NAMES[thread.error]);
+		thread.error = ERR_NONE;
+	} else {
+		print_buffer(value, out);
+	}
+	buffer_putc(out, '\n');
+	region_end(NULL);
+}
+
+/* Evaluate all complete request lines of the client, keeping a partial
+ * last line for later. A line longer than SERVER_LINE_MAXLEN is answered
+ * with a parse error when the limit is passed, and dropped up to its end.
+ */
+static void handle_requests(struct client *c)
+{
+	char *start = c->in.data;
+	char *end = c->in.data + c->in.len;
+	char *newline;
+	while ((newline = memchr(start, '\n', end - start))) {
+		*newline = '\0';
+		if (c->skipping) {
+			c->skipping = 0;
+		} else if (*skip_spaces(start)) {
+			handle_request(start, &c->out);
+		}
+		start = newline + 1;
+	}
+	if (c->skipping || end - start > SERVER_LINE_MAXLEN) {
+		if (!c->skipping) {
+			buffer_puts(&c->out, "error: ");
+			buffer_puts(&c->out, ERROR_NAMES[ERR_PARSE]);
+			buffer_putc(&c->out, '\n');
+			c->skipping = 1;
+		}
+		start = end;
+	}
+	c->in.len = end - start;
+	memmove(c->in.data, start, c->in.len);
+	c->in.data[c->in.len] = '\0';
+}
+
+/* Send as much of the pending responses as the socket accepts. Returns
+ * non-zero if the connection failed.
+ */
+static int flush_client(struct client *c)
+{
+	while (c->out_sent < c->out.len) {
+		ssize_t n = write(c->fd,
+				  c->out.data + c->out_sent,
+				  c->out.len - c->out_sent);
+		if (n < 0) {
+			return errno != EAGAIN && errno != EWOULDBLOCK;
+		}
+		c->out_sent += n;
+	}
+	c->out.len = 0;
+	c->out_sent = 0;
+	return 0;
+}
+
+static void close_client(struct client *c)
+{
+	close(c->fd);
+	free(c->in.data);
+	free(c->out.data);
+	free(c);
+}
+
+/* Read from a readable client and answer its requests. Returns non-zero
+ * if the connection was closed.
+ */
+static int read_client(struct client *c)
+{
+	while (1) {
+		ssize_t n;
+		buffer_reserve(&c->in, SERVER_READ_SIZE);
+		n = read(c->fd, c->in.data + c->in.len, SERVER_READ_SIZE);
+		if (n == 0) {
+			return 1;
+		} else if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return 1;
+		}
+		c->in.len += n;
+		c->in.data[c->in.len] = '\0';
+		handle_requests(c);
+		if (flush_client(c)) {
+			return 1;
+		}
+	}
+}
+
+/* Accept a pending connection on the listening socket. Only one is
+ * accepted at a time, so that connections arriving together are spread
+ * over the workers.
+ */
+static void accept_client(int epfd, int listen_fd)
+{
+	struct epoll_event ev;
+	struct client *c;
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		/* another worker was faster */
+		return;
+	}
+	if (set_nonblocking(fd)) {
+		close(fd);
+		return;
+	}
+	c = malloc(sizeof *c);
+	c->fd = fd;
+	c->in.data = NULL;
+	c->in.len = 0;
+	c->in.size = 0;
+	c->out.data = NULL;
+	c->out.len = 0;
+	c->out.size = 0;
+	c->out_sent = 0;
+	c->writing = 0;
+	c->skipping = 0;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		close_client(c);
+	}
+}
+
+/* Run the event loop of a worker.
+ */
+static void run_worker(int listen_fd)
+{
+	struct epoll_event events[SERVER_EVENTS];
+	struct epoll_event ev;
+	int epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	/* only wake one worker for each new connection */
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	while (1) {
+		int i;
+		int n = epoll_wait(epfd, events, SERVER_EVENTS, -1);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < n; ++i) {
+			struct client *c = events[i].data.ptr;
+			int closed = 0;
+			if (!c) {
+				accept_client(epfd, listen_fd);
+				continue;
+			}
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				closed = 1;
+			}
+			if (!closed && (events[i].events & EPOLLOUT)) {
+				closed = flush_client(c);
+			}
+			if (!closed && (events[i].events & EPOLLIN)) {
+				closed = read_client(c);
+			}
+			if (closed) {
+				close_client(c);
+				continue;
+			}
+			/* wait for the socket to be writable only while
+			   responses are pending */
+			if (c->writing != (c->out.len > 0)) {
+				c->writing = c->out.len > 0;
+				ev.events = EPOLLIN | (c->writing ? EPOLLOUT : 0);
+				ev.data.ptr = c;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+			}
+		}
+	}
+}
+
+/* Fork a worker process. Returns non-zero on failure.
+ */
+static int start_worker(int listen_fd)
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	} else if (pid == 0) {
+		run_worker(listen_fd);
+	}
+	return 0;
+}
+
+/* Serve requests on a unix socket path, or on a TCP port of the loopback
+ * address if port is non-zero, with the given number of worker
+ * processes. The interpreter must be initialized. Only returns on
+ * failure.
+ */
+int serve(const char *path, int port, int workers)
+{
+	int listen_fd = listen_socket(path, port);
+	int i;
+	pid_t pid;
+	if (listen_fd < 0) {
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < workers; ++i) {
+		if (start_worker(listen_fd)) {
+			return 1;
+		}
+	}
+	if (port) {
+		fprintf(stderr, "Serving on 127.0.0.1:%d with %d workers\n",
+			port, workers);
+	} else {
+		fprintf(stderr, "Serving on %s with %d workers\n", path, workers);
+	}
+	/* a worker exits on failure or when a client evaluates (exit),
+	   losing its connections, so keep the number of workers */
+	while ((pid = wait(NULL)) > 0) {
+		fprintf(stderr, "Worker %ld exited, starting another\n",
+			(long) pid);
+		if (start_worker(listen_fd)) {
+			return 1;
+		}
+	}
+	return 1;
+}
@@ -1,7 +1,15 @@
+#define _DEFAULT_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <utime.h>
 
 #include "lisp.h"
+#include "embed.h"
 
 /* Evaluate a string of lisp code and assert that it is true.
  */
@@ -20,6 +28,122 @@ void lisp_assert(const char *src) {
 	}
 }
 
+/* Evaluate a string of lisp code, ignoring the result.
+ */
+void lisp_run(const char *src) {
+	const char *endptr;
+	struct expr *expr = read_expr(src, &endptr);
+	if (*endptr) {
+		fprintf(stderr, "Trailing chars %s!\n", endptr);
+		exit(EXIT_FAILURE);
+	}
+	eval_expr(expr);
+	if (thread.error != ERR_NONE) {
+		fprintf(stderr, "Lisp evaluation failed: %s\n", src);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Evaluate a string of lisp code and assert that it prints as expected.
+ */
+void lisp_assert_prints(const char *src, const char *expected) {
+	const char *endptr;
+	struct expr *expr = read_expr(src, &endptr);
+	struct expr *result;
+	if (*endptr) {
+		fprintf(stderr, "Trailing chars %s!\n", endptr);
+		exit(EXIT_FAILURE);
+	}
+	result = eval_expr(expr);
+	thread.out.len = 0;
+	print_buffer(result, &thread.out);
+	if (strcmp(thread.out.data, expected)) {
+		fprintf(stderr, "Lisp assertion failed: %s printed %s, expected %s\n",
+			src, thread.out.data, expected);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Write a file for the tests, with the given modification time.
+ */
+void write_test_file(const char *path, const char *text, time_t mtime) {
+	struct utimbuf times;
+	FILE *f = fopen(path, "w");
+	if (!f || fputs(text, f) < 0 || fclose(f)) {
+		fprintf(stderr, "Could not write %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	times.actime = mtime;
+	times.modtime = mtime;
+	utime(path, &times);
+}
+
+/* Write lines with a null character to a pipe, which is read without
+ * mapping it.
+ */
+void *write_test_fifo(void *arg) {
+	static const char text[] = "\0null\nnext\n";
+	FILE *f = fopen(arg, "w");
+	if (!f || fwrite(text, 1, sizeof text - 1, f) != sizeof text - 1
+	    || fclose(f)) {
+		fprintf(stderr, "Could not write %s\n", (const char *) arg);
+		exit(EXIT_FAILURE);
+	}
+	return NULL;
+}
+
+#define TEST_SYMBOLS 20000
+#define TEST_SYMBOL_THREADS 4
+
+/* Symbols saved by each thread of the symbol table test. */
+static const char *saved[TEST_SYMBOL_THREADS][TEST_SYMBOLS];
+
+/* Save the same names as the other threads, starting at a different one.
+ */
+void *save_symbols(void *arg) {
+	long t = (long) arg;
+	char name[SYMBOL_MAXLEN];
+	long i;
+	for (i = 0; i < TEST_SYMBOLS; ++i) {
+		long j = (i + t * TEST_SYMBOLS / TEST_SYMBOL_THREADS) % TEST_SYMBOLS;
+		sprintf(name, "symbol-%ld", j);
+		saved[t][j] = save_symbol(name);
+	}
+	return NULL;
+}
+
+/* Evaluate a string of lisp code and assert that it fails with the
+ * expected error, which is then cleared.
+ */
+void lisp_assert_error(const char *src, enum error expected) {
+	const char *endptr;
+	struct expr *expr = read_expr(src, &endptr);
+	if (*endptr) {
+		fprintf(stderr, "Trailing chars %s!\n", endptr);
+		exit(EXIT_FAILURE);
+	}
+	eval_expr(expr);
+	if (thread.error != expected) {
+		fprintf(stderr, "Lisp assertion failed: %s did not fail as expected\n",
+			src);
+		exit(EXIT_FAILURE);
+	}
+	thread.error = ERR_NONE;
+}
+
+/* Evaluate a string of lisp code in a region, asserting that it is true
+ * unless it is a definition.
+ */
+void lisp_assert_region(const char *src) {
+	region_begin();
+	if (!strncmp(src, "(define ", 8)) {
+		lisp_run(src);
+	} else {
+		lisp_assert(src);
+	}
+	region_end(NULL);
+}
+
 int main(int argc, char **argv) {
 	if (argc > 1) {
 		fprintf(stderr, "No args expected, got: %s ...", argv[0]);
@@ -39,8 +163,14 @@ int main(int argc, char **argv) {
 	lisp_assert("(= 3 (abs -3))");
 	lisp_assert("(< (abs (- (/ 22 7) pi)) 0.01)");
 
+	/* reading */
+	lisp_assert("(= 1.5e3 1500)");
+	lisp_assert("(= -0.25 (- 0 (/ 1 4)))");
+	lisp_assert("(= 12345678901234567890 (* 1234567890123456789 10))");
+
 	/* equality */
-	/* lisp_assert("(equal (quote test) (quote test))");*/
+	lisp_assert("(equal (quote test) (quote test))");
+	lisp_assert("(equal \"test\" \"test\")");
 	lisp_assert("(equal (list 1 3 3 7) (list 1 3 3 7))");
 	lisp_assert("(not (equal (list 1 3 3 7) (list 1 3 3 8)))");
 
@@ -49,6 +179,520 @@ int main(int argc, char **argv) {
 	lisp_assert("(equal (map (lambda (x) (* x x)) (list 1 2 3 4)) (list 1 4 9 16))");
 	lisp_assert("(not (and true true false))");
 	lisp_assert("(or true false true)");
+	lisp_assert("(= 6 (apply + (list 1 2 3)))");
+	lisp_assert("(equal ((lambda args args) 1 2 3) (list 1 2 3))");
+
+	/* hash-consing */
+	lisp_assert("(eq (read-data \"(1 (2 x))\") (read-data \"(1 (2 x))\"))");
+	lisp_assert("(eq (hash-cons (list \"s\" 1)) (hash-cons (list \"s\" 1)))");
+	lisp_assert("(eq (hash-cons (list 1 2)) (read-data \"(1 2)\"))");
+	lisp_assert("(not (equal (read-data \"(1 2)\") (read-data \"(1 3)\")))");
+	lisp_assert("(equal (read-data \"(1 2)\") (list 1 2))");
+	lisp_assert("(equal (hash-cons (list 0 (- 0))) (list 0 0))");
+	lisp_run("(hash-quotes true)");
+	lisp_assert("(eq (quote (a (b c))) (quote (a (b c))))");
+	lisp_run("(hash-quotes false)");
+	lisp_assert("(not (eq (quote (a b)) (quote (a b))))");
+
+	/* deep recursion and continuations */
+	lisp_run("(define range (lambda (n acc) (if (= n 0) acc (range (- n 1) (cons n acc)))))");
+	lisp_assert("(eq (length (range 50000 ())) 50000)");
+	lisp_assert("(member 50000 (range 50000 ()))");
+	/* substituting a later parameter does not walk a long argument */
+	lisp_run("(define big (range 1000000 ()))");
+	lisp_run("(define first-length (lambda (a b) (+ b (length a))))");
+	lisp_assert("(= (first-length big 1) 1000001)");
+	lisp_assert("(= 42 (call/cc (lambda (k) (+ 1 (k 42)))))");
+	lisp_assert("(= 3 (+ 1 (call/cc (lambda (k) 2))))");
+	lisp_assert("(= 6 (+ 1 (call/cc (lambda (k) (k 2))) 3))");
+	lisp_assert_prints("(list 1 (list 2 (list 3 (list 4))))", "(1 (2 (3 (4))))");
+
+	/* compiled lambdas */
+	lisp_run("(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))");
+	lisp_assert("(= (fib 20) 6765)");
+	lisp_run("(jit false)");
+	lisp_assert("(= (fib 12) 144)");
+	lisp_run("(jit true)");
+	lisp_run("(define loop (lambda (n) (if (< n 1) (- n) (loop (- n 1)))))");
+	lisp_assert("(= (loop 500) 0)");
+	lisp_run("(define old-loop loop)");
+	lisp_run("(define loop (lambda (n) 7))");
+	lisp_assert("(= (old-loop 500) 7)");
+
+	/* limits */
+	globals.limits.fuel = 100000;
+	lisp_run("(define spin (lambda (n) (spin (+ n 1))))");
+	lisp_assert_error("(spin 0)", ERR_FUEL);
+	lisp_run("(define spin (lambda (s) (spin s)))");
+	lisp_assert_error("(spin \"s\")", ERR_FUEL);
+	globals.limits.fuel = 0;
+	globals.limits.heap = 1 << 20;
+	lisp_run("(define grow (lambda (l) (grow (cons 1 l))))");
+	lisp_assert_error("(grow ())", ERR_MEMORY);
+	globals.limits.heap = 0;
+	globals.limits.depth = 1000;
+	lisp_run("(define deep (lambda (s) (cons s (deep s))))");
+	lisp_assert_error("(deep \"s\")", ERR_DEPTH);
+	globals.limits.depth = 0;
+	lisp_assert("(= (fib 10) 55)");
+
+	/* embedding */
+	{
+		lisp_value *args[2];
+		lisp_value *add = lisp_lookup("+");
+		lisp_value *rule;
+		lisp_value *low;
+		lisp_value *high;
+		lisp_value *result;
+		args[0] = lisp_number(40);
+		args[1] = lisp_number(2);
+		result = lisp_call(add, 2, args);
+		if (lisp_error() != LISP_OK || lisp_number_value(result) != 42) {
+			fprintf(stderr, "Embedded call of + failed\n");
+			exit(EXIT_FAILURE);
+		}
+		lisp_release(result);
+		lisp_release(lisp_eval("(define rule (lambda (x tags) (if (< x 10) (car tags) (cdr tags))))"));
+		rule = lisp_lookup("rule");
+		lisp_release(args[1]);
+		low = lisp_string("low");
+		high = lisp_string("high");
+		args[1] = lisp_cons(low, high);
+		lisp_release(low);
+		lisp_release(high);
+		result = lisp_call(rule, 2, args);
+		if (lisp_error() != LISP_OK
+		    || strcmp(lisp_string_value(result), "high")) {
+			fprintf(stderr, "Embedded call of rule failed\n");
+			exit(EXIT_FAILURE);
+		}
+		lisp_release(result);
+		result = lisp_call(rule, 1, args);
+		if (lisp_error() != LISP_ERR_USER || result) {
+			fprintf(stderr, "Embedded call with wrong arity did not fail\n");
+			exit(EXIT_FAILURE);
+		}
+		lisp_release(args[0]);
+		lisp_release(args[1]);
+		lisp_release(rule);
+		lisp_release(add);
+		thread.error = ERR_NONE;
+	}
+
+	/* modules */
+	lisp_assert("(equal 'a (quote a))");
+	lisp_assert("(equal '(1 'b) (list 1 (list (quote quote) (quote b))))");
+	write_test_file("testmod.lisp",
+			"(define x 1)\n(define f (lambda (y) (+ x y)))\n", 1000);
+	lisp_run("(require 'testmod)");
+	lisp_assert("(= (testmod/f 2) 3)");
+	lisp_assert_error("x", ERR_USER);
+	/* same size and time, so the cache is used */
+	write_test_file("testmod.lisp",
+			"(define x 2)\n(define f (lambda (y) (+ x y)))\n", 1000);
+	globals.modules = NULL;
+	lisp_run("(require 'testmod)");
+	lisp_assert("(= (testmod/f 2) 3)");
+	write_test_file("testmod.lisp",
+			"(define x 2)\n(define f (lambda (y) (+ x y)))\n", 2000);
+	globals.modules = NULL;
+	lisp_run("(require 'testmod)");
+	lisp_assert("(= (testmod/f 2) 4)");
+	lisp_assert_error("(require 'no-such-module)", ERR_USER);
+	remove("testmod.lisp");
+	remove("testmod.lispc");
+
+	/* streams */
+	lisp_run("(define p (delay (list 1 2)))");
+	lisp_assert("(equal (force p) (list 1 2))");
+	lisp_assert("(eq (force p) (force p))");
+	lisp_assert("(= (force 5) 5)");
+	lisp_run("(define ints (lambda (n) (cons n (delay (ints (+ n 1))))))");
+	lisp_assert("(= (stream-fold + 0 (stream-take 5 (ints 1))) 15)");
+	lisp_assert("(= (stream-fold + 0 (stream-take 3 (stream-filter (lambda (x) (< 10 x)) (stream-map (lambda (x) (* x x)) (ints 1))))) 77)");
+	lisp_assert("(= (stream-fold + 0 (stream-take 50000 (ints 1))) 1250025000)");
+	write_test_file("test-stream.txt", "1\n\n(2 3)\n4\n", 1000);
+	lisp_assert("(equal (stream-fold (lambda (acc x) (cons x acc)) () (stream-from-file \"test-stream.txt\")) (list 4 (list 2 3) 1))");
+	remove("test-stream.txt");
+	lisp_assert("(equal (append (list 1 2) (list 3)) (list 1 2 3))");
+
+	/* generators */
+	lisp_run("(define upto (lambda (n max) (if (< max n) () ((lambda (y) (upto (+ n 1) max)) (yield n)))))");
+	lisp_run("(define g (make-generator (lambda () (upto 1 3))))");
+	lisp_assert("(= (next g) 1)");
+	lisp_assert("(equal (list (next g) (next g) (next g) (next g)) (list 2 3 () ()))");
+	lisp_assert("(= (generator-fold + 0 (generator-map (lambda (x) (* x x)) (make-generator (lambda () (upto 1 4))))) 30)");
+	lisp_assert("(= (generator-fold + 0 (make-generator (lambda () (upto 1 100000)))) 5000050000)");
+	lisp_assert_error("(yield 1)", ERR_USER);
+	lisp_run("(define g (make-generator (lambda () (car 1))))");
+	lisp_assert_error("(next g)", ERR_USER);
+	lisp_assert("(null (next g))");
+
+	/* input */
+	write_test_file("test-lines.txt", "first\r\n\nsecond\nlast", 1000);
+	lisp_run("(define port (open-input-file \"test-lines.txt\"))");
+	lisp_assert("(equal (read-line port) \"first\")");
+	lisp_assert("(equal (read-lines port) (list \"\" \"second\" \"last\"))");
+	lisp_assert("(null (read-line port))");
+	lisp_run("(close-port port)");
+	lisp_assert_error("(read-line port)", ERR_USER);
+	lisp_run("(define line (read-line (open-input-file \"test-lines.txt\")))");
+	lisp_run("(for-each-line (open-input-file \"test-lines.txt\") (lambda (l) (define last-line l)))");
+	lisp_assert("(equal last-line \"last\")");
+	lisp_assert("(eq (hash-cons line) (hash-cons \"first\"))");
+	lisp_assert_prints("(list line)", "(\"first\")");
+	remove("test-lines.txt");
+	{
+		pthread_t writer;
+		if (mkfifo("test-fifo", 0600)
+		    || pthread_create(&writer, NULL, write_test_fifo, "test-fifo")) {
+			fprintf(stderr, "Could not make test-fifo\n");
+			exit(EXIT_FAILURE);
+		}
+		lisp_run("(define fifo-lines (read-lines (open-input-file \"test-fifo\")))");
+		pthread_join(writer, NULL);
+		lisp_assert("(= (length fifo-lines) 2)");
+		lisp_assert("(equal (car (cdr fifo-lines)) \"next\")");
+		remove("test-fifo");
+	}
+
+	/* futures */
+	lisp_assert("(= (touch (future (+ 1 2))) 3)");
+	lisp_assert("(= (touch 4) 4)");
+	lisp_run("(define pfib (lambda (n) (if (< n 10) (fib n) ((lambda (a b) (+ (touch a) b)) (future (pfib (- n 1))) (pfib (- n 2))))))");
+	lisp_assert("(= (pfib 16) 987)");
+	lisp_run("(workers 3)");
+	lisp_assert("(= (pfib 18) 2584)");
+	lisp_assert("(equal (map touch (map (lambda (x) (future (list x (* x x)))) (list 1 2 3))) (list (list 1 1) (list 2 4) (list 3 9)))");
+	lisp_run("(define f (future (car 1)))");
+	lisp_assert_error("(touch f)", ERR_USER);
+	lisp_assert_error("(touch f)", ERR_USER);
+	lisp_run("(workers 1)");
+	lisp_assert("(= (pfib 15) 610)");
+	lisp_run("(workers 0)");
+	lisp_assert_error("(workers -1)", ERR_USER);
+
+	/* symbols saved concurrently */
+	{
+		pthread_t threads[TEST_SYMBOL_THREADS];
+		char name[SYMBOL_MAXLEN];
+		long t;
+		long i;
+		for (t = 0; t < TEST_SYMBOL_THREADS; ++t) {
+			pthread_create(&threads[t], NULL, save_symbols, (void *) t);
+		}
+		for (t = 0; t < TEST_SYMBOL_THREADS; ++t) {
+			pthread_join(threads[t], NULL);
+		}
+		for (i = 0; i < TEST_SYMBOLS; ++i) {
+			sprintf(name, "symbol-%ld", i);
+			for (t = 0; t < TEST_SYMBOL_THREADS; ++t) {
+				if (saved[t][i] != save_symbol(name)) {
+					fprintf(stderr, "Symbol %s was saved twice\n", name);
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+	lisp_assert("(equal (quote symbol-42) (car (read-data \"(symbol-42)\")))");
+
+	/* memoization */
+	lisp_run("(define mfib (memoize (lambda (n) (if (< n 2) n (+ (mfib (- n 1)) (mfib (- n 2)))))))");
+	lisp_assert("(= (mfib 80) 23416728348467685)");
+	lisp_assert("(equal (memo-stats mfib) (list 78 81 81))");
+	lisp_run("(define mlen (memoize length))");
+	lisp_assert("(= (mlen (list 1 (list 2 \"x\") 0)) 3)");
+	lisp_assert("(= (mlen (list 1 (list 2 \"x\") -0)) 3)");
+	lisp_assert("(equal (memo-stats mlen) (list 1 1 1))");
+	lisp_run("(define sq (memoize (lambda (x) (* x x)) 2))");
+	lisp_assert("(equal (list (sq 1) (sq 2) (sq 1) (sq 3) (sq 2) (sq 1)) (list 1 4 1 9 4 1))");
+	lisp_assert("(equal (memo-stats sq) (list 1 5 2))");
+	lisp_assert_error("(memoize sq 0)", ERR_USER);
+	lisp_run("(define mg (memoize (lambda (x) ((lambda (y) (* x 10)) (yield x)))))");
+	lisp_run("(define g3 (make-generator (lambda () (list (mg 3) (mg 3)))))");
+	lisp_assert("(= (next g3) 3)");
+	lisp_assert("(equal (list 1 (next g3)) (list 1 ()))");
+	lisp_assert("(equal (memo-stats mg) (list 1 1 1))");
+
+	/* fusing list functions */
+	lisp_assert("(equal (map (lambda (x) (* x x)) (filter (lambda (x) (< x 3)) (list 1 2 3 4))) (list 1 4))");
+	lisp_assert("(equal (filter (lambda (x) (< 1 x)) (map abs (list -1 2 -3))) (list 2 3))");
+	lisp_assert("(= (apply + (map (lambda (x) (* 2 x)) (map abs (list 1 -2 3)))) 12)");
+	lisp_assert("(= (fold (lambda (acc x) (- acc x)) 10 (map abs (list -1 -2))) 7)");
+	lisp_assert("(= (length (filter (lambda (x) (< 2 x)) (list 1 2 3 4 5))) 3)");
+	lisp_assert("(= (length (list 1 2 3)) 3)");
+	lisp_assert("(= (length ()) 0)");
+	lisp_assert_error("(apply + (map car (list (list 1) (list \"x\"))))", ERR_USER);
+	lisp_assert_error("(map abs (map abs (cons 1 2)))", ERR_USER);
+	lisp_assert_error("(length (filter abs (list 1)))", ERR_USER);
+	/* continuations and yields leave a chain as without fusion */
+	lisp_assert("(= (call/cc (lambda (k) (map (lambda (x) (if (= x 20) (k 99) x)) (map (lambda (y) (* y 10)) (list 1 2 3))))) 99)");
+	lisp_run("(define fused-g (make-generator (lambda () (map (lambda (x) (yield x)) (map (lambda (y) (* y 10)) (list 1 2 3))))))");
+	lisp_assert("(= (next fused-g) 10)");
+	lisp_assert("(= (next fused-g) 20)");
+	lisp_run("(define old-map map)");
+	lisp_run("(define map (lambda (f lst) lst))");
+	lisp_assert("(equal (map abs (map abs (list -1))) (list -1))");
+	lisp_run("(define map old-map)");
+	{
+		size_t fused;
+		size_t heap = thread.heap;
+		lisp_run("(apply + (map abs (map abs (list -1 2 -3 4))))");
+		fused = thread.heap - heap;
+		lisp_run("(fuse false)");
+		heap = thread.heap;
+		lisp_run("(apply + (map abs (map abs (list -1 2 -3 4))))");
+		lisp_run("(fuse true)");
+		if (thread.heap - heap < fused + 8 * sizeof (struct expr)) {
+			fprintf(stderr, "Fused lists were allocated\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* recomputing dependent definitions */
+	lisp_run("(define scale (lambda (x) (* 2 x)))");
+	lisp_run("(define base (+ 1 2))");
+	lisp_run("(define scaled (scale base))");
+	lisp_run("(define scaled-more (+ scaled 1))");
+	lisp_run("(define unrelated (+ 1 1))");
+	lisp_assert("(= scaled-more 7)");
+	lisp_run("(define scale (lambda (x) (car x)))");
+	lisp_assert("(= unrelated 2)");
+	lisp_assert_error("scaled-more", ERR_USER);
+	lisp_run("(define scale (lambda (x) (* 10 x)))");
+	lisp_assert("(= scaled-more 31)");
+	lisp_run("(define base (+ 2 2))");
+	lisp_assert("(= scaled 40)");
+	lisp_run("(define saved-scale scale)");
+	lisp_run("(define scale (lambda (x) x))");
+	lisp_assert("(= (saved-scale 1) 10)");
+	lisp_assert("(= scaled-more 5)");
+	lisp_run("(define count (+ 0 1))");
+	lisp_run("(define count (+ count 1))");
+	lisp_assert("(= count 2)");
+	lisp_run("(define cycle-n 1)");
+	lisp_run("(define cycle-m (+ cycle-n 1))");
+	lisp_run("(define cycle-n (+ cycle-m 1))");
+	lisp_assert("(equal (list cycle-n cycle-m) (list 3 4))");
+	lisp_assert("(equal (list cycle-n cycle-m) (list 3 4))");
+
+	/* allocating evaluations in regions */
+	globals.regions = 1;
+	lisp_assert_region("(define region-list (map (lambda (x) (* x x)) (list 1 2 3)))");
+	lisp_assert_region("(= (apply + region-list) 14)");
+	lisp_assert_region("(define region-square (lambda (x) (* x x)))");
+	lisp_assert_region("(= (fold (lambda (acc x) (+ acc (region-square x))) 0 (range 200 ())) 2686700)");
+	lisp_assert_region("(= (region-square 4) 16)");
+	{
+		size_t heap = thread.heap;
+		lisp_assert_region("(define region-text \"text\")");
+		if (thread.heap - heap != sizeof (struct expr) + 5) {
+			fprintf(stderr, "Promoted string was not charged\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	lisp_assert_region("(equal region-text \"text\")");
+	lisp_assert_region("(define region-p (delay (list 1 2)))");
+	lisp_assert_region("(equal (force region-p) (list 1 2))");
+	lisp_assert_region("(eq (force region-p) (force region-p))");
+	lisp_assert_region("(define region-g (make-generator (lambda () (upto 1 3))))");
+	lisp_assert_region("(= (next region-g) 1)");
+	lisp_assert_region("(= (next region-g) 2)");
+	lisp_assert_region("(equal (list (next region-g) (next region-g)) (list 3 ()))");
+	lisp_assert_region("(= 42 (call/cc (lambda (k) (+ 1 (k 42)))))");
+	lisp_assert_region("(eq (hash-cons (list 1 2)) (hash-cons (list 1 2)))");
+	{
+		const char *endptr;
+		struct expr *r;
+		size_t heap;
+		int i;
+		region_begin();
+		r = region_end(eval_expr(read_expr("(map (lambda (x) (* 2 x)) (list 1 2 3))", &endptr)));
+		heap = thread.heap;
+		for (i = 0; i < 10; ++i) {
+			lisp_assert_region("(= (length (map (lambda (x) (+ x 1)) (range 1000 ()))) 1000)");
+		}
+		if (thread.heap != heap) {
+			fprintf(stderr, "Heap grew by %lu bytes in regions\n",
+				(unsigned long) (thread.heap - heap));
+			exit(EXIT_FAILURE);
+		}
+		thread.out.len = 0;
+		print_buffer(r, &thread.out);
+		if (strcmp(thread.out.data, "(2 4 6)")) {
+			fprintf(stderr, "Result of a region was not kept\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	globals.regions = 0;
+
+	/* foreign functions */
+	lisp_run("(define libm (ffi-load \"libm.so.6\"))");
+	lisp_run("(define libc (ffi-load \"libc.so.6\"))");
+	lisp_run("(define c-pow (ffi-func libm \"pow\" '(double double) 'double))");
+	lisp_assert("(= (c-pow 2 10) 1024)");
+	lisp_assert_prints("c-pow", "[foreign pow]");
+	lisp_run("(define c-ldexp (ffi-func libm \"ldexp\" '(double int) 'double))");
+	lisp_assert("(= (c-ldexp 3 2) 12)");
+	lisp_run("(define c-abs (ffi-func libc \"labs\" '(long) 'long))");
+	lisp_assert("(= (c-abs -3) 3)");
+	lisp_run("(define c-strlen (ffi-func libc \"strlen\" '(string) 'long))");
+	lisp_assert("(= (c-strlen \"hello\") 5)");
+	lisp_run("(define c-modf (ffi-func libm \"modf\" '(double f64) 'double))");
+	lisp_run("(define parts (make-f64 1))");
+	lisp_assert("(= (c-modf 2.5 parts) 0.5)");
+	lisp_assert("(= (f64-ref parts 0) 2)");
+	lisp_assert("(= (f64-length (make-f64 3 1.5)) 3)");
+	lisp_assert("(= (f64-ref (make-f64 3 1.5) 2) 1.5)");
+	lisp_assert("(= (f64-set parts 0 7) (f64-ref parts 0))");
+	lisp_assert_error("(f64-ref parts 1)", ERR_USER);
+	lisp_assert_error("(c-pow 1)", ERR_USER);
+	lisp_assert_error("(c-pow \"1\" 2)", ERR_USER);
+	lisp_assert_error("(ffi-load \"no-such-library.so\")", ERR_USER);
+	lisp_assert_error("(ffi-func libm \"no_such_function\" () 'void)", ERR_USER);
+	lisp_assert_error("(ffi-func libm \"pow\" '(float) 'double)", ERR_USER);
+	lisp_assert_error("(libm)", ERR_USER);
+	lisp_assert_prints("(ffi-func libc \"pthread_mutexattr_setprioceiling\" '(long long) 'int)",
+			   "[foreign pthread_mutexattr_setprioceiling]");
+
+	/* measurement */
+	lisp_assert("(= (perf-stat (fib 10)) 55)");
+
+	/* tracing */
+	lisp_run("(define count-down (lambda (n) (if (< n 1) 0 (count-down (- n 1)))))");
+	lisp_run("(trace true)");
+	globals.limits.depth = 100;
+	lisp_assert("(= (count-down 1000) 0)");
+	globals.limits.depth = 0;
+	lisp_assert_error("(count-down (car 1))", ERR_USER);
+	lisp_run("(trace false)");
+	lisp_run("(trace-dump \"test-trace.json\")");
+	{
+		static char text[1 << 20];
+		FILE *f = fopen("test-trace.json", "r");
+		size_t len = f ? fread(text, 1, sizeof text - 1, f) : 0;
+		text[len] = '\0';
+		if (!f || strncmp(text, "{\"traceEvents\":[\n", 16)
+		    || !strstr(text, "{\"name\":\"count-down\",\"ph\":\"B\"")
+		    || !strstr(text, "{\"name\":\"count-down\",\"ph\":\"E\"")) {
+			fprintf(stderr, "Trace was not written as expected\n");
+			exit(EXIT_FAILURE);
+		}
+		fclose(f);
+	}
+	remove("test-trace.json");
+
+	/* sampling profiler */
+	lisp_run("(jit false)");
+	lisp_run("(define spin (lambda (n) (if (< n 1) 0 (spin (- n 1)))))");
+	lisp_run("(define spin-twice (lambda (n) (+ (spin n) (spin n))))");
+	if (profile_start(1000, PROFILE_BUFFER)) {
+		fprintf(stderr, "Profiler was not started\n");
+		exit(EXIT_FAILURE);
+	}
+	{
+		clock_t start = clock();
+		while (clock() - start < CLOCKS_PER_SEC / 5) {
+			lisp_assert("(= (spin-twice 2000) 0)");
+		}
+	}
+	if (profile_stop("test-profile.folded")) {
+		fprintf(stderr, "Profile was not written\n");
+		exit(EXIT_FAILURE);
+	}
+	{
+		static char text[1 << 16];
+		FILE *f = fopen("test-profile.folded", "r");
+		size_t len = f ? fread(text, 1, sizeof text - 1, f) : 0;
+		text[len] = '\0';
+		if (!f || !strstr(text, "spin-twice;spin ")) {
+			fprintf(stderr, "Profile was not written as expected\n");
+			exit(EXIT_FAILURE);
+		}
+		fclose(f);
+	}
+	remove("test-profile.folded");
+	/* a full buffer only keeps complete samples */
+	if (profile_start(1000, 64)) {
+		fprintf(stderr, "Profiler was not started\n");
+		exit(EXIT_FAILURE);
+	}
+	{
+		clock_t start = clock();
+		while (clock() - start < CLOCKS_PER_SEC / 5) {
+			lisp_assert("(= (spin-twice 2000) 0)");
+		}
+	}
+	if (profile_stop("test-profile.folded")) {
+		fprintf(stderr, "Profile was not written\n");
+		exit(EXIT_FAILURE);
+	}
+	{
+		char line[256];
+		unsigned long count = 0;
+		FILE *f = fopen("test-profile.folded", "r");
+		while (f && fgets(line, sizeof line, f)) {
+			char *space = strrchr(line, ' ');
+			char *name;
+			if (!space) {
+				fprintf(stderr, "Profile line has no count: %s", line);
+				exit(EXIT_FAILURE);
+			}
+			count += strtoul(space + 1, NULL, 10);
+			*space = '\0';
+			for (name = strtok(line, ";"); name; name = strtok(NULL, ";")) {
+				if (strcmp(name, "spin-twice") && strcmp(name, "spin")
+				    && strcmp(name, "[toplevel]")) {
+					fprintf(stderr, "Profile has unknown name %s\n", name);
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+		if (!f || count == 0 || count > 32) {
+			fprintf(stderr, "Profile kept %lu samples\n", count);
+			exit(EXIT_FAILURE);
+		}
+		fclose(f);
+	}
+	remove("test-profile.folded");
+	lisp_run("(jit true)");
+
+	/* compiling to C */
+	{
+		static char text[1 << 16];
+		FILE *f = fopen("test-compile.lisp", "w");
+		size_t len;
+		fputs("(define loop (lambda (n) (if (< n 1) n (loop (- n 1)))))\n"
+		      "(define twice (lambda (n) (+ (loop n) (loop n))))\n"
+		      "(twice 3)\n", f);
+		fclose(f);
+		if (compile_file("test-compile.lisp", "test-compile.c")) {
+			fprintf(stderr, "Compiling failed\n");
+			exit(EXIT_FAILURE);
+		}
+		f = fopen("test-compile.c", "r");
+		len = f ? fread(text, 1, sizeof text - 1, f) : 0;
+		text[len] = '\0';
+		if (!f || !strstr(text, "static struct expr *f_loop(struct expr *t0)\n")
+		    || !strstr(text, "goto start;")
+		    || !strstr(text, " = f_loop(t0);")
+		    || !strstr(text, "create_builtin(\"twice\", bi_f_twice, SF_NONE);")
+		    || !strstr(text, "compiled_run(\"(twice 3)\");")) {
+			fprintf(stderr, "Compiled code was not written as expected\n");
+			exit(EXIT_FAILURE);
+		}
+		fclose(f);
+	}
+	remove("test-compile.lisp");
+	remove("test-compile.c");
+
+	/* printing */
+	lisp_assert_prints("(list 1 (list 2.5 (quote a)) (cons 1 2))",
+			   "(1 (2.5 a) (1 . 2))");
+	lisp_assert_prints("(/ 1 3)", "0.3333333333333333");
+	lisp_assert_prints("(* 1e21 -1)", "-1e+21");
+	lisp_assert_prints("(to-string (list 0.1 ()))", "\"(0.1 ())\"");
+	lisp_assert_prints("(lambda (x) x)", "(lambda (x) x)");
 
 	printf("All tests succeeded!\n");
 	return 0;
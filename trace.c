@@ -0,0 +1,125 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "lisp.h"
+
+/* A tracer recording events of the evaluation while (trace true) is in
+ * effect, which trace-dump exports in the trace event format of Chrome
+ * and Perfetto.
+ *
+ * Every thread writes fixed-size events with nanosecond timestamps into
+ * its own ring buffer, which keeps the last TRACE_EVENTS events, without
+ * any locking or formatting. Function calls are recorded as enter and
+ * exit events, see F_TRACE in eval_expr, and the heap size is recorded
+ * whenever a thread takes a new chunk of expressions.
+ */
+
+/* All ring buffers, for trace-dump. */
+static struct trace_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the time of the first event, which the exported times count from */
+static unsigned long start_time;
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Record an event in the ring buffer of the current thread.
+ */
+void trace_event(enum trace_type type, const char *name, size_t value)
+{
+	struct trace_ring *ring = thread.trace;
+	struct trace_event *ev;
+	if (!ring) {
+		ring = malloc(sizeof *ring);
+		ring->tid = thread.id;
+		ring->count = 0;
+		pthread_mutex_lock(&rings_lock);
+		if (!rings) {
+			start_time = now_ns();
+		}
+		ring->next = rings;
+		rings = ring;
+		pthread_mutex_unlock(&rings_lock);
+		thread.trace = ring;
+	}
+	ev = &ring->events[ring->count++ & (TRACE_EVENTS - 1)];
+	ev->time = now_ns();
+	ev->name = name;
+	ev->value = value;
+	ev->type = type;
+}
+
+/* Write a string as a JSON string.
+ */
+static void write_json_string(FILE *f, const char *s)
+{
+	putc('"', f);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\') {
+			putc('\\', f);
+		}
+		putc(*s, f);
+	}
+	putc('"', f);
+}
+
+/* Write the events of all threads to a file as a JSON trace. Events of
+ * threads that are running meanwhile may be missing.
+ */
+static int dump_trace(const char *path)
+{
+	struct trace_ring *ring;
+	int first = 1;
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		return 1;
+	}
+	fputs("{\"traceEvents\":[\n", f);
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring; ring = ring->next) {
+		unsigned long i = ring->count > TRACE_EVENTS
+			? ring->count - TRACE_EVENTS : 0;
+		for (; i < ring->count; ++i) {
+			struct trace_event *ev = &ring->events[i & (TRACE_EVENTS - 1)];
+			unsigned long t = ev->time - start_time;
+			if (!first) {
+				fputs(",\n", f);
+			}
+			first = 0;
+			fputs("{\"name\":", f);
+			write_json_string(f, ev->name);
+			fprintf(f, ",\"ph\":\"%s\",\"ts\":%lu.%03lu,\"pid\":1,\"tid\":%u",
+				ev->type == TE_ENTER ? "B" : ev->type == TE_EXIT ? "E" : "C",
+				t / 1000, t % 1000, ring->tid);
+			if (ev->type == TE_HEAP) {
+				fprintf(f, ",\"args\":{\"bytes\":%lu}", (unsigned long) ev->value);
+			}
+			putc('}', f);
+		}
+	}
+	pthread_mutex_unlock(&rings_lock);
+	fputs("\n]}\n", f);
+	return fclose(f) != 0;
+}
+
+struct expr *bi_trace_dump(unsigned int argc, struct expr **argv)
+{
+	const char *path;
+	if (check_arg_count(argc, 1) || check_type(argv[0], T_STRING)) {
+		return NULL;
+	}
+	path = string_text(argv[0]);
+	if (dump_trace(path)) {
+		fprintf(stderr, "Can not write trace to %s!\n", path);
+		thread.error = ERR_USER;
+	}
+	return NULL;
+}